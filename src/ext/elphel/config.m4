@@ -62,5 +62,9 @@ PHP_ADD_INCLUDE($UAPI_DIR)
   dnl
   dnl PHP_SUBST(ELPHEL_SHARED_LIBADD)
 
+  dnl # native autoexposure runs in a thread (elphel_autoexp_start())
+  PHP_ADD_LIBRARY(pthread, 1, ELPHEL_SHARED_LIBADD)
+  PHP_SUBST(ELPHEL_SHARED_LIBADD)
+
   PHP_NEW_EXTENSION(elphel, elphel_php.c, $ext_shared)
 fi
@@ -198,6 +198,9 @@
  */
 
 #define DELAY_HISTOGRAMS_INIT 1
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1 /// O_DIRECT
+#endif
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -206,12 +209,24 @@
 
 #include <sys/mman.h>		/* mmap */
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>   /* struct iovec */
+#include <time.h>      /* clock_gettime */
 #include <fcntl.h>     /* (O_RDWR) */
 #include <asm/byteorder.h>
 #include <errno.h>
+#include <limits.h>    /* LONG_MAX */
+#include <math.h>      /* isfinite */
+#include <stdarg.h>
+#include <pthread.h>   /* autoexposure thread */
+#include <sys/file.h>  /* flock */
 #include "php.h"
+#ifdef ZTS /// defined in php_config.h (included by php.h)
+#error "elphel_autoexp_* threads use the module globals directly, ZTS builds are not supported"
+#endif
 #include "php_ini.h"  /* for php.ini processing */
 #include "ext/standard/info.h" /* for php_info_print_table_* */
+#include "SAPI.h"     /* for sapi_add_header(), sapi_flush() */
 #include "elphel_php.h"
 
 
@@ -231,6 +246,8 @@ static zend_function_entry elphel_functions[] = {
         PHP_FE(elphel_get_P_arr, NULL)
         PHP_FE(elphel_set_P_arr, NULL)
         PHP_FE(elphel_gamma_add, NULL)
+        PHP_FE(elphel_gamma_add_batch, NULL)
+        PHP_FE(elphel_gamma_calc, NULL)
         PHP_FE(elphel_gamma_add_custom, NULL)
         PHP_FE(elphel_gamma_get, NULL)
         PHP_FE(elphel_gamma_get_index, NULL)
@@ -247,17 +264,44 @@ static zend_function_entry elphel_functions[] = {
         PHP_FE(elphel_reset_sensor, NULL)
         PHP_FE(elphel_set_fpga_time, NULL)
         PHP_FE(elphel_get_fpga_time, NULL)
+        PHP_FE(elphel_fpga_time_now, NULL)
+        PHP_FE(elphel_fpga_to_host, NULL)
         PHP_FE(elphel_wait_frame, NULL)
+        PHP_FE(elphel_record, NULL)
+        PHP_FE(elphel_mjpeg_stream, NULL)
+        PHP_FE(elphel_metalog_open, NULL)
+        PHP_FE(elphel_metalog_update, NULL)
+        PHP_FE(elphel_metalog_close, NULL)
+        PHP_FE(elphel_metalog_query, NULL)
         PHP_FE(elphel_fpga_read, NULL)
         PHP_FE(elphel_fpga_write, NULL)
+        PHP_FE(elphel_fpga_read_block, NULL)
+        PHP_FE(elphel_fpga_write_vec, NULL)
         PHP_FE(elphel_gamma, NULL)
+        PHP_FE(elphel_gamma_array, NULL)
         PHP_FE(elphel_reverse_gamma, NULL)
         PHP_FE(elphel_histogram, NULL)
         PHP_FE(elphel_reverse_histogram, NULL)
+        PHP_FE(elphel_histogram_query, NULL)
+        PHP_FE(elphel_histogram_stats, NULL)
+        PHP_FE(elphel_autoexp_start, NULL)
+        PHP_FE(elphel_autoexp_stop, NULL)
+        PHP_FE(elphel_autoexp_log, NULL)
+        PHP_FE(elphel_histogram_aggregate_start, NULL)
+        PHP_FE(elphel_histogram_aggregate_stop, NULL)
+        PHP_FE(elphel_histogram_aggregate, NULL)
+        PHP_FE(elphel_histogram_aggregate_stats, NULL)
         PHP_FE(elphel_get_exif_field, NULL)
         PHP_FE(elphel_set_exif_field, NULL)
+        PHP_FE(elphel_set_exif_fields, NULL)
+        PHP_FE(elphel_get_exif_typed, NULL)
         PHP_FE(elphel_get_interframe_meta, NULL)
+        PHP_FE(elphel_get_interframe_meta_batch, NULL)
+        PHP_FE(elphel_get_synced_frames, NULL)
+        PHP_FE(elphel_circbuf_status, NULL)
         PHP_FE(elphel_get_exif_elphel, NULL)
+        PHP_FE(elphel_get_exif_batch, NULL)
+        PHP_FE(elphel_export_track, NULL)
         PHP_FE(elphel_update_exif, NULL)
         PHP_FE(elphel_get_circbuf_pointers, NULL)
         {NULL, NULL, NULL}
@@ -287,6 +331,10 @@ ZEND_GET_MODULE(elphel)
 
 PHP_INI_BEGIN()
 //! read ini entries here
+    STD_PHP_INI_ENTRY("elphel.preopen_ports", PREOPEN_PORTS_DEFAULT, PHP_INI_SYSTEM, OnUpdateString, preopen_ports, zend_elphel_globals, elphel_globals)
+    STD_PHP_INI_ENTRY("elphel.fpga_device", FPGA_DEVICE_DEFAULT, PHP_INI_SYSTEM, OnUpdateString, fpga_device, zend_elphel_globals, elphel_globals)
+    STD_PHP_INI_ENTRY("elphel.fpga_base",   FPGA_BASE_DEFAULT,   PHP_INI_SYSTEM, OnUpdateLong,   fpga_base,   zend_elphel_globals, elphel_globals)
+    STD_PHP_INI_ENTRY("elphel.fpga_size",   FPGA_SIZE_DEFAULT,   PHP_INI_SYSTEM, OnUpdateLong,   fpga_size,   zend_elphel_globals, elphel_globals)
 PHP_INI_END()
 
 
@@ -389,6 +437,7 @@ PHP_FUNCTION(elphel_get_frame)
         RETURN_NULL();
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     RETURN_LONG( ELPHEL_GLOBALPARS(port,G_THIS_FRAME));
 } 
 /// Get current compressed frame number
@@ -399,6 +448,7 @@ PHP_FUNCTION(elphel_get_compressed_frame)
         RETURN_NULL();
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     RETURN_LONG( ELPHEL_GLOBALPARS(port,G_COMPRESSOR_FRAME));
 }
 PHP_FUNCTION(elphel_skip_frames)
@@ -409,6 +459,7 @@ PHP_FUNCTION(elphel_skip_frames)
         RETURN_NULL();
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     long target_frame=lseek((int) ELPHEL_G( fd_fparmsall[port]), 0, SEEK_CUR )+skip;
     if ((target_frame<0) || (target_frame > 0x7ffffdff))
         RETURN_NULL(); /// Out of limit for skip frames
@@ -423,6 +474,7 @@ PHP_FUNCTION(elphel_wait_frame_abs)
         RETURN_NULL();
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     if ((target_frame<0) || (target_frame > 0x7ffffdff))
         RETURN_NULL(); /// Out of limit for skip frames
     RETURN_LONG(lseek((int) ELPHEL_G( fd_fparmsall[port]), target_frame + LSEEK_FRAME_WAIT_ABS, SEEK_END ));
@@ -505,6 +557,7 @@ PHP_FUNCTION(elphel_get_P_value)
         RETURN_NULL();
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     if (frame <0)
         frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME);
     addr = full_addr & 0xffff; /// remove any possible flags
@@ -560,7 +613,9 @@ PHP_FUNCTION(elphel_get_P_value)
 
 PHP_FUNCTION(elphel_test)
 {
-    long result= ELPHEL_GLOBALPARS(0, G_THIS_FRAME);
+    long result;
+    if (ELPHEL_NEED(0, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
+    result= ELPHEL_GLOBALPARS(0, G_THIS_FRAME);
     RETURN_LONG(result);
 } 
 
@@ -582,6 +637,7 @@ PHP_FUNCTION(elphel_get_state)
         RETURN_NULL();
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     frame16=ELPHEL_GLOBALPARS(port, G_THIS_FRAME) & PARS_FRAMES_MASK;
     compressor_state= ((struct framepars_t *) ELPHEL_G(framePars[port]))[frame16].pars[P_COMPRESSOR_RUN];
     sensor_state=     ((struct framepars_t *) ELPHEL_G(framePars[port]))[frame16].pars[P_SENSOR_RUN];
@@ -610,6 +666,7 @@ PHP_FUNCTION(elphel_framepars_get_raw)
     }
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     packed_framepars_structure= (char*) emalloc (sizeof (struct framepars_t));
     if (packed_framepars_structure) {
         /// use gamma_cache_index to retrieve table from cache
@@ -657,6 +714,7 @@ PHP_FUNCTION(elphel_get_P_arr)
     }
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     //    init_sens();
     /// first see if this frame is either in the future, past or is frame zero (parameters that are not related to frames)
     if (frame < 0) { /// frame number not provided - use latest
@@ -748,8 +806,9 @@ long elphel_set_P_value_common(long port, long addr, long data, long frame, long
     unsigned long uframe;
     long maddr;
     ///shortcut for global parameters - directly mmaped
-    if ((port < 0) || (port > SENSOR_PORTS))
+    if ((port < 0) || (port >= SENSOR_PORTS))
         return -1;
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) return -1;
     maddr=addr & 0xffff;
     if (( (addr & 0xff00) != 0xff00 ) && (maddr >= FRAMEPAR_GLOBALS)) { /// these globals can be written just through mmap
         if (maddr >= (FRAMEPAR_GLOBALS+P_MAX_GPAR)) {
@@ -874,6 +933,9 @@ PHP_FUNCTION(elphel_reset_sensor) {
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|l", &port,&broardcast) == FAILURE) {
         RETURN_NULL();
     }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     lseek((int) ELPHEL_G(fd_fparmsall[port]), LSEEK_FRAMEPARS_INIT, SEEK_END ); /// reset all framepars and globalPars
     elphel_set_P_value_common (port, P_SENSOR, 0, 0, -1, broardcast);
     RETURN_NULL();
@@ -912,6 +974,7 @@ PHP_FUNCTION(elphel_set_P_arr)
     }
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     if      (frame == -1)  uframe = ELPHEL_GLOBALPARS(port, G_THIS_FRAME) + FRAME_DEAFAULT_AHEAD; // old: use earliest frame
     else if (frame == -2)  uframe = 0xffffffffL; // (new nc393: use ASAP mode)
     else                   uframe = (unsigned long) frame;
@@ -1012,43 +1075,248 @@ int gamma_calc (double gamma, double black, unsigned short * gtable) {
 }
 
 /**
- * @brief Calculate new gamma table (specified by gamma value and black level) and put it into gamma cache
- * Gamma cache will be used to program gamma tables to FPGA, calculate derivative tables
- * Gamma tables should be loaded before used (gamma/black level/scale) specified as frame parameters 
- * gamma - floating point, <=1.0,  will be rounded to 0.01. Larger gammas are reseved for custom tables
- * black - floating point, <=1.0 or integer>1 (1..255) - level to subtract from sensor value
- * @return hash16 - ((gamma *100) & 0xff) | (((black * 256) 0xff) << 8)
+ * @brief Calculate gamma table (as array of 257 unsigned short values), same result as gamma_calc().
+ * pow() is replaced by vector (NEON/SSE through GCC vector extensions) log2/exp2 approximations with the error below
+ * 0.025 LSB, the few entries closer than GAMMA_ROUND_MARGIN to the rounding threshold are recalculated with pow()
+ * @param gamma - gamma value (1.0 - linear)
+ * @param black - black level, 1.0 corresponds to 256 for 8bit values
+ * @param gtable - gamma array reference (allocated by the caller)
+ * @return 0 - OK, <0 - error
  */
-PHP_FUNCTION(elphel_gamma_add)
-{
+int gamma_calc_vector (double gamma, double black, unsigned short * gtable) {
+    const gamma_v4si exp_mask=  {0x007fffff, 0x007fffff, 0x007fffff, 0x007fffff};
+    const gamma_v4si one_bits=  {0x3f800000, 0x3f800000, 0x3f800000, 0x3f800000};
+    const gamma_v4si magic_bits={0x4b400000, 0x4b400000, 0x4b400000, 0x4b400000};
+    const gamma_v4sf magic=     {12582912.0f, 12582912.0f, 12582912.0f, 12582912.0f}; /// 1.5 * 2^23 - float to int rounding
+    const gamma_v4sf sqrt2=     {M_SQRT2, M_SQRT2, M_SQRT2, M_SQRT2};
+    const gamma_v4sf one=       {1.0f, 1.0f, 1.0f, 1.0f};
+    const gamma_v4sf min_exp=   {-126.0f, -126.0f, -126.0f, -126.0f};
+    const gamma_v4sf zero=      {0.0f, 0.0f, 0.0f, 0.0f};
+    union {
+        gamma_v4sf v[(257 + GAMMA_VECTOR_LANES - 1) / GAMMA_VECTOR_LANES];
+        float      f[(257 + GAMMA_VECTOR_LANES - 1) / GAMMA_VECTOR_LANES * GAMMA_VECTOR_LANES];
+    } xy;
+    gamma_v4sf x, m, s, s2, l, t, n, f, y, vgamma;
+    gamma_v4si bits, e, mask;
+    double black256, k, v, xd;
+    int i, ig;
+    if (!gtable) return -1;
+    ///Same 0.13 <= gamma <= 10.0 limits for gamma as used earlier
+    if (gamma < 0.13) gamma=0.13;
+    if (gamma >10.0)  gamma=10.0;
+    black256=black*256.0;
+    k=1.0/(256.0-black256);
+    for (i=0; i < (int) (sizeof(xy.f)/sizeof(xy.f[0])); i++) xy.f[i]= (i < 257)? (k*(i-black256)) : 0.0f;
+    vgamma= zero + (float) gamma;
+    for (i=0; i < (int) (sizeof(xy.v)/sizeof(xy.v[0])); i++) {
+        x= xy.v[i];
+        /// log2(x)= e + log2(m), sqrt(0.5) <= m < sqrt(2)
+        bits= (gamma_v4si) x;
+        e= ((bits >> 23) & 0xff) - 127;
+        m= (gamma_v4sf) ((bits & exp_mask) | one_bits);
+        mask= (gamma_v4si) (m > sqrt2);
+        m= (gamma_v4sf) (((gamma_v4si) m) - (mask & 0x00800000)); /// m/2
+        e-= mask;
+        /// log2(m) = 2/ln(2) * atanh(s), s=(m-1)/(m+1), |s| < 0.172
+        s= (m - one) / (m + one);
+        s2= s * s;
+        l= ((gamma_v4sf) (e + magic_bits) - magic) +
+            s * (2.8853900817779268f + s2 * (0.9617966939259756f + s2 * (0.5770780163555854f + s2 * (0.4121985831111324f + s2 * 0.3205988979753252f))));
+        /// 2^(gamma*log2(x)) = 2^n * 2^f, -0.5 <= f <= 0.5
+        t= vgamma * l;
+        mask= (gamma_v4si) (t < min_exp);
+        t= (gamma_v4sf) ((mask & (gamma_v4si) min_exp) | (~mask & (gamma_v4si) t));
+        n= (t + magic) - magic;
+        f= t - n;
+        y= one + f * (0.6931471805599453f + f * (0.2402265069591007f + f * (0.05550410866482158f +
+                f * (0.009618129107628477f + f * (0.0013333558146428443f + f * 0.00015403530393381608f)))));
+        y*= (gamma_v4sf) ((((gamma_v4si) (n + magic)) - magic_bits + 127) << 23);
+        mask= (gamma_v4si) (x > zero);
+        xy.v[i]= (gamma_v4sf) (mask & (gamma_v4si) y);
+    }
+    for (i=0; i<257; i++) {
+        v= 0.5 + 65535.0 * xy.f[i];
+        ig= v;
+        /// too close to the rounding threshold for the approximation accuracy - use the same pow() as gamma_calc()
+        if (((v - ig) < GAMMA_ROUND_MARGIN) || ((v - ig) > (1.0 - GAMMA_ROUND_MARGIN))) {
+            xd= k*(i-black256);
+            if (xd < 0.0 ) xd=0.0;
+            ig= 0.5+65535.0*pow(xd,gamma);
+        }
+        if (ig > 0xffff) ig=0xffff;
+        gtable[i]=ig;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find gamma table (hash16/scale) in the driver gamma cache
+ * @param hash16 - unique ID of the table
+ * @param iscale - scale, GAMMA_SCLALE_1 (0x400) is 1.0
+ * @return <0 - -errno, 0 - not in cache, >0 - cache index
+ */
+long gamma_get_index (long hash16, long iscale) {
+    unsigned short data_to_write[3];
+    data_to_write[0]= iscale; /// 0..0xffff
+    data_to_write[1]= hash16;
+    ///- next 1 byte   [4]   - mode (1 - not_nice, 2 - need reverse, 4 - hardware)
+    ///- next 1 byte   [5]   - color - only if hardware bit in mode is set
+    data_to_write[2]=0;
+    if (write(ELPHEL_G(fd_gamma_cache), data_to_write, sizeof(data_to_write)) < 0) return -errno;
+    return lseek(ELPHEL_G(fd_gamma_cache), 0, SEEK_CUR);
+}
+
+/**
+ * @brief Get gamma table calculated by gamma_calc() for hash16 from the in-process memo, calculate and memoize it if missing.
+ * hash16 defines both gamma and black level (see elphel_gamma_add()), so the memo entries never go stale.
+ * The least recently used entry is replaced when the memo is full
+ * @param hash16 - ((gamma *100) & 0xff) | (((black * 256) 0xff) << 8)
+ * @return pointer to 257-element table (valid until the next call)
+ */
+unsigned short * gamma_memo_table (int hash16) {
+    struct elphel_gamma_memo_t * memo= ELPHEL_G(gamma_memo);
+    int i, lru=0;
+    ELPHEL_G(gamma_memo_clock)++;
+    for (i=0; i < GAMMA_MEMO_SIZE; i++) {
+        if (memo[i].used && (memo[i].hash16 == hash16)) {
+            memo[i].used= ELPHEL_G(gamma_memo_clock);
+            return memo[i].table;
+        }
+        if (memo[i].used < memo[lru].used) lru= i;
+    }
+    gamma_calc_vector (0.01 * (hash16 & 0xff), (1.0/256.0) * ((hash16 >> 8) & 0xff), memo[lru].table);
+    memo[lru].hash16= hash16;
+    memo[lru].used=   ELPHEL_G(gamma_memo_clock);
+    return memo[lru].table;
+}
+
+/**
+ * @brief Calculate new gamma table (specified by gamma value and black level) and put it into gamma cache (see elphel_gamma_add())
+ * @param gamma - gamma, will be rounded to 0.01
+ * @param black - black level, <=1.0 or integer>1 (1..255)
+ * @param force - upload the table even if the driver already has it
+ * @return <0 - -errno, otherwise hash16
+ */
+long gamma_add (double gamma, double black, int force) {
     unsigned short data_to_write[260];
-    double gamma,black;
     int igamma, iblack, hash16;
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "dd", &gamma, &black ) == FAILURE) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Wrong arguments");
-        RETURN_NULL ();
-    }
     igamma=100*gamma+0.5;
     if (igamma <   0) igamma=  0;
     if (igamma > 255) igamma=255;
-    gamma=0.01*igamma;
     iblack= (black>=1.0)?black:(256*black+0.5);
     if (iblack <   0) iblack=  0;
     if (iblack > 254) iblack=254; /// don't use 255 - reserve it for custom tables
-    black= (1.0/256.0) * iblack;
     hash16= igamma | (iblack<<8);
+    /// already in the driver cache - nothing to calculate or write
+    if (!force && (gamma_get_index(hash16, GAMMA_SCLALE_1) > 0)) return hash16;
     data_to_write[0]= GAMMA_SCLALE_1; /// 1.0
     data_to_write[1]= hash16;
     ///- next 1 byte   [4]   - mode (1 - not_nice, 2 - need reverse, 4 - hardware)
     ///- next 1 byte   [5]   - color ( only if hardware bit in mode is set)
     data_to_write[2]=0;
-    gamma_calc (gamma, black, &data_to_write[3]);
-    long rslt=write(ELPHEL_G(fd_gamma_cache), data_to_write, sizeof(data_to_write));
+    memcpy(&data_to_write[3], gamma_memo_table(hash16), 257 * sizeof(unsigned short));
+    if (write(ELPHEL_G(fd_gamma_cache), data_to_write, sizeof(data_to_write)) < 0) return -errno;
+    return hash16;
+}
+
+/**
+ * @brief Calculate new gamma table (specified by gamma value and black level) and put it into gamma cache
+ * Gamma cache will be used to program gamma tables to FPGA, calculate derivative tables
+ * Gamma tables should be loaded before used (gamma/black level/scale) specified as frame parameters 
+ * gamma - floating point, <=1.0,  will be rounded to 0.01. Larger gammas are reseved for custom tables
+ * black - floating point, <=1.0 or integer>1 (1..255) - level to subtract from sensor value
+ * force - (optional) upload the table even if the driver already has it (by default the table is not recalculated or
+ *         written again if it is in the driver gamma cache, calculated tables are reused from the in-process memo)
+ * @return hash16 - ((gamma *100) & 0xff) | (((black * 256) 0xff) << 8)
+ */
+PHP_FUNCTION(elphel_gamma_add)
+{
+    double gamma,black;
+    zend_bool force=0;
+    long rslt;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "dd|b", &gamma, &black, &force ) == FAILURE) {
+        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Wrong arguments");
+        RETURN_NULL ();
+    }
+    if (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_GAMMA) < 0) RETURN_NULL();
+    rslt= gamma_add (gamma, black, force);
     if (rslt<0) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Write to fd_gamma_cache returned errno=%d",errno);
-        RETURN_LONG(-errno);
+        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Write to fd_gamma_cache returned errno=%d",(int) -rslt);
     }
-    RETURN_LONG (hash16);
+    RETURN_LONG (rslt);
+}
+
+/**
+ * @brief Add several gamma tables to the gamma cache (same as elphel_gamma_add() for each of them)
+ * @param tables - array of (gamma, black) pairs
+ * @param force - (optional) upload the tables even if the driver already has them
+ * @return array with the same keys as tables: hash16 or -errno for each table, NULL for the elements that are not pairs
+ */
+PHP_FUNCTION(elphel_gamma_add_batch)
+{
+    zval *arr, **data, **zgamma, **zblack, zval_gamma, zval_black;
+    HashTable *arr_hash;
+    HashPosition pointer;
+    char *key;
+    int   key_len;
+    ulong index;
+    zend_bool force=0;
+    long rslt;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|b", &arr, &force) == FAILURE) {
+        RETURN_NULL ();
+    }
+    if (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_GAMMA) < 0) RETURN_NULL();
+    array_init(return_value);
+    arr_hash = Z_ARRVAL_P(arr);
+    for(zend_hash_internal_pointer_reset_ex(arr_hash, &pointer);
+            zend_hash_get_current_data_ex(arr_hash, (void**) &data, &pointer) == SUCCESS;
+            zend_hash_move_forward_ex(arr_hash, &pointer)) {
+        rslt= -EINVAL;
+        if ((Z_TYPE_PP(data) == IS_ARRAY) &&
+                (zend_hash_index_find(Z_ARRVAL_PP(data), 0, (void**) &zgamma) == SUCCESS) &&
+                (zend_hash_index_find(Z_ARRVAL_PP(data), 1, (void**) &zblack) == SUCCESS)) {
+            zval_gamma= **zgamma;
+            zval_black= **zblack;
+            zval_copy_ctor(&zval_gamma);
+            zval_copy_ctor(&zval_black);
+            convert_to_double(&zval_gamma);
+            convert_to_double(&zval_black);
+            rslt= gamma_add (Z_DVAL(zval_gamma), Z_DVAL(zval_black), force);
+            zval_dtor(&zval_gamma);
+            zval_dtor(&zval_black);
+        } else {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Each element should be an array(gamma, black)");
+        }
+        if (zend_hash_get_current_key_ex(arr_hash, &key, &key_len, &index, 0, &pointer) == HASH_KEY_IS_STRING) {
+            if (rslt == -EINVAL) add_assoc_null(return_value, key);
+            else                 add_assoc_long(return_value, key, rslt);
+        } else {
+            if (rslt == -EINVAL) add_index_null(return_value, index);
+            else                 add_index_long(return_value, index, rslt);
+        }
+    }
+}
+
+/**
+ * @brief Calculate gamma table without adding it to the gamma cache (does not need the camera)
+ * @param gamma - gamma value (1.0 - linear), limited to 0.13..10.0
+ * @param black - black level, 1.0 corresponds to 256 for 8bit values
+ * @param scalar - (optional) use pow() for each element (gamma_calc()) instead of the vector code (gamma_calc_vector())
+ * @return array of 257 integers 0..0xffff
+ */
+PHP_FUNCTION(elphel_gamma_calc)
+{
+    unsigned short gtable[257];
+    double gamma, black;
+    zend_bool scalar=0;
+    int i;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "dd|b", &gamma, &black, &scalar) == FAILURE) {
+        RETURN_NULL ();
+    }
+    if (scalar) gamma_calc        (gamma, black, gtable);
+    else        gamma_calc_vector (gamma, black, gtable);
+    array_init(return_value);
+    for (i=0;i<257;i++) add_next_index_long(return_value, gtable[i]);
 }
 
 /**
@@ -1077,6 +1345,7 @@ PHP_FUNCTION(elphel_gamma_add_custom)
         php_error_docref(NULL TSRMLS_CC, E_ERROR, "Wrong arguments");
         RETURN_LONG (-998);
     }
+    if (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_GAMMA) < 0) RETURN_LONG (-1);
     arr_hash = Z_ARRVAL_P(arr);
     array_count = zend_hash_num_elements(arr_hash);
     if (array_count != 257) {
@@ -1147,6 +1416,7 @@ PHP_FUNCTION(elphel_gamma_get)
         php_error_docref(NULL TSRMLS_CC, E_ERROR, "Wrong arguments");
         RETURN_LONG (-998);
     }
+    if (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_GAMMA) < 0) RETURN_LONG (-1);
     if (zscale) {
         switch (Z_TYPE_P(zscale)) {
         case IS_DOUBLE:
@@ -1201,7 +1471,6 @@ PHP_FUNCTION(elphel_gamma_get)
 
 PHP_FUNCTION(elphel_gamma_get_index)
 {
-    unsigned short data_to_write[3];
     long hash16;
     zval  *zscale=NULL;
     int iscale=GAMMA_SCLALE_1;
@@ -1209,6 +1478,7 @@ PHP_FUNCTION(elphel_gamma_get_index)
         php_error_docref(NULL TSRMLS_CC, E_ERROR, "Wrong arguments");
         RETURN_LONG (-998);
     }
+    if (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_GAMMA) < 0) RETURN_LONG (-1);
     if (zscale) {
         switch (Z_TYPE_P(zscale)) {
         case IS_DOUBLE:
@@ -1224,17 +1494,7 @@ PHP_FUNCTION(elphel_gamma_get_index)
     if (iscale < 0)      iscale=0;
     if (iscale > 0xffff) iscale=0xffff;
     /// look for a table in cache
-    data_to_write[0]= iscale; /// 0..0xffff
-    data_to_write[1]= hash16;
-    ///- next 1 byte   [4]   - mode (1 - not_nice, 2 - need reverse, 4 - hardware)
-    ///- next 1 byte   [5]   - color - only if hardware bit in mode is set
-    data_to_write[2]=0;
-    long rslt=write(ELPHEL_G(fd_gamma_cache), data_to_write, sizeof(data_to_write));
-    if (rslt<0) {
-        //      php_error_docref(NULL TSRMLS_CC, E_ERROR, "Write to fd_gamma_cache returned errno=%d",errno);
-        RETURN_LONG(-errno); /// i/o error/ table does not exist - "silent" error?
-    }
-    RETURN_LONG (lseek(ELPHEL_G(fd_gamma_cache), 0, SEEK_CUR));
+    RETURN_LONG (gamma_get_index(hash16, iscale)); /// <0 - i/o error/ table does not exist - "silent" error?
 }
 
 
@@ -1255,6 +1515,7 @@ PHP_FUNCTION(elphel_gamma_get_raw)
         php_error_docref(NULL TSRMLS_CC, E_ERROR, "Wrong index");
         RETURN_NULL ();
     }
+    if (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_GAMMA) < 0) RETURN_NULL();
     if (index >= GAMMA_CACHE_NUMBER) {
         php_error_docref(NULL TSRMLS_CC, E_ERROR, "Wrong index (%d >= %d)",index, (int) GAMMA_CACHE_NUMBER);
         RETURN_NULL ();
@@ -1290,34 +1551,22 @@ PHP_FUNCTION(elphel_histogram_get_raw)
     char * packed_histogram_structure;
     long frame=-1;
     long needed=0xfff;
-    long index;
-    long total_hist_entries;
+    struct histogram_stuct_t * histogram;
+    int error;
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll|ll", &port, &sub_chn, &needed, &frame) == FAILURE) {
         php_error_docref(NULL TSRMLS_CC, E_ERROR, "Wrong index");
         RETURN_NULL ();
     }
     if ((port <0)    || (port >=   SENSOR_PORTS)) RETURN_NULL ();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL ();
     if ((sub_chn <0) || (sub_chn >= MAX_SENSORS)) RETURN_NULL ();
 //    if (frame<0) frame=lseek((int) ELPHEL_G( fd_fparmsall[port]), 0, SEEK_CUR );
     if (frame <0) {
         frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
     }
-
-#ifdef DELAY_HISTOGRAMS_INIT
-    if (ELPHEL_G(fd_histogram_cache) <0) php_elphel_init_histograms();
-#endif
-
     needed &= 0xfff;
-    total_hist_entries = lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_SET_CHN + (4 * port) + sub_chn, SEEK_END); /// specify port/sub-channel is needed
-    lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_WAIT_C, SEEK_END); /// wait for all histograms, not just Y (G1)
-    lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_NEEDED + (needed & 0xff0), SEEK_END); /// mask out needed raw (fpga) bits
-    index=lseek(ELPHEL_G(fd_histogram_cache), frame, SEEK_SET);    /// request histograms for frame=frame, wait until available if needed
-    if (index <0) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Requested histograms are not available (frame=%d, needed=0x%x)",frame,needed);
-        RETURN_NULL ();
-    }
-    if (index >= total_hist_entries) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Internal error: frame=%d, index=%d >= %d (total_hist_entries)",frame, index, total_hist_entries);
+    if (!(histogram= get_histogram_snapshot (port, sub_chn, frame, needed, 0, &error))) {
+        histogram_snapshot_error (frame, needed, error);
         RETURN_NULL ();
     }
     packed_histogram_structure= (char*) emalloc (sizeof(struct histogram_stuct_t));
@@ -1325,8 +1574,7 @@ PHP_FUNCTION(elphel_histogram_get_raw)
         php_error_docref(NULL TSRMLS_CC, E_ERROR, "emalloc error");
         RETURN_NULL ();
     }
-    /// use gamma_cache_index to retrieve table from cache
-    memcpy(packed_histogram_structure, &(((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[index]),sizeof(struct histogram_stuct_t));
+    memcpy(packed_histogram_structure, histogram, sizeof(struct histogram_stuct_t));
     RETURN_STRINGL (packed_histogram_structure, sizeof(struct histogram_stuct_t), 0);
 }
 
@@ -1351,58 +1599,29 @@ PHP_FUNCTION(elphel_histogram_get)
     struct histogram_stuct_t * frame_histogram_structure;
     long frame=-1;
     long needed=0xfff;
-    long index;
-    long total_hist_entries;
-    int i;
+    int i, error;
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll|ll", &port, &sub_chn, &needed, &frame) == FAILURE) {
         php_error_docref(NULL TSRMLS_CC, E_ERROR, "Wrong index");
         RETURN_NULL ();
     }
     if ((port <0)    || (port >=   SENSOR_PORTS)) RETURN_NULL ();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL ();
     if ((sub_chn <0) || (sub_chn >= MAX_SENSORS)) RETURN_NULL ();
 
     //    if (frame<0) frame=lseek((int) ELPHEL_G( fd_fparmsall[port]), 0, SEEK_CUR );
     if (frame <0) {
         frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
     }
-#ifdef DELAY_HISTOGRAMS_INIT
-    if (ELPHEL_G(fd_histogram_cache) <0) php_elphel_init_histograms();
-#endif
     needed &= 0xfff;
-    total_hist_entries= lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_SET_CHN + (4 * port) + sub_chn, SEEK_END); /// specify port/sub-channel is needed
-
-    lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_WAIT_C, SEEK_END); // / wait for all histograms, not just Y (G1)
-    lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_NEEDED + (needed & 0xff0), SEEK_END); // / mask out needed raw (fpga) bits
-    index=lseek(ELPHEL_G(fd_histogram_cache), frame, SEEK_SET);    /// request histograms for frame=frame, wait until available if needed
-    if (index <0) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Requested histograms are not available (frame=%d, needed=0x%x)",frame,needed);
-        RETURN_NULL ();
-    }
-    if (index >= total_hist_entries) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Internal error: frame=%d, index=%d >= %d (total_hist_entries)",frame, index, total_hist_entries);
-        RETURN_NULL ();
-    }
-
-    frame_histogram_structure= (struct histogram_stuct_t *) emalloc (sizeof(struct histogram_stuct_t));
-    if (!frame_histogram_structure) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "emalloc error");
-        RETURN_NULL ();
-    }
-    /// use gamma_cache_index to retrieve table from cache
-    memcpy((void *) frame_histogram_structure, &(((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[index]),sizeof(struct histogram_stuct_t));
-    /// verify that histogram is still valid
-    if (frame != ((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[index].frame ) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Frame changed while retrieving histograms (frame requested=%d, received=%d, index=%d)",
-                frame, (int)((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[index].frame, index);
+    if (!(frame_histogram_structure= get_histogram_snapshot (port, sub_chn, frame, needed, 0, &error))) {
+        histogram_snapshot_error (frame, needed, error);
         RETURN_NULL ();
-        efree (frame_histogram_structure);
     }
     /// verify that selected tables are valid
     if ((needed & frame_histogram_structure->valid ) != needed) {
         php_error_docref(NULL TSRMLS_CC, E_ERROR, "Not all the requested tables are available (frame=%d needed=0x%x, valid=0x%x)",
                 frame, needed, frame_histogram_structure->valid);
         RETURN_NULL ();
-        efree (frame_histogram_structure);
     }
     /// TODO: make array with subarrays for each individual table/color?
 
@@ -1428,10 +1647,68 @@ PHP_FUNCTION(elphel_histogram_get)
 
 
 ///=================================
+/**
+ * @brief Read the whole Exif directory (entries for all the tags in the Exif template) with bulk reads and index it by ltag
+ * The table and the hash are persistent, they are rebuilt by createExifDirectory() when the Exif page size changes
+ * @return number of directory entries, <0 - read error
+ */
+long load_exif_dir_all (void) {
+    struct exif_dir_table_t * table;
+    long allocated, num_bytes=0, rslt;
+    int num_entries, hash_size, i;
+    unsigned int h;
+    allocated= EXIF_DIR_INITIAL_ENTRIES * sizeof(struct exif_dir_table_t);
+    table= (struct exif_dir_table_t *) pemalloc(allocated, 1);
+    lseek ((int) ELPHEL_G(fd_exifdir), 0, SEEK_SET);
+    while ((rslt= read((int) ELPHEL_G(fd_exifdir), ((char *) table) + num_bytes, allocated - num_bytes)) > 0) {
+        num_bytes += rslt;
+        if (num_bytes >= allocated) {
+            allocated <<= 1;
+            table= (struct exif_dir_table_t *) perealloc(table, allocated, 1);
+        }
+    }
+    if (ELPHEL_G(exif_dir_all))  pefree(ELPHEL_G(exif_dir_all), 1);
+    if (ELPHEL_G(exif_dir_hash)) pefree(ELPHEL_G(exif_dir_hash), 1);
+    ELPHEL_G(exif_dir_all)=  NULL;
+    ELPHEL_G(exif_dir_hash)= NULL;
+    ELPHEL_G(exif_dir_all_num)= 0;
+    if (rslt < 0) {
+        pefree(table, 1);
+        return -1;
+    }
+    num_entries= num_bytes / sizeof(struct exif_dir_table_t);
+    /// open addressing with linear probing, at most half full. Stores entry index+1, 0 - empty slot
+    for (hash_size= EXIF_DIR_MIN_HASH; hash_size < (2 * num_entries); hash_size <<= 1);
+    ELPHEL_G(exif_dir_hash)= (unsigned short *) pecalloc(hash_size, sizeof(unsigned short), 1);
+    for (i=0; i < num_entries; i++) {
+        for (h= EXIF_DIR_HASH(table[i].ltag, hash_size - 1); ELPHEL_G(exif_dir_hash)[h]; h= (h + 1) & (hash_size - 1));
+        ELPHEL_G(exif_dir_hash)[h]= i + 1; /// for duplicate ltags the first entry is found first, same as with the sequential scan
+    }
+    ELPHEL_G(exif_dir_all)=       table;
+    ELPHEL_G(exif_dir_all_num)=   num_entries;
+    ELPHEL_G(exif_dir_hash_mask)= hash_size - 1;
+    return num_entries;
+}
+
+/**
+ * @brief Find the Exif directory entry for the tag (no syscalls, call createExifDirectory(0) first to make sure directory is current)
+ * @param ltag - long tag (IFD in bits 16..19, Exif tag in bits 0..15)
+ * @return pointer to the directory entry or NULL if the tag is not in the Exif template
+ */
+struct exif_dir_table_t * exif_dir_find (unsigned long ltag) {
+    unsigned int h;
+    if (!ELPHEL_G(exif_dir_hash)) return NULL;
+    for (h= EXIF_DIR_HASH(ltag, ELPHEL_G(exif_dir_hash_mask)); ELPHEL_G(exif_dir_hash)[h]; h= (h + 1) & ELPHEL_G(exif_dir_hash_mask)) {
+        if (ELPHEL_G(exif_dir_all)[ELPHEL_G(exif_dir_hash)[h] - 1].ltag == ltag) return &ELPHEL_G(exif_dir_all)[ELPHEL_G(exif_dir_hash)[h] - 1];
+    }
+    return NULL;
+}
+
 long createExifDirectory (int rebuild) { /// build directory of pointers in the Exif data for some of the (variable) fields used in the Elphel cameras
-    int indx;
+    int indx, i;
     long numfields=0;
     struct exif_dir_table_t dir_table_entry;
+    if (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_EXIFDIR) < 0) return -1;
     ///  Read the size  of the Exif data
 //    php_error_docref(NULL TSRMLS_CC, E_WARNING, "%d: createExifDirectory(%d)\n",__LINE__,rebuild);
 
@@ -1440,11 +1717,13 @@ long createExifDirectory (int rebuild) { /// build directory of pointers in the
 //    php_error_docref(NULL TSRMLS_CC, E_WARNING, "%d: exif_this_size = 0x%x, ELPHEL_G(exif_size)= 0x%x\n",
 //            __LINE__,exif_this_size,ELPHEL_G(exif_size));
 
-    if ((ELPHEL_G(exif_size) == exif_this_size) && !rebuild) return 0; // no need to rebuild
+    if ((ELPHEL_G(exif_size) == exif_this_size) && ELPHEL_G(exif_dir_all) && !rebuild) return 0; // no need to rebuild
     ELPHEL_G(exif_size) = exif_this_size;
 
     for (indx=0; indx<ExifKmlNumber; indx++) ELPHEL_G(exif_dir)[indx].ltag=0;
-    while (read((int) ELPHEL_G(fd_exifdir), &dir_table_entry, sizeof(dir_table_entry))>0) {
+    if (load_exif_dir_all() < 0) return 0;
+    for (i=0; i < ELPHEL_G(exif_dir_all_num); i++) {
+        dir_table_entry= ELPHEL_G(exif_dir_all)[i];
         switch (dir_table_entry.ltag) {
         case Exif_Image_ImageDescription:      indx= Exif_Image_ImageDescription_Index; break;
         //         case Exif_Image_FrameNumber:           indx= Exif_Image_FrameNumber_Index; break;
@@ -1488,6 +1767,33 @@ long createExifDirectory (int rebuild) { /// build directory of pointers in the
 }
 
 
+/**
+ * @brief List all frames currently available in the circbuf, oldest first
+ * @param port - sensor port (0..3)
+ * @param second - start from the second oldest frame (the oldest one may be overwritten soon)
+ * @param pointers - set to an emalloc-ed array of circbuf pointers (caller should efree() it), NULL if there are no frames
+ * @return number of frames in the pointers array
+ */
+long get_circbuf_frames (long port, int second, long ** pointers) {
+    long p;
+    long num_frames=0;
+    long allocated=0;
+    *pointers=NULL;
+    if ((port <0) || (port >= SENSOR_PORTS)) return 0;
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_CIRCBUF) < 0) return 0;
+    p=lseek((int) ELPHEL_G( fd_circ[port]), second? LSEEK_CIRC_SCND: LSEEK_CIRC_FIRST, SEEK_END );
+    while (p>=0) {
+        if (num_frames >= allocated) {
+            allocated = allocated? (allocated << 1) : 64;
+            *pointers= (long *) erealloc(*pointers, allocated * sizeof(long));
+        }
+        (*pointers)[num_frames++]=p;
+        p=lseek((int) ELPHEL_G( fd_circ[port]), LSEEK_CIRC_NEXT, SEEK_END );
+        p=lseek((int) ELPHEL_G( fd_circ[port]), LSEEK_CIRC_READY, SEEK_END );
+    }
+    return num_frames;
+}
+
 ///TODO: make reverse order, specify how many frames wanted. So first will be most reliable
 PHP_FUNCTION(elphel_get_circbuf_pointers) {
     long port;
@@ -1504,6 +1810,7 @@ PHP_FUNCTION(elphel_get_circbuf_pointers) {
     }
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_CIRCBUF | ELPHEL_OPEN_EXIF) < 0) RETURN_NULL();
     ccam_dma_buf_char= (char *) ELPHEL_G(ccam_dma_buf[port]);
 
 
@@ -1565,31 +1872,52 @@ PHP_FUNCTION(elphel_get_circbuf_pointers) {
 }
 
 
+/**
+ * @brief Copy interframe parameters of the frame from the mmap-ed circbuf, and the timestamp that follows the frame data
+ * @param port - sensor port (0..3)
+ * @param circbuf_pointer - frame pointer in the circbuf (as returned by elphel_get_circbuf_pointers())
+ * @param frame_params - structure to fill. NOTE: timestamp_sec shares storage with frame_length, so the length is returned instead
+ * @return <0 - wrong pointer, no interframe signature at that location or invalid length, otherwise compressed frame length (bytes),
+ *         0 < length < circbuf size
+ */
+long get_interframe_meta (long port, long circbuf_pointer, struct interframe_params_t * frame_params) {
+    char * ccam_dma_buf_char;
+    long frameParamPointer,jpeg_len,timestamp_start;
+    long circbuf_size;
+    if ((port <0) || (port >= SENSOR_PORTS)) return -1;
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_CIRCBUF) < 0) return -1;
+    circbuf_size=ELPHEL_G(ccam_dma_buf_len[port]);
+    if ((circbuf_pointer < 0) || (circbuf_pointer >= circbuf_size) || (circbuf_pointer & 0x1f)) return -1; /// frames are 32-byte aligned
+    ccam_dma_buf_char= (char *) ELPHEL_G( ccam_dma_buf[port]);
+    frameParamPointer=circbuf_pointer-32;
+    if (frameParamPointer < 0) frameParamPointer+=circbuf_size;
+    memcpy (frame_params, &ccam_dma_buf_char[frameParamPointer],32);
+    /// nothing from the block is trusted before the signature and the length are verified (block may be overwritten)
+    if (frame_params->signffff !=0xffff) return -1;
+    jpeg_len=frame_params->frame_length;
+    if ((jpeg_len <= 0) || (jpeg_len >= circbuf_size)) return -1;
+    ///Copy timestamp (goes after the image data)
+    timestamp_start=(circbuf_pointer+((jpeg_len+CCAM_MMAP_META+3) & (~0x1f)) + 32 - CCAM_MMAP_META_SEC) % circbuf_size; //! magic shift - should index first byte of the time stamp
+    if ((timestamp_start + 8) <= circbuf_size) {
+        memcpy (&(frame_params->timestamp_sec), &ccam_dma_buf_char[timestamp_start],8);
+    } else { /// timestamp wraps around the buffer end
+        memcpy (&(frame_params->timestamp_sec), &ccam_dma_buf_char[timestamp_start], circbuf_size - timestamp_start);
+        memcpy (((char *) &(frame_params->timestamp_sec)) + (circbuf_size - timestamp_start), ccam_dma_buf_char, 8 - (circbuf_size - timestamp_start));
+    }
+    return jpeg_len;
+}
+
 PHP_FUNCTION(elphel_get_interframe_meta)
 {
     long port;
-    char * ccam_dma_buf_char;
     struct interframe_params_t frame_params;
     long circbuf_pointer=-1;
-    long frameParamPointer,jpeg_len,timestamp_start;
-    //   long circbuf_size=ELPHEL_GLOBALPARS(G_CIRCBUFSIZE);
-    long circbuf_size;
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll", &port, &circbuf_pointer) == FAILURE) {
         RETURN_NULL();
     }
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
-    circbuf_size=ELPHEL_G(ccam_dma_buf_len[port]);
-    ccam_dma_buf_char= (char *) ELPHEL_G( ccam_dma_buf[port]);
-    frameParamPointer=circbuf_pointer-32;
-    if (frameParamPointer < 0) frameParamPointer+=circbuf_size;
-    memcpy (&frame_params, &ccam_dma_buf_char[frameParamPointer],32);
-    jpeg_len=frame_params.frame_length;
-    ///Copy timestamp (goes after the image data)
-    timestamp_start=circbuf_pointer+((jpeg_len+CCAM_MMAP_META+3) & (~0x1f)) + 32 - CCAM_MMAP_META_SEC; //! magic shift - should index first byte of the time stamp
-    if (timestamp_start >= circbuf_size) timestamp_start-=circbuf_size;
-    memcpy (&(frame_params.timestamp_sec), &ccam_dma_buf_char[timestamp_start],8);
-    if (frame_params.signffff !=0xffff) {
+    if (get_interframe_meta (port, circbuf_pointer, &frame_params) < 0) {
         RETURN_NULL();
     }
     array_init(return_value);
@@ -1612,272 +1940,810 @@ PHP_FUNCTION(elphel_get_interframe_meta)
     add_assoc_long(return_value, "timestamp_usec",frame_params.timestamp_usec); /// number of microseconds to add to seconds
 }
 
-
-#define saferead255(f,d,l) read(f,d,((l)<256)?(l):255)
-PHP_FUNCTION(elphel_get_exif_elphel)
+/**
+ * @brief Decode interframe parameters for many frames at once, return them as columns (one array per field)
+ * @param port - sensor port (0..3)
+ * @param pointers - array of circbuf pointers (as returned by elphel_get_circbuf_pointers())
+ * @param fields - (optional) bitmask of the columns to return, default - all:
+ * - bit 0 (0x01) - "width"
+ * - bit 1 (0x02) - "height"
+ * - bit 2 (0x04) - "quality2"
+ * - bit 3 (0x08) - "color"
+ * - bit 4 (0x10) - "frame_length"
+ * - bit 5 (0x20) - "meta_index"
+ * - bit 6 (0x40) - "timestamp_sec" and "timestamp_usec"
+ * @return NULL - error, otherwise associative array of indexed arrays, all of the same length as pointers.
+ *         Column "valid" is always present, rows with valid==false (wrong pointer or signature) have all other fields zeroed
+ */
+PHP_FUNCTION(elphel_get_interframe_meta_batch)
 {
+    const char * column_names[] = {"width", "height", "quality2", "color", "frame_length", "meta_index", "timestamp_sec", "timestamp_usec"};
+    long column_values[INTERFRAME_META_COLUMNS];
+    zval * columns[INTERFRAME_META_COLUMNS];
+    zval * valid_column;
     long port;
-    long makerNote[16];
-    long rational3[6];
-    long exif_page_start;
-    char *key;
-    long indx;
-    char val[256];
-    long exif_page=0;
-    int hours=0, minutes=0;
-    double seconds=0.0;
-    double  longitude=0.0, latitude=0.0,  altitude=0.0,  heading=0.0,  roll=0.0, pitch=0.0, exposure=0.0;
-    val[255]='\0';
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll", &port, &exif_page) == FAILURE) {
+    long fields=INTERFRAME_META_ALL;
+    long circbuf_pointer, jpeg_len;
+    int i;
+    struct interframe_params_t frame_params;
+    zval *arr, **data;
+    HashTable *arr_hash;
+    HashPosition pointer;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "la|l", &port, &arr, &fields) == FAILURE) {
         RETURN_NULL();
     }
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
-
-    createExifDirectory(0); /// make sure directory is current
-    if (exif_page) exif_page_start=lseek ((int) ELPHEL_G(fd_exif[port]), exif_page, SEEK_END); /// select specified Exif page
-    else           exif_page_start=lseek ((int) ELPHEL_G(fd_exif[port]), 0, SEEK_SET); /// Select 0 (currently being acquired) Exif page
-    if (exif_page_start<0) RETURN_NULL(); //exif_page may be out of range
-//    php_error_docref(NULL TSRMLS_CC, E_WARNING, "%d: exif_page = 0x%x\n",  __LINE__,exif_page);
-//    php_error_docref(NULL TSRMLS_CC, E_WARNING, "%d: exif_page_start = 0x%x\n",  __LINE__,exif_page_start);
-//    php_error_docref(NULL TSRMLS_CC, E_WARNING, "%d: Exif_Image_ImageNumber_Index = 0x%x\n",  __LINE__,Exif_Image_ImageNumber_Index);
-//    php_error_docref(NULL TSRMLS_CC, E_WARNING, "%d:  ELPHEL_G(exif_dir)[Exif_Image_ImageNumber_Index].dst = 0x%x\n",  __LINE__, ELPHEL_G(exif_dir)[Exif_Image_ImageNumber_Index].dst);
-//    php_error_docref(NULL TSRMLS_CC, E_WARNING, "%d: exif_page_start+ELPHEL_G(exif_dir)[Exif_Image_ImageNumber_Index].dst = 0x%x\n",  __LINE__,exif_page_start+ELPHEL_G(exif_dir)[Exif_Image_ImageNumber_Index].dst);
-
+    fields &= INTERFRAME_META_ALL;
+    if (fields & INTERFRAME_META_TIMESTAMP) fields |= INTERFRAME_META_TIMESTAMP << 1; /// seconds and microseconds go together
+    arr_hash = Z_ARRVAL_P(arr);
     array_init(return_value);
-//    /exif_page_start
-    ///Image Description
-//    add_assoc_string(return_value, "dbg_exif_page",       exif_page,  1);
-//    add_assoc_string(return_value, "dbg_exif_page_start", exif_page_start,  1);
-//    add_assoc_string(return_value, "dbg_Exif_Image_ImageNumber_Index", Exif_Image_ImageNumber_Index,  1);
-//    add_assoc_string(return_value, "dbg_dst", ELPHEL_G(exif_dir)[Exif_Image_ImageNumber_Index].dst,  1);
-//    add_assoc_string(return_value, "dbg_offs", exif_page_start+ELPHEL_G(exif_dir)[Exif_Image_ImageNumber_Index].dst,  1);
-
-    if (ELPHEL_G(exif_dir)[Exif_Image_ImageDescription_Index].ltag==Exif_Image_ImageDescription) { // Exif_Image_ImageDescription is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_Image_ImageDescription_Index].dst,
-                SEEK_SET);
-        saferead255(ELPHEL_G(fd_exif[port]), val, ELPHEL_G(exif_dir)[Exif_Image_ImageDescription_Index].len);
-        add_assoc_string(return_value, "ImageDescription", val,  1);
-    }
-    ///Exif_Image_FrameNumber_Index           0x13
-    if (ELPHEL_G(exif_dir)[Exif_Image_ImageNumber_Index].ltag==Exif_Image_ImageNumber) { // Exif_Image_FrameNumber_Index is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_Image_ImageNumber_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), rational3, 4);
-        sprintf (val,"%ld", (long) __cpu_to_be32( rational3[0]));
-        add_assoc_string(return_value, "FrameNumber", val,  1);
+    ALLOC_INIT_ZVAL(valid_column);
+    array_init(valid_column);
+    for (i=0; i < INTERFRAME_META_COLUMNS; i++) {
+        columns[i]=NULL;
+        if (fields & (1 << i)) {
+            ALLOC_INIT_ZVAL(columns[i]);
+            array_init(columns[i]);
+        }
     }
-
-    ///Exif_Image_PageNumber_Index           0x15 - mostly for testing - should be == port
-    if (ELPHEL_G(exif_dir)[Exif_Image_PageNumber_Index].ltag==Exif_Image_PageNumber) { // Exif_Image_PageNumber_Index is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_Image_PageNumber_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), rational3, 4);
-        sprintf (val,"%ld", (long) __cpu_to_be32( rational3[0]));
-        add_assoc_string(return_value, "FramePage", val,  1);
-    }
-
-    ///Exif_Image_Orientation_Index           0x15
-    if (ELPHEL_G(exif_dir)[Exif_Image_Orientation_Index].ltag==Exif_Image_Orientation) { // Exif_Image_Orientation_Index is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_Image_Orientation_Index].dst,
-                SEEK_SET);
-        rational3[0]=0;
-        read(ELPHEL_G(fd_exif[port]), rational3, 2);
-        sprintf (val,"%ld", (long) ( rational3[0]>>8));
-        add_assoc_string(return_value, "Orientation", val,  1);
+    for(zend_hash_internal_pointer_reset_ex(arr_hash, &pointer);
+            zend_hash_get_current_data_ex(arr_hash, (void**) &data, &pointer) == SUCCESS;
+            zend_hash_move_forward_ex(arr_hash, &pointer)) {
+        circbuf_pointer = (Z_TYPE_PP(data) == IS_LONG)? Z_LVAL_PP(data) : -1;
+        jpeg_len= get_interframe_meta (port, circbuf_pointer, &frame_params);
+        if (jpeg_len < 0) {
+            memset(column_values, 0, sizeof(column_values));
+        } else {
+            column_values[0]= frame_params.width;
+            column_values[1]= frame_params.height;
+            column_values[2]= frame_params.quality2;
+            column_values[3]= frame_params.color;
+            column_values[4]= jpeg_len;
+            column_values[5]= frame_params.meta_index;
+            column_values[6]= frame_params.timestamp_sec;
+            column_values[7]= frame_params.timestamp_usec;
+        }
+        add_next_index_bool(valid_column, jpeg_len >= 0);
+        for (i=0; i < INTERFRAME_META_COLUMNS; i++) if (columns[i]) add_next_index_long(columns[i], column_values[i]);
     }
+    add_assoc_zval(return_value, "valid", valid_column);
+    for (i=0; i < INTERFRAME_META_COLUMNS; i++) if (columns[i]) add_assoc_zval(return_value, column_names[i], columns[i]);
+}
 
-    ///DateTimeOriginal (with subseconds)
-    if (ELPHEL_G(exif_dir)[Exif_Photo_DateTimeOriginal_Index].ltag==Exif_Photo_DateTimeOriginal) {
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_Photo_DateTimeOriginal_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), val, 19);
-        val[19]='\0';
-        if (ELPHEL_G(exif_dir)[Exif_Photo_SubSecTimeOriginal_Index].ltag==Exif_Photo_SubSecTimeOriginal) {
-            val[19]='.';
-            lseek (ELPHEL_G(fd_exif[port]),
-                    exif_page_start+ELPHEL_G(exif_dir)[Exif_Photo_SubSecTimeOriginal_Index].dst,
-                    SEEK_SET);
-            read(ELPHEL_G(fd_exif[port]), &val[20], 7);
-            val[27]='\0';
-        }
-        add_assoc_string(return_value, "DateTimeOriginal", val,  1);
-    }
 
-    ///Exif_Photo_ExposureTime
-    if (ELPHEL_G(exif_dir)[Exif_Photo_ExposureTime_Index].ltag==Exif_Photo_ExposureTime) { // Exif_Photo_ExposureTime is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_Photo_ExposureTime_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), rational3, 8);
-        exposure=(1.0*__cpu_to_be32( rational3[0]))/__cpu_to_be32( rational3[1]);
-        sprintf (val,"%f",exposure);
-        add_assoc_string(return_value, "ExposureTime", val,  1);
-    }
+/**
+ * @brief Match compressed frames of several sensor ports by their timestamps
+ * Frames of all the selected ports are merged in time order, each set starts with the earliest remaining frame and includes
+ * the next frame of each other port if it is not later than tolerance_us. Ports without such frame are marked as missing.
+ * @param port_mask - bit mask of the sensor ports to synchronize (bit 0 - port 0)
+ * @param tolerance_us - (optional) maximal timestamp difference in a set, microseconds (default 1000)
+ * @param count - (optional) number of the most recent sets to return, 0 (default) - all available
+ * @return NULL - error, otherwise array of sets in chronological order, each set is an associative array:
+ * - "timestamp_sec", "timestamp_usec" - timestamp of the earliest frame in the set
+ * - "skew_usec" - difference between the latest and the earliest timestamps in the set
+ * - "complete" - true if all the selected ports have a frame in the set
+ * - "missing" - bit mask of ports that do not have a matching frame
+ * - "pointers" - array indexed by port number (selected ports only) of circbuf pointers, -1 for missing frames
+ */
+PHP_FUNCTION(elphel_get_synced_frames)
+{
+    long port_mask;
+    long tolerance_us=1000;
+    long count=0;
+    long port, i, num_valid, first_set;
+    long * port_pointers[SENSOR_PORTS];
+    long long * port_timestamps[SENSOR_PORTS];
+    long num_frames[SENSOR_PORTS];
+    long heads[SENSOR_PORTS];
+    long total_frames=0;
+    long num_sets=0;
+    long * set_pointers;      /// [set * SENSOR_PORTS + port]
+    long long * set_timestamps;
+    long * set_skews;
+    long * set_missing;
+    long long t0, latest;
+    struct interframe_params_t frame_params;
+    zval * set_zval, * pointers_zval;
 
-    ///Exif_Photo_MakerNote
-    if (ELPHEL_G(exif_dir)[Exif_Photo_MakerNote_Index].ltag==Exif_Photo_MakerNote) { // Exif_Photo_MakerNote is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_Photo_MakerNote_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), makerNote, 64);
-        sprintf (val,"0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx",
-                (long) __cpu_to_be32(makerNote[0]),
-                (long) __cpu_to_be32(makerNote[1]),
-                (long) __cpu_to_be32(makerNote[2]),
-                (long) __cpu_to_be32(makerNote[3]),
-                (long) __cpu_to_be32(makerNote[4]),
-                (long) __cpu_to_be32(makerNote[5]),
-                (long) __cpu_to_be32(makerNote[6]),
-                (long) __cpu_to_be32(makerNote[7]),
-                (long) __cpu_to_be32(makerNote[8]),
-                (long) __cpu_to_be32(makerNote[9]),
-                (long) __cpu_to_be32(makerNote[10]),
-                (long) __cpu_to_be32(makerNote[11]),
-                (long) __cpu_to_be32(makerNote[12]),
-                (long) __cpu_to_be32(makerNote[13]),
-                (long) __cpu_to_be32(makerNote[14]),
-                (long) __cpu_to_be32(makerNote[15]));
-        add_assoc_string(return_value, "MakerNote", val,  1);
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|ll", &port_mask, &tolerance_us, &count) == FAILURE) {
+        RETURN_NULL();
     }
-
-    /// GPS measure mode
-    if (ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSMeasureMode_Index].ltag==Exif_GPSInfo_GPSMeasureMode) {
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSMeasureMode_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), val, 1);
-        val[1]='\0';
-        add_assoc_stringl(return_value, "GPSMeasureMode", val, 1,  1);
+    port_mask &= (1 << SENSOR_PORTS) - 1;
+    if (!port_mask || (tolerance_us < 0) || (count < 0)) RETURN_NULL();
+
+    /// read timestamps of all valid frames of each port (circbuf order is chronological)
+    for (port = 0; port < SENSOR_PORTS; port++) {
+        port_pointers[port]=NULL;
+        port_timestamps[port]=NULL;
+        num_frames[port]=0;
+        heads[port]=0;
+        if (!(port_mask & (1 << port))) continue;
+        num_frames[port]= get_circbuf_frames (port, 1, &port_pointers[port]);
+        if (num_frames[port]) port_timestamps[port]= (long long *) emalloc(num_frames[port] * sizeof(long long));
+        for (i=0, num_valid=0; i < num_frames[port]; i++) {
+            if (get_interframe_meta (port, port_pointers[port][i], &frame_params) < 0) continue;
+            port_pointers[port][num_valid]= port_pointers[port][i];
+            port_timestamps[port][num_valid++]= 1000000LL * frame_params.timestamp_sec + frame_params.timestamp_usec;
+        }
+        num_frames[port]=num_valid;
+    }
+    for (port = 0, total_frames=0; port < SENSOR_PORTS; port++) total_frames+=num_frames[port];
+    set_pointers=   (long *)      emalloc((total_frames + 1) * SENSOR_PORTS * sizeof(long));
+    set_timestamps= (long long *) emalloc((total_frames + 1) * sizeof(long long));
+    set_skews=      (long *)      emalloc((total_frames + 1) * sizeof(long));
+    set_missing=    (long *)      emalloc((total_frames + 1) * sizeof(long));
+
+    /// merge ports in time order - each frame is visited once
+    while (1) {
+        t0=-1;
+        for (port = 0; port < SENSOR_PORTS; port++) {
+            if ((heads[port] < num_frames[port]) && ((t0 < 0) || (port_timestamps[port][heads[port]] < t0)))
+                t0=port_timestamps[port][heads[port]];
+        }
+        if (t0 < 0) break; /// all frames used
+        latest=t0;
+        set_missing[num_sets]=0;
+        for (port = 0; port < SENSOR_PORTS; port++) {
+            set_pointers[num_sets * SENSOR_PORTS + port]=-1;
+            if (!(port_mask & (1 << port))) continue;
+            if ((heads[port] < num_frames[port]) && ((port_timestamps[port][heads[port]] - t0) <= tolerance_us)) {
+                set_pointers[num_sets * SENSOR_PORTS + port]=port_pointers[port][heads[port]];
+                if (port_timestamps[port][heads[port]] > latest) latest=port_timestamps[port][heads[port]];
+                heads[port]++;
+            } else {
+                set_missing[num_sets] |= 1 << port;
+            }
+        }
+        set_timestamps[num_sets]=t0;
+        set_skews[num_sets]=latest-t0;
+        num_sets++;
     }
-
-    ///GPS date/time
-    if (ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSDateStamp_Index].ltag==Exif_GPSInfo_GPSDateStamp) {
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSDateStamp_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), val, 10);
-        val[10]='\0';
-        if (ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSTimeStamp_Index].ltag==Exif_GPSInfo_GPSTimeStamp) {
-            lseek (ELPHEL_G(fd_exif[port]),
-                    exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSTimeStamp_Index].dst,
-                    SEEK_SET);
-            read(ELPHEL_G(fd_exif[port]), rational3, 24);
-            hours=   __cpu_to_be32( rational3[0]);
-            minutes= __cpu_to_be32( rational3[2]);
-            seconds= (1.0*(__cpu_to_be32( rational3[4])+1))/__cpu_to_be32( rational3[5]); /// GPS likes ".999", let's inc by one - anyway will round that out
-            sprintf (&val[10]," %02d:%02d:%05.2f",hours,minutes,seconds);
+    first_set= (count && (count < num_sets))? (num_sets - count) : 0;
+    array_init(return_value);
+    for (i = first_set; i < num_sets; i++) {
+        ALLOC_INIT_ZVAL(set_zval);
+        array_init(set_zval);
+        add_assoc_long(set_zval, "timestamp_sec",  (long) (set_timestamps[i] / 1000000));
+        add_assoc_long(set_zval, "timestamp_usec", (long) (set_timestamps[i] % 1000000));
+        add_assoc_long(set_zval, "skew_usec",      set_skews[i]);
+        add_assoc_bool(set_zval, "complete",       set_missing[i] == 0);
+        add_assoc_long(set_zval, "missing",        set_missing[i]);
+        ALLOC_INIT_ZVAL(pointers_zval);
+        array_init(pointers_zval);
+        for (port = 0; port < SENSOR_PORTS; port++) if (port_mask & (1 << port)) {
+            add_index_long(pointers_zval, port, set_pointers[i * SENSOR_PORTS + port]);
         }
-        add_assoc_string(return_value, "GPSDateTime", val,  1);
+        add_assoc_zval(set_zval, "pointers", pointers_zval);
+        add_next_index_zval(return_value, set_zval);
     }
-
-    /// knowing format provided from GPS - degrees and minutes only, no seconds:
-    ///GPS Longitude
-    if (ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLongitude_Index].ltag==Exif_GPSInfo_GPSLongitude) { // Exif_GPSInfo_GPSLongitude is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLongitude_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), rational3, 24);
-        longitude=__cpu_to_be32( rational3[0])/(1.0*__cpu_to_be32( rational3[1])) + __cpu_to_be32( rational3[2])/(60.0*__cpu_to_be32( rational3[3]));
-        if (ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLongitudeRef_Index].ltag==Exif_GPSInfo_GPSLongitudeRef) {
-            lseek (ELPHEL_G(fd_exif[port]),
-                    exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLongitudeRef_Index].dst,
-                    SEEK_SET);
-            read(ELPHEL_G(fd_exif[port]), val, 1);
-            if (val[0]!= 'E') longitude=-longitude;
-        }
-        sprintf (val,"%f",longitude);
-        add_assoc_string(return_value, "GPSLongitude", val,  1);
+    for (port = 0; port < SENSOR_PORTS; port++) {
+        if (port_pointers[port])   efree(port_pointers[port]);
+        if (port_timestamps[port]) efree(port_timestamps[port]);
     }
-    ///GPS Latitude
-    if (ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLatitude_Index].ltag==Exif_GPSInfo_GPSLatitude) { // Exif_GPSInfo_GPSLatitude is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLatitude_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), rational3, 24);
-        latitude=__cpu_to_be32( rational3[0])/(1.0*__cpu_to_be32( rational3[1])) + __cpu_to_be32( rational3[2])/(60.0*__cpu_to_be32( rational3[3]));
-        if (ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLatitudeRef_Index].ltag==Exif_GPSInfo_GPSLatitudeRef) {
-            lseek (ELPHEL_G(fd_exif[port]),
-                    exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLatitudeRef_Index].dst,
-                    SEEK_SET);
-            read(ELPHEL_G(fd_exif[port]), val, 1);
-            if (val[0] != 'N') latitude=-latitude;
-        }
-        sprintf (val,"%f",latitude);
-        add_assoc_string(return_value, "GPSLatitude", val,  1);
+    efree(set_pointers);
+    efree(set_timestamps);
+    efree(set_skews);
+    efree(set_missing);
+}
+
+/**
+ * @brief Estimate the circbuf fill rate (bytes per second) from the most recent frames, used when the reader is not behind
+ * @param port - sensor port (0..3)
+ * @return fill rate in bytes per second, 0.0 if there are not enough frames to measure it
+ */
+double get_circbuf_fill_rate (long port) {
+    int  fd_circ=ELPHEL_G(fd_circ[port]);
+    long circbuf_size=ELPHEL_G(ccam_dma_buf_len[port]);
+    long p_last, p_first, p;
+    long long ts_last, ts_first;
+    int i;
+    struct interframe_params_t frame_params;
+    p_last= lseek(fd_circ, LSEEK_CIRC_LAST, SEEK_END);
+    if ((p_last < 0) || (get_interframe_meta(port, p_last, &frame_params) < 0)) return 0.0;
+    ts_last= 1000000LL * frame_params.timestamp_sec + frame_params.timestamp_usec;
+    p_first=p_last;
+    for (i=0; i < CIRCBUF_RATE_FRAMES; i++) {
+        p= lseek(fd_circ, LSEEK_CIRC_PREV, SEEK_END);
+        if (p < 0) break;
+        p_first=p;
+    }
+    if ((p_first == p_last) || (get_interframe_meta(port, p_first, &frame_params) < 0)) return 0.0;
+    ts_first= 1000000LL * frame_params.timestamp_sec + frame_params.timestamp_usec;
+    if (ts_last <= ts_first) return 0.0;
+    p= p_last - p_first;
+    if (p < 0) p+=circbuf_size;
+    return 1000000.0 * p / (ts_last - ts_first);
+}
+
+/**
+ * @brief Report how far a circbuf reader is behind the compressor and how soon its frame will be overwritten.
+ * Only the mmap-ed interframe parameters are read (no per-frame syscalls), so it can be called for every frame.
+ * @param port - sensor port (0..3)
+ * @param pointer - reader's circbuf pointer (frame it is going to read)
+ * @return NULL - error, otherwise associative array:
+ * - "valid" - frame at pointer is still valid
+ * - "write_pointer" - circbuf pointer of the frame being compressed
+ * - "lag_bytes" - bytes from the reader's frame to the write pointer
+ * - "lag_frames" - number of complete frames after the reader's one
+ * - "lag_ratio" - lag_bytes relative to the circbuf size (overwrite happens at 1.0)
+ * - "fill_rate" - bytes per second written by the compressor (averaged over recent calls), 0.0 if unknown
+ * - "time_to_overwrite" - estimated seconds until the reader's frame is overwritten, -1.0 if unknown, 0.0 if not valid
+ */
+PHP_FUNCTION(elphel_circbuf_status)
+{
+    long port, circbuf_pointer;
+    long circbuf_size, wp, p, jpeg_len, frame_bytes;
+    long lag_bytes, lag_frames=0, span_bytes=0;
+    long long first_ts=0, last_ts=0;
+    double rate, time_to_overwrite=-1.0;
+    int fd_circ, valid;
+    struct interframe_params_t frame_params;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll", &port, &circbuf_pointer) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_CIRCBUF) < 0) RETURN_NULL();
+    fd_circ=ELPHEL_G(fd_circ[port]);
+    circbuf_size=ELPHEL_G(ccam_dma_buf_len[port]);
+    if ((circbuf_pointer < 0) || (circbuf_pointer >= circbuf_size))
+        RETURN_NULL();
+    wp= lseek(fd_circ, LSEEK_CIRC_TOWP, SEEK_END);
+    if (wp < 0) RETURN_NULL();
+    lseek(fd_circ, circbuf_pointer, SEEK_SET);
+    valid= lseek(fd_circ, LSEEK_CIRC_VALID, SEEK_END) >= 0;
+    lag_bytes= wp - circbuf_pointer;
+    if (lag_bytes < 0) lag_bytes+=circbuf_size;
+    /// Walk the interframe headers from the reader's frame towards the write pointer
+    p=circbuf_pointer;
+    jpeg_len= valid? get_interframe_meta(port, p, &frame_params) : -1;
+    if (jpeg_len >= 0) {
+        first_ts= 1000000LL * frame_params.timestamp_sec + frame_params.timestamp_usec;
+        last_ts=  first_ts;
+    }
+    while ((jpeg_len >= 0) && (lag_frames < CIRCBUF_STATUS_MAX_FRAMES)) {
+        frame_bytes= ((jpeg_len + CCAM_MMAP_META + 3) & (~0x1f)) + 32; /// same alignment as used to locate the timestamp
+        if ((span_bytes + frame_bytes) >= lag_bytes) break;             /// next one is the frame being compressed
+        p= (p + frame_bytes) % circbuf_size;
+        jpeg_len= get_interframe_meta(port, p, &frame_params);
+        if (jpeg_len < 0) break;
+        span_bytes+=frame_bytes;
+        lag_frames++;
+        last_ts= 1000000LL * frame_params.timestamp_sec + frame_params.timestamp_usec;
+    }
+    /// Update per-port fill rate average, measure it from the last frames if the reader is not behind
+    rate= ELPHEL_G(circbuf_rate[port]);
+    if ((lag_frames > 0) && (last_ts > first_ts)) {
+        double rate_now= 1000000.0 * span_bytes / (last_ts - first_ts);
+        rate= (rate > 0.0)? (CIRCBUF_RATE_ALPHA * rate_now + (1.0 - CIRCBUF_RATE_ALPHA) * rate) : rate_now;
+    } else if (rate <= 0.0) {
+        rate= get_circbuf_fill_rate(port);
+    }
+    ELPHEL_G(circbuf_rate[port])=rate;
+    if (!valid)           time_to_overwrite= 0.0;
+    else if (rate > 0.0)  time_to_overwrite= (circbuf_size - lag_bytes) / rate;
+
+    array_init(return_value);
+    add_assoc_bool  (return_value, "valid",             valid);
+    add_assoc_long  (return_value, "write_pointer",     wp);
+    add_assoc_long  (return_value, "lag_bytes",         lag_bytes);
+    add_assoc_long  (return_value, "lag_frames",        lag_frames);
+    add_assoc_double(return_value, "lag_ratio",         ((double) lag_bytes) / circbuf_size);
+    add_assoc_double(return_value, "fill_rate",         rate);
+    add_assoc_double(return_value, "time_to_overwrite", time_to_overwrite);
+}
+
+
+/**
+ * @brief Read the whole Exif page of the frame in a single read()
+ * @param port - sensor port (0..3)
+ * @param exif_page - Exif page number (meta_index of the frame), 0 - page of the frame currently being acquired
+ * @param page - buffer to receive the page, at least page_size bytes
+ * @param page_size - Exif page size (ELPHEL_G(exif_size) after createExifDirectory())
+ * @return number of bytes read, <0 - exif_page is out of range or read error
+ */
+long read_exif_page (long port, long exif_page, unsigned char * page, long page_size) {
+    long exif_page_start;
+    if ((port <0) || (port >= SENSOR_PORTS) || (ELPHEL_NEED(port, ELPHEL_OPEN_EXIF) < 0)) return -1;
+    if (exif_page) exif_page_start=lseek ((int) ELPHEL_G(fd_exif[port]), exif_page, SEEK_END); /// select specified Exif page
+    else           exif_page_start=lseek ((int) ELPHEL_G(fd_exif[port]), 0, SEEK_SET); /// Select 0 (currently being acquired) Exif page
+    if (exif_page_start<0) return -1; //exif_page may be out of range
+    return read(ELPHEL_G(fd_exif[port]), page, page_size);
+}
+
+/// Big-endian 32-bit value from the Exif page, bytes are cast before shifting (a promoted signed int would overflow into bit 31)
+#define EXIF_BE32(page, offs) (((unsigned long) (page)[(offs)] << 24) | ((unsigned long) (page)[(offs)+1] << 16) | \
+                               ((unsigned long) (page)[(offs)+2] << 8) |  (unsigned long) (page)[(offs)+3])
+/// Field from the Exif directory (index 'indx', tag 'ltag') is present in the template and the page has at least 'size' bytes of it
+#define EXIF_FIELD_IN_PAGE(indx, ltag_value, size, page_len) \
+    ((ELPHEL_G(exif_dir)[indx].ltag == (ltag_value)) && ((ELPHEL_G(exif_dir)[indx].dst + (size)) <= (page_len)))
+
+/**
+ * @brief Decode fields used by the Elphel cameras from the Exif page, using offsets from the Exif directory (see createExifDirectory())
+ * @param page - Exif page (as read by read_exif_page())
+ * @param page_len - number of bytes in the page
+ * @param exif - structure to fill, exif->present is a bit mask (EXIF_ELPHEL_*) of the decoded fields,
+ *               EXIF_ELPHEL_GPS_FIX is set when the GPS data describes a real 2D/3D fix
+ */
+void decode_exif_elphel (const unsigned char * page, long page_len, struct elphel_exif_elphel_t * exif) {
+    long dst, len;
+    int i;
+    int gps_valid=1;
+    memset (exif, 0, sizeof(struct elphel_exif_elphel_t));
+
+    ///Image Description
+    if (EXIF_FIELD_IN_PAGE(Exif_Image_ImageDescription_Index, Exif_Image_ImageDescription, 0, page_len)) {
+        dst= ELPHEL_G(exif_dir)[Exif_Image_ImageDescription_Index].dst;
+        len= ELPHEL_G(exif_dir)[Exif_Image_ImageDescription_Index].len;
+        if (len > (sizeof(exif->image_description) - 1)) len= sizeof(exif->image_description) - 1;
+        if (len > (page_len - dst))                      len= page_len - dst;
+        memcpy (exif->image_description, &page[dst], len);
+        exif->present |= EXIF_ELPHEL_DESCRIPTION;
+    }
+    ///Exif_Image_FrameNumber_Index           0x13
+    if (EXIF_FIELD_IN_PAGE(Exif_Image_ImageNumber_Index, Exif_Image_ImageNumber, 4, page_len)) {
+        exif->frame_number= (long) EXIF_BE32(page, ELPHEL_G(exif_dir)[Exif_Image_ImageNumber_Index].dst);
+        exif->present |= EXIF_ELPHEL_FRAME_NUMBER;
+    }
+    ///Exif_Image_PageNumber_Index           0x15 - mostly for testing - should be == port
+    if (EXIF_FIELD_IN_PAGE(Exif_Image_PageNumber_Index, Exif_Image_PageNumber, 4, page_len)) {
+        exif->frame_page= (long) EXIF_BE32(page, ELPHEL_G(exif_dir)[Exif_Image_PageNumber_Index].dst);
+        exif->present |= EXIF_ELPHEL_FRAME_PAGE;
+    }
+    ///Exif_Image_Orientation_Index           0x15 - SHORT, only the low (second) byte is used
+    if (EXIF_FIELD_IN_PAGE(Exif_Image_Orientation_Index, Exif_Image_Orientation, 2, page_len)) {
+        exif->orientation= page[ELPHEL_G(exif_dir)[Exif_Image_Orientation_Index].dst + 1];
+        exif->present |= EXIF_ELPHEL_ORIENTATION;
+    }
+    ///DateTimeOriginal (with subseconds)
+    if (EXIF_FIELD_IN_PAGE(Exif_Photo_DateTimeOriginal_Index, Exif_Photo_DateTimeOriginal, 19, page_len)) {
+        memcpy (exif->date_time_original, &page[ELPHEL_G(exif_dir)[Exif_Photo_DateTimeOriginal_Index].dst], 19);
+        if (EXIF_FIELD_IN_PAGE(Exif_Photo_SubSecTimeOriginal_Index, Exif_Photo_SubSecTimeOriginal, 7, page_len)) {
+            exif->date_time_original[19]='.';
+            memcpy (&exif->date_time_original[20], &page[ELPHEL_G(exif_dir)[Exif_Photo_SubSecTimeOriginal_Index].dst], 7);
+        }
+        exif->present |= EXIF_ELPHEL_DATE_TIME;
+    }
+    ///Exif_Photo_ExposureTime
+    if (EXIF_FIELD_IN_PAGE(Exif_Photo_ExposureTime_Index, Exif_Photo_ExposureTime, 8, page_len)) {
+        dst= ELPHEL_G(exif_dir)[Exif_Photo_ExposureTime_Index].dst;
+        exif->exposure=(1.0*EXIF_BE32(page, dst))/EXIF_BE32(page, dst+4);
+        exif->present |= EXIF_ELPHEL_EXPOSURE;
+    }
+    ///Exif_Photo_MakerNote
+    if (EXIF_FIELD_IN_PAGE(Exif_Photo_MakerNote_Index, Exif_Photo_MakerNote, 64, page_len)) {
+        dst= ELPHEL_G(exif_dir)[Exif_Photo_MakerNote_Index].dst;
+        for (i=0; i<16; i++) exif->maker_note[i]= EXIF_BE32(page, dst + 4*i);
+        exif->present |= EXIF_ELPHEL_MAKER_NOTE;
+    }
+    /// GPS measure mode
+    if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_GPSMeasureMode_Index, Exif_GPSInfo_GPSMeasureMode, 1, page_len)) {
+        exif->gps_measure_mode[0]= page[ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSMeasureMode_Index].dst];
+        exif->present |= EXIF_ELPHEL_GPS_MODE;
+    }
+    ///GPS date/time
+    if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_GPSDateStamp_Index, Exif_GPSInfo_GPSDateStamp, 10, page_len)) {
+        memcpy (exif->gps_date, &page[ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSDateStamp_Index].dst], 10);
+        if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_GPSTimeStamp_Index, Exif_GPSInfo_GPSTimeStamp, 24, page_len)) {
+            dst= ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSTimeStamp_Index].dst;
+            exif->gps_hours=   EXIF_BE32(page, dst);
+            exif->gps_minutes= EXIF_BE32(page, dst+8);
+            exif->gps_seconds= (1.0*(EXIF_BE32(page, dst+16)+1))/EXIF_BE32(page, dst+20); /// GPS likes ".999", let's inc by one - anyway will round that out
+            exif->present |= EXIF_ELPHEL_GPS_TIME;
+        }
+        exif->present |= EXIF_ELPHEL_GPS_DATE;
+    }
+    /// knowing format provided from GPS - degrees and minutes only, no seconds:
+    ///GPS Longitude
+    if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_GPSLongitude_Index, Exif_GPSInfo_GPSLongitude, 24, page_len)) {
+        dst= ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLongitude_Index].dst;
+        exif->longitude=EXIF_BE32(page, dst)/(1.0*EXIF_BE32(page, dst+4)) + EXIF_BE32(page, dst+8)/(60.0*EXIF_BE32(page, dst+12));
+        if (!EXIF_BE32(page, dst+4) || !EXIF_BE32(page, dst+12)) gps_valid=0; /// no fix - zero denominators (value is kept as is)
+        if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_GPSLongitudeRef_Index, Exif_GPSInfo_GPSLongitudeRef, 1, page_len) &&
+                (page[ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLongitudeRef_Index].dst] != 'E')) exif->longitude=-exif->longitude;
+        exif->present |= EXIF_ELPHEL_LONGITUDE;
+    }
+    ///GPS Latitude
+    if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_GPSLatitude_Index, Exif_GPSInfo_GPSLatitude, 24, page_len)) {
+        dst= ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLatitude_Index].dst;
+        exif->latitude=EXIF_BE32(page, dst)/(1.0*EXIF_BE32(page, dst+4)) + EXIF_BE32(page, dst+8)/(60.0*EXIF_BE32(page, dst+12));
+        if (!EXIF_BE32(page, dst+4) || !EXIF_BE32(page, dst+12)) gps_valid=0; /// no fix - zero denominators (value is kept as is)
+        if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_GPSLatitudeRef_Index, Exif_GPSInfo_GPSLatitudeRef, 1, page_len) &&
+                (page[ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSLatitudeRef_Index].dst] != 'N')) exif->latitude=-exif->latitude;
+        exif->present |= EXIF_ELPHEL_LATITUDE;
     }
     ///GPS Altitude
-    if (ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSAltitude_Index].ltag==Exif_GPSInfo_GPSAltitude) { // Exif_GPSInfo_GPSAltitude is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSAltitude_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), rational3, 8);
-        altitude=(1.0*__cpu_to_be32( rational3[0]))/__cpu_to_be32( rational3[1]);
-
-        if (ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSAltitudeRef_Index].ltag==Exif_GPSInfo_GPSAltitudeRef) {
-            lseek (ELPHEL_G(fd_exif[port]),
-                    exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSAltitudeRef_Index].dst,
-                    SEEK_SET);
-            read(ELPHEL_G(fd_exif[port]), val, 1);
-            if (val[0] != '\0') altitude=-altitude;
-        }
-        sprintf (val,"%f",altitude);
-        add_assoc_string(return_value, "GPSAltitude", val,  1);
+    if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_GPSAltitude_Index, Exif_GPSInfo_GPSAltitude, 8, page_len)) {
+        dst= ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSAltitude_Index].dst;
+        exif->altitude=(1.0*EXIF_BE32(page, dst))/EXIF_BE32(page, dst+4);
+        if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_GPSAltitudeRef_Index, Exif_GPSInfo_GPSAltitudeRef, 1, page_len) &&
+                (page[ELPHEL_G(exif_dir)[Exif_GPSInfo_GPSAltitudeRef_Index].dst] != '\0')) exif->altitude=-exif->altitude;
+        exif->present |= EXIF_ELPHEL_ALTITUDE;
     }
     ///Compass Direction (magnetic)
-    if (ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassDirection_Index].ltag==Exif_GPSInfo_CompassDirection) { // Exif_GPSInfo_CompassDirection is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassDirection_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), rational3, 8);
-        heading=(1.0*__cpu_to_be32( rational3[0]))/__cpu_to_be32( rational3[1]);
-        sprintf (val,"%f",heading);
-        add_assoc_string(return_value, "CompassDirection", val,  1);
+    if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_CompassDirection_Index, Exif_GPSInfo_CompassDirection, 8, page_len)) {
+        dst= ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassDirection_Index].dst;
+        exif->heading=(1.0*EXIF_BE32(page, dst))/EXIF_BE32(page, dst+4);
+        exif->present |= EXIF_ELPHEL_HEADING;
     }
     ///Processing 'hacked' pitch and roll (made of Exif destination latitude/longitude)
     ///Compass Roll
-    if (ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassRoll_Index].ltag==Exif_GPSInfo_CompassRoll) { // Exif_GPSInfo_CompassRoll is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassRoll_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), rational3, 8);
-        roll=(1.0*__cpu_to_be32( rational3[0]))/__cpu_to_be32( rational3[1]);
+    if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_CompassRoll_Index, Exif_GPSInfo_CompassRoll, 8, page_len)) {
+        dst= ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassRoll_Index].dst;
+        exif->roll=(1.0*EXIF_BE32(page, dst))/EXIF_BE32(page, dst+4);
+        if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_CompassRollRef_Index, Exif_GPSInfo_CompassRollRef, 1, page_len) &&
+                (page[ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassRollRef_Index].dst] != EXIF_COMPASS_ROLL_ASCII[0])) exif->roll=-exif->roll;
+        exif->present |= EXIF_ELPHEL_ROLL;
+    }
+    ///Compass Pitch
+    if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_CompassPitch_Index, Exif_GPSInfo_CompassPitch, 8, page_len)) {
+        dst= ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassPitch_Index].dst;
+        exif->pitch=(1.0*EXIF_BE32(page, dst))/EXIF_BE32(page, dst+4);
+        if (EXIF_FIELD_IN_PAGE(Exif_GPSInfo_CompassPitchRef_Index, Exif_GPSInfo_CompassPitchRef, 1, page_len) &&
+                (page[ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassPitchRef_Index].dst] != EXIF_COMPASS_PITCH_ASCII[0])) exif->pitch=-exif->pitch;
+        exif->present |= EXIF_ELPHEL_PITCH;
+    }
+    /// GPS fix: 2D or 3D measurement and both coordinates decoded to finite numbers
+    if (gps_valid &&
+            ((exif->present & (EXIF_ELPHEL_GPS_MODE | EXIF_ELPHEL_LONGITUDE | EXIF_ELPHEL_LATITUDE)) == (EXIF_ELPHEL_GPS_MODE | EXIF_ELPHEL_LONGITUDE | EXIF_ELPHEL_LATITUDE)) &&
+            ((exif->gps_measure_mode[0] == '2') || (exif->gps_measure_mode[0] == '3')) &&
+            isfinite(exif->longitude) && isfinite(exif->latitude)) exif->present |= EXIF_ELPHEL_GPS_FIX;
+}
 
-        if (ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassRollRef_Index].ltag==Exif_GPSInfo_CompassRollRef) {
-            lseek (ELPHEL_G(fd_exif[port]),
-                    exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassRollRef_Index].dst,
-                    SEEK_SET);
-            read(ELPHEL_G(fd_exif[port]), val, 1);
-            if (val[0] != EXIF_COMPASS_ROLL_ASCII[0]) roll=-roll;
-        }
-        sprintf (val,"%f",roll);
-        add_assoc_string(return_value, "CompassRoll", val,  1);
+/**
+ * @brief Add decoded Exif fields to the associative array as strings, the same way elphel_get_exif_elphel() always did
+ * @param arr - initialized array
+ * @param exif - decoded Exif fields (see decode_exif_elphel())
+ */
+void add_assoc_exif_elphel (zval * arr, const struct elphel_exif_elphel_t * exif) {
+    char val[256];
+    if (exif->present & EXIF_ELPHEL_DESCRIPTION) add_assoc_string(arr, "ImageDescription", (char *) exif->image_description,  1);
+    if (exif->present & EXIF_ELPHEL_FRAME_NUMBER) {
+        sprintf (val,"%ld", exif->frame_number);
+        add_assoc_string(arr, "FrameNumber", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_FRAME_PAGE) {
+        sprintf (val,"%ld", exif->frame_page);
+        add_assoc_string(arr, "FramePage", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_ORIENTATION) {
+        sprintf (val,"%ld", exif->orientation);
+        add_assoc_string(arr, "Orientation", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_DATE_TIME) add_assoc_string(arr, "DateTimeOriginal", (char *) exif->date_time_original,  1);
+    if (exif->present & EXIF_ELPHEL_EXPOSURE) {
+        sprintf (val,"%f",exif->exposure);
+        add_assoc_string(arr, "ExposureTime", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_MAKER_NOTE) {
+        sprintf (val,"0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx,0x%08lx",
+                exif->maker_note[0],  exif->maker_note[1],  exif->maker_note[2],  exif->maker_note[3],
+                exif->maker_note[4],  exif->maker_note[5],  exif->maker_note[6],  exif->maker_note[7],
+                exif->maker_note[8],  exif->maker_note[9],  exif->maker_note[10], exif->maker_note[11],
+                exif->maker_note[12], exif->maker_note[13], exif->maker_note[14], exif->maker_note[15]);
+        add_assoc_string(arr, "MakerNote", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_GPS_MODE) add_assoc_stringl(arr, "GPSMeasureMode", (char *) exif->gps_measure_mode, 1,  1);
+    if (exif->present & EXIF_ELPHEL_GPS_DATE) {
+        memcpy (val, exif->gps_date, 10);
+        val[10]='\0';
+        if (exif->present & EXIF_ELPHEL_GPS_TIME) sprintf (&val[10]," %02d:%02d:%05.2f",exif->gps_hours,exif->gps_minutes,exif->gps_seconds);
+        add_assoc_string(arr, "GPSDateTime", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_LONGITUDE) {
+        sprintf (val,"%f",exif->longitude);
+        add_assoc_string(arr, "GPSLongitude", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_LATITUDE) {
+        sprintf (val,"%f",exif->latitude);
+        add_assoc_string(arr, "GPSLatitude", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_ALTITUDE) {
+        sprintf (val,"%f",exif->altitude);
+        add_assoc_string(arr, "GPSAltitude", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_HEADING) {
+        sprintf (val,"%f",exif->heading);
+        add_assoc_string(arr, "CompassDirection", val,  1);
     }
+    if (exif->present & EXIF_ELPHEL_ROLL) {
+        sprintf (val,"%f",exif->roll);
+        add_assoc_string(arr, "CompassRoll", val,  1);
+    }
+    if (exif->present & EXIF_ELPHEL_PITCH) {
+        sprintf (val,"%f",exif->pitch);
+        add_assoc_string(arr, "CompassPitch", val,  1);
+    }
+}
 
-    ///Compass Pitch
-    if (ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassPitch_Index].ltag==Exif_GPSInfo_CompassPitch) { // Exif_GPSInfo_CompassPitch is present in template
-        lseek (ELPHEL_G(fd_exif[port]),
-                exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassPitch_Index].dst,
-                SEEK_SET);
-        read(ELPHEL_G(fd_exif[port]), rational3, 8);
-        pitch=(1.0*__cpu_to_be32( rational3[0]))/__cpu_to_be32( rational3[1]);
+PHP_FUNCTION(elphel_get_exif_elphel)
+{
+    long port;
+    long exif_page=0;
+    long page_len;
+    unsigned char * page;
+    struct elphel_exif_elphel_t exif;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll", &port, &exif_page) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+
+    createExifDirectory(0); /// make sure directory is current
+    if (ELPHEL_G(exif_size) <= 0) RETURN_NULL();
+    page= (unsigned char *) emalloc(ELPHEL_G(exif_size));
+    page_len= read_exif_page(port, exif_page, page, ELPHEL_G(exif_size)); /// one read instead of lseek/read per field
+    if (page_len < 0) {
+        efree(page);
+        RETURN_NULL(); //exif_page may be out of range
+    }
+    decode_exif_elphel(page, page_len, &exif);
+    efree(page);
+    array_init(return_value);
+    add_assoc_exif_elphel(return_value, &exif);
+}
+
+/**
+ * @brief Decode Elphel Exif fields of many Exif pages at once, return them as typed columns (one array per field)
+ * @param port - sensor port (0..3)
+ * @param pages - array of Exif page numbers (meta_index of the frames, see elphel_get_interframe_meta_batch())
+ * @param field_mask - (optional) bitmask of the columns to return, default - all:
+ * - bit  0 (0x0001) - "ImageDescription" (string)
+ * - bit  1 (0x0002) - "FrameNumber" (integer)
+ * - bit  2 (0x0004) - "FramePage" (integer)
+ * - bit  3 (0x0008) - "Orientation" (integer)
+ * - bit  4 (0x0010) - "DateTimeOriginal" (string, with subseconds)
+ * - bit  5 (0x0020) - "ExposureTime" (double, seconds)
+ * - bit  6 (0x0040) - "MakerNote" (array of 16 integers)
+ * - bit  7 (0x0080) - "GPSMeasureMode" (integer, 2 or 3)
+ * - bit  8 (0x0100) - "GPSDateTime" (string, same format as elphel_get_exif_elphel())
+ * - bit 10 (0x0400) - "GPSLongitude" (double, degrees, negative - West)
+ * - bit 11 (0x0800) - "GPSLatitude" (double, degrees, negative - South)
+ * - bit 12 (0x1000) - "GPSAltitude" (double, meters)
+ * - bit 13 (0x2000) - "CompassDirection" (double, degrees)
+ * - bit 14 (0x4000) - "CompassRoll" (double, degrees)
+ * - bit 15 (0x8000) - "CompassPitch" (double, degrees)
+ * @return NULL - error, otherwise associative array of indexed arrays, all of the same length as pages.
+ *         Column "valid" is always present (false - page is out of range), fields missing in a page are NULL
+ */
+PHP_FUNCTION(elphel_get_exif_batch)
+{
+    const char * column_names[] = {"ImageDescription", "FrameNumber", "FramePage", "Orientation", "DateTimeOriginal", "ExposureTime",
+                                   "MakerNote", "GPSMeasureMode", "GPSDateTime", NULL, "GPSLongitude", "GPSLatitude", "GPSAltitude",
+                                   "CompassDirection", "CompassRoll", "CompassPitch"};
+    zval * columns[EXIF_ELPHEL_COLUMNS];
+    zval * valid_column;
+    zval * maker_note;
+    long port;
+    long field_mask=EXIF_ELPHEL_ALL;
+    long exif_page, page_len;
+    unsigned char * page;
+    char val[32];
+    int i, j;
+    struct elphel_exif_elphel_t exif;
+    zval *arr, **data;
+    HashTable *arr_hash;
+    HashPosition pointer;
 
-        if (ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassPitchRef_Index].ltag==Exif_GPSInfo_CompassPitchRef) {
-            lseek (ELPHEL_G(fd_exif[port]),
-                    exif_page_start+ELPHEL_G(exif_dir)[Exif_GPSInfo_CompassPitchRef_Index].dst,
-                    SEEK_SET);
-            read(ELPHEL_G(fd_exif[port]), val, 1);
-            if (val[0] != EXIF_COMPASS_PITCH_ASCII[0]) pitch=-pitch;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "la|l", &port, &arr, &field_mask) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    field_mask &= EXIF_ELPHEL_ALL & ~EXIF_ELPHEL_GPS_TIME; /// GPS time is a part of "GPSDateTime"
+    createExifDirectory(0); /// make sure directory is current
+    if (ELPHEL_G(exif_size) <= 0) RETURN_NULL();
+    page= (unsigned char *) emalloc(ELPHEL_G(exif_size));
+    arr_hash = Z_ARRVAL_P(arr);
+    array_init(return_value);
+    ALLOC_INIT_ZVAL(valid_column);
+    array_init(valid_column);
+    for (i=0; i < EXIF_ELPHEL_COLUMNS; i++) {
+        columns[i]=NULL;
+        if (field_mask & (1 << i)) {
+            ALLOC_INIT_ZVAL(columns[i]);
+            array_init(columns[i]);
+        }
+    }
+    for(zend_hash_internal_pointer_reset_ex(arr_hash, &pointer);
+            zend_hash_get_current_data_ex(arr_hash, (void**) &data, &pointer) == SUCCESS;
+            zend_hash_move_forward_ex(arr_hash, &pointer)) {
+        exif_page = (Z_TYPE_PP(data) == IS_LONG)? Z_LVAL_PP(data) : -1;
+        page_len= (exif_page >= 0)? read_exif_page(port, exif_page, page, ELPHEL_G(exif_size)) : -1;
+        if (page_len < 0) memset (&exif, 0, sizeof(exif));
+        else              decode_exif_elphel(page, page_len, &exif);
+        add_next_index_bool(valid_column, page_len >= 0);
+        for (i=0; i < EXIF_ELPHEL_COLUMNS; i++) if (columns[i]) {
+            if (!(exif.present & (1 << i))) {
+                add_next_index_null(columns[i]);
+                continue;
+            }
+            switch (1 << i) {
+            case EXIF_ELPHEL_DESCRIPTION:  add_next_index_string(columns[i], exif.image_description, 1); break;
+            case EXIF_ELPHEL_FRAME_NUMBER: add_next_index_long  (columns[i], exif.frame_number); break;
+            case EXIF_ELPHEL_FRAME_PAGE:   add_next_index_long  (columns[i], exif.frame_page); break;
+            case EXIF_ELPHEL_ORIENTATION:  add_next_index_long  (columns[i], exif.orientation); break;
+            case EXIF_ELPHEL_DATE_TIME:    add_next_index_string(columns[i], exif.date_time_original, 1); break;
+            case EXIF_ELPHEL_EXPOSURE:     add_next_index_double(columns[i], exif.exposure); break;
+            case EXIF_ELPHEL_MAKER_NOTE:
+                ALLOC_INIT_ZVAL(maker_note);
+                array_init(maker_note);
+                for (j=0; j<16; j++) add_next_index_long(maker_note, exif.maker_note[j]);
+                add_next_index_zval(columns[i], maker_note);
+                break;
+            case EXIF_ELPHEL_GPS_MODE:     add_next_index_long  (columns[i], exif.gps_measure_mode[0] - '0'); break;
+            case EXIF_ELPHEL_GPS_DATE:
+                memcpy (val, exif.gps_date, 10);
+                val[10]='\0';
+                if (exif.present & EXIF_ELPHEL_GPS_TIME) sprintf (&val[10]," %02d:%02d:%05.2f",exif.gps_hours,exif.gps_minutes,exif.gps_seconds);
+                add_next_index_string(columns[i], val, 1);
+                break;
+            case EXIF_ELPHEL_LONGITUDE:    add_next_index_double(columns[i], exif.longitude); break;
+            case EXIF_ELPHEL_LATITUDE:     add_next_index_double(columns[i], exif.latitude); break;
+            case EXIF_ELPHEL_ALTITUDE:     add_next_index_double(columns[i], exif.altitude); break;
+            case EXIF_ELPHEL_HEADING:      add_next_index_double(columns[i], exif.heading); break;
+            case EXIF_ELPHEL_ROLL:         add_next_index_double(columns[i], exif.roll); break;
+            case EXIF_ELPHEL_PITCH:        add_next_index_double(columns[i], exif.pitch); break;
+            default:                       add_next_index_null  (columns[i]);
+            }
         }
-        sprintf (val,"%f",pitch);
-        add_assoc_string(return_value, "CompassPitch", val,  1);
     }
+    efree(page);
+    add_assoc_zval(return_value, "valid", valid_column);
+    for (i=0; i < EXIF_ELPHEL_COLUMNS; i++) if (columns[i]) add_assoc_zval(return_value, column_names[i], columns[i]);
+}
+
+/**
+ * @brief Format text into the track output buffer, send the buffer to the output when it is nearly full
+ * @param out - output buffer
+ * @param format - printf() format
+ */
+void track_printf (struct elphel_track_out_t * out, const char * format, ...) {
+    va_list args;
+    int len;
+    if ((out->len + TRACK_LINE_MAXSIZE) > sizeof(out->buf)) {
+        PHPWRITE(out->buf, out->len);
+        out->len=0;
+    }
+    va_start(args, format);
+    len= vsnprintf(out->buf + out->len, TRACK_LINE_MAXSIZE, format, args);
+    va_end(args);
+    if (len >= TRACK_LINE_MAXSIZE) len= TRACK_LINE_MAXSIZE - 1; /// truncated
+    if (len > 0) out->len += len;
+}
+
+/**
+ * @brief Add text with XML special characters escaped to the track output buffer
+ * @param out - output buffer
+ * @param text - text to escape
+ */
+void track_xml_escaped (struct elphel_track_out_t * out, const char * text) {
+    for (; *text; text++) switch (*text) {
+    case '<':  track_printf(out, "&lt;");   break;
+    case '>':  track_printf(out, "&gt;");   break;
+    case '&':  track_printf(out, "&amp;");  break;
+    case '"':  track_printf(out, "&quot;"); break;
+    default:   track_printf(out, "%c", *text);
+    }
+}
+
+/**
+ * @brief Generate KML or GeoJSON track of the frames currently in the circbuf and send it to the output.
+ * Frames are visited oldest first, GPS position, altitude, compass direction, roll, pitch and DateTimeOriginal are decoded
+ * from the Exif page of each frame in memory (see decode_exif_elphel()).
+ * KML has a Placemark with a Camera (tilt = 90 + pitch) and a Point for each frame, GeoJSON - a FeatureCollection of Point features
+ * with time, frame number and orientation in the properties. Times are converted from DateTimeOriginal to ISO 8601 (UTC).
+ * @param port - sensor port (0..3)
+ * @param format - (optional) "kml" (default) or "geojson"
+ * @param options - (optional) associative array:
+ * - "name"        - KML document name (default "Elphel camera track")
+ * - "second"      - start from the second oldest frame, the oldest one may be overwritten soon (default true)
+ * - "step"        - use every step-th frame (default 1)
+ * - "max_points"  - stop after this number of points, 0 (default) - no limit
+ * - "require_gps" - skip frames without a valid 2D/3D GPS fix (default true)
+ * - "headers"     - send Content-Type header (default true)
+ * @return NULL - error, otherwise number of points in the track
+ */
+PHP_FUNCTION(elphel_export_track)
+{
+    long port;
+    char * format="kml";
+    int format_len=3;
+    zval * options=NULL;
+    HashTable * options_hash;
+    int geojson;
+    long step, max_points, require_gps, second;
+    long num_frames, i, points=0;
+    long * pointers;
+    long page_len;
+    unsigned char * page;
+    char when[32];
+    struct interframe_params_t frame_params;
+    struct elphel_exif_elphel_t exif;
+    struct elphel_track_out_t * out;
 
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|sa", &port, &format, &format_len, &options) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    if      (!strcasecmp(format, "kml"))     geojson=0;
+    else if (!strcasecmp(format, "geojson")) geojson=1;
+    else {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Unsupported track format \"%s\", should be \"kml\" or \"geojson\"", format);
+        RETURN_NULL();
+    }
+    options_hash= options? Z_ARRVAL_P(options) : NULL;
+    step=        get_option_long(options_hash, "step", 1);
+    max_points=  get_option_long(options_hash, "max_points", 0);
+    require_gps= get_option_long(options_hash, "require_gps", 1);
+    second=      get_option_long(options_hash, "second", 1);
+    if (step < 1) step=1;
+    createExifDirectory(0); /// make sure directory is current
+    if (ELPHEL_G(exif_size) <= 0) RETURN_NULL();
+    if (get_option_long(options_hash, "headers", 1)) {
+        if (geojson) sapi_add_header("Content-Type: application/geo+json", sizeof("Content-Type: application/geo+json") - 1, 1);
+        else         sapi_add_header("Content-Type: application/vnd.google-earth.kml+xml", sizeof("Content-Type: application/vnd.google-earth.kml+xml") - 1, 1);
+    }
+    num_frames= get_circbuf_frames(port, second, &pointers);
+    page= (unsigned char *) emalloc(ELPHEL_G(exif_size));
+    out=  (struct elphel_track_out_t *) emalloc(sizeof(struct elphel_track_out_t));
+    out->len=0;
+    if (geojson) {
+        track_printf(out, "{\"type\":\"FeatureCollection\",\"features\":[");
+    } else {
+        track_printf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n<Document>\n<name>");
+        track_xml_escaped(out, get_option_string(options_hash, "name", "Elphel camera track"));
+        track_printf(out, "</name>\n");
+    }
+    for (i=0; (i < num_frames) && (!max_points || (points < max_points)); i+=step) {
+        if (get_interframe_meta(port, pointers[i], &frame_params) < 0) continue; /// overwritten
+        page_len= read_exif_page(port, frame_params.meta_index, page, ELPHEL_G(exif_size));
+        if (page_len < 0) continue;
+        decode_exif_elphel(page, page_len, &exif);
+        if (require_gps && !(exif.present & EXIF_ELPHEL_GPS_FIX)) continue;
+        if (!isfinite(exif.longitude) || !isfinite(exif.latitude)) continue; /// never output "nan" coordinates
+        if (!isfinite(exif.altitude)) exif.altitude= 0.0;
+        /// "YYYY:MM:DD HH:MM:SS.ssssss" -> "YYYY-MM-DDTHH:MM:SS.ssssssZ"
+        when[0]='\0';
+        if (exif.present & EXIF_ELPHEL_DATE_TIME) {
+            snprintf(when, sizeof(when), "%sZ", exif.date_time_original);
+            when[4]='-';
+            when[7]='-';
+            when[10]='T';
+        }
+        if (geojson) {
+            track_printf(out, "%s\n{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":[%.7f,%.7f,%.2f]},\"properties\":{",
+                    points? ",":"", exif.longitude, exif.latitude, exif.altitude);
+            track_printf(out, "\"circbuf_pointer\":%ld", pointers[i]);
+            if (exif.present & EXIF_ELPHEL_FRAME_NUMBER) track_printf(out, ",\"frame\":%ld", exif.frame_number);
+            if (when[0])                                 track_printf(out, ",\"time\":\"%s\"", when);
+            if (exif.present & EXIF_ELPHEL_HEADING)      track_printf(out, ",\"heading\":%.3f", exif.heading);
+            if (exif.present & EXIF_ELPHEL_ROLL)         track_printf(out, ",\"roll\":%.3f", exif.roll);
+            if (exif.present & EXIF_ELPHEL_PITCH)        track_printf(out, ",\"pitch\":%.3f", exif.pitch);
+            track_printf(out, "}}");
+        } else {
+            track_printf(out, "<Placemark>\n");
+            if (exif.present & EXIF_ELPHEL_FRAME_NUMBER) track_printf(out, "<name>%ld</name>\n", exif.frame_number);
+            if (when[0])                                 track_printf(out, "<TimeStamp><when>%s</when></TimeStamp>\n", when);
+            track_printf(out, "<Camera><longitude>%.7f</longitude><latitude>%.7f</latitude><altitude>%.2f</altitude>"
+                    "<heading>%.3f</heading><tilt>%.3f</tilt><roll>%.3f</roll><altitudeMode>absolute</altitudeMode></Camera>\n",
+                    exif.longitude, exif.latitude, exif.altitude, exif.heading, 90.0 + exif.pitch, exif.roll);
+            track_printf(out, "<Point><altitudeMode>absolute</altitudeMode><coordinates>%.7f,%.7f,%.2f</coordinates></Point>\n</Placemark>\n",
+                    exif.longitude, exif.latitude, exif.altitude);
+        }
+        points++;
+    }
+    if (geojson) track_printf(out, "\n]}\n");
+    else         track_printf(out, "</Document>\n</kml>\n");
+    PHPWRITE(out->buf, out->len);
+    efree(out);
+    efree(page);
+    if (pointers) efree(pointers);
+    RETURN_LONG(points);
 }
 
 PHP_FUNCTION(elphel_update_exif) {
@@ -1890,7 +2756,7 @@ PHP_FUNCTION(elphel_get_exif_field)
     long port;
     long exif_page=0;
     long ltag;
-    struct exif_dir_table_t dir_table_entry;
+    struct exif_dir_table_t * dir_table_entry;
     char * rslt;
     int found=0;
 
@@ -1899,25 +2765,20 @@ PHP_FUNCTION(elphel_get_exif_field)
     }
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_EXIF) < 0) RETURN_NULL();
 
-    // find the ltag in the directory (may need to scan all the directory)
-    lseek ((int) ELPHEL_G(fd_exifdir), 0, SEEK_SET);
-    while (read((int) ELPHEL_G(fd_exifdir), &dir_table_entry, sizeof(dir_table_entry))>0) {
-        if (dir_table_entry.ltag==ltag) {
-            found=1;
-            break;
-        }
-    }
-    if (!found) RETURN_NULL();
+    createExifDirectory(0); /// make sure directory is current
+    dir_table_entry= exif_dir_find(ltag);
+    if (!dir_table_entry) RETURN_NULL();
     //    lseek (fd_exifdir, 0, SEEK_SET);
     if (exif_page) found= lseek ((int) ELPHEL_G(fd_exif[port]), exif_page, SEEK_END); /// select specified Exif page
     else           found= lseek ((int) ELPHEL_G(fd_exif[port]), 0, SEEK_SET); /// Select 0 (currently being acquired) Exif page
     if (found<0) RETURN_NULL(); //exif_page may be out of range
 
-    lseek ((int) ELPHEL_G(fd_exif[port]), dir_table_entry.dst, SEEK_CUR);
-    rslt=emalloc(dir_table_entry.len);
-    read((int) ELPHEL_G(fd_exif[port]), rslt, dir_table_entry.len);
-    RETURN_STRINGL(rslt,dir_table_entry.len,0);
+    lseek ((int) ELPHEL_G(fd_exif[port]), dir_table_entry->dst, SEEK_CUR);
+    rslt=emalloc(dir_table_entry->len);
+    read((int) ELPHEL_G(fd_exif[port]), rslt, dir_table_entry->len);
+    RETURN_STRINGL(rslt,dir_table_entry->len,0);
 }
 
 
@@ -1926,27 +2787,21 @@ PHP_FUNCTION(elphel_set_exif_field)
 {
     long port;
     long ltag;
-    struct exif_dir_table_t dir_table_entry;
+    struct exif_dir_table_t * dir_table_entry;
     char * value;
     int value_length;
-    int found=0;
 
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "lls", &port, &ltag, &value, &value_length) == FAILURE) {
         RETURN_NULL();
     }
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
-    // find the ltag in the directory (may need to scan all the directory)
-    lseek ((int) ELPHEL_G(fd_exifdir), 0, SEEK_SET);
-    while (read((int) ELPHEL_G(fd_exifdir), &dir_table_entry, sizeof(dir_table_entry))>0) {
-        if (dir_table_entry.ltag==ltag) {
-            found=1;
-            break;
-        }
-    }
-    if (!found) RETURN_NULL();
-    lseek ((int) ELPHEL_G(fd_exifmeta[port]), dir_table_entry.src, SEEK_SET);
-    if (value_length>dir_table_entry.len) value_length = dir_table_entry.len;
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_EXIF) < 0) RETURN_NULL();
+    createExifDirectory(0); /// make sure directory is current
+    dir_table_entry= exif_dir_find(ltag);
+    if (!dir_table_entry) RETURN_NULL();
+    lseek ((int) ELPHEL_G(fd_exifmeta[port]), dir_table_entry->src, SEEK_SET);
+    if (value_length>dir_table_entry->len) value_length = dir_table_entry->len;
     ///NOTE:DEBUG
     // php_printf ("value=%s, value_length=%d\n",value, value_length);
     long rslt=write(ELPHEL_G(fd_exifmeta[port]), value, value_length);
@@ -1954,145 +2809,1299 @@ PHP_FUNCTION(elphel_set_exif_field)
     RETURN_LONG(rslt);
 }
 
+/// qsort() comparator for elphel_set_exif_fields() - order writes by their location in the Exif meta data
+static int exif_write_compare (const void * a, const void * b) {
+    unsigned long src_a= ((const struct elphel_exif_write_t *) a)->src;
+    unsigned long src_b= ((const struct elphel_exif_write_t *) b)->src;
+    return (src_a > src_b) - (src_a < src_b);
+}
 
-//! wait for the next frame to be compressed (and related parameters updated
-PHP_FUNCTION(elphel_wait_frame)
+/**
+ * @brief Set several Exif fields at once. Tags are found in the cached Exif directory, writes to adjacent fields are merged
+ * into a single positioned vectored write (pwritev()), so all the fields are usually written with very few syscalls.
+ * As with elphel_set_exif_field() each value is truncated to the length of its field.
+ * @param port - sensor port (0..3)
+ * @param fields - associative array ltag=>value, values that are not strings are converted to strings
+ * @return NULL - wrong port, <0 - -errno of the first failed write, otherwise total number of bytes written.
+ *         Tags that are not in the Exif template are skipped with a warning
+ */
+PHP_FUNCTION(elphel_set_exif_fields)
 {
     long port;
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &port) == FAILURE) {
+    zval *arr, **data;
+    zval *values;
+    HashTable *arr_hash;
+    HashPosition pointer;
+    char *key;
+    int   key_len;
+    ulong index;
+    struct exif_dir_table_t * dir_table_entry;
+    struct elphel_exif_write_t * writes;
+    struct iovec iov[EXIF_WRITE_MAX_IOV];
+    int num_writes=0, num_values=0, i, num_iov;
+    unsigned long run_start, run_end;
+    long rslt, total=0;
+    int fd_exifmeta;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "la", &port, &arr) == FAILURE) {
         RETURN_NULL();
     }
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_NULL();
-    lseek((int) ELPHEL_G( fd_circ[port]), LSEEK_CIRC_TOWP, SEEK_END );
-    lseek((int) ELPHEL_G( fd_circ[port]), LSEEK_CIRC_WAIT, SEEK_END );
-    RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_EXIF) < 0) RETURN_NULL();
+    fd_exifmeta=ELPHEL_G(fd_exifmeta[port]);
+    arr_hash = Z_ARRVAL_P(arr);
+    if (zend_hash_num_elements(arr_hash) == 0) RETURN_LONG(0);
+    createExifDirectory(0); /// make sure directory is current
+    writes= (struct elphel_exif_write_t *) emalloc(zend_hash_num_elements(arr_hash) * sizeof(struct elphel_exif_write_t));
+    values= (zval *) emalloc(zend_hash_num_elements(arr_hash) * sizeof(zval)); /// string copies of non-string values
+    for(zend_hash_internal_pointer_reset_ex(arr_hash, &pointer);
+            zend_hash_get_current_data_ex(arr_hash, (void**) &data, &pointer) == SUCCESS;
+            zend_hash_move_forward_ex(arr_hash, &pointer)) {
+        if (zend_hash_get_current_key_ex(arr_hash, &key, &key_len, &index, 0, &pointer) != HASH_KEY_IS_LONG) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Exif tag should be an integer (ltag), got \"%s\"", key);
+            continue;
+        }
+        dir_table_entry= exif_dir_find(index);
+        if (!dir_table_entry) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Exif tag 0x%lx is not in the Exif template", (unsigned long) index);
+            continue;
+        }
+        writes[num_writes].src= dir_table_entry->src;
+        if (Z_TYPE_PP(data) == IS_STRING) {
+            writes[num_writes].data= Z_STRVAL_PP(data);
+            writes[num_writes].len=  Z_STRLEN_PP(data);
+        } else {
+            values[num_values]= **data;
+            zval_copy_ctor(&values[num_values]);
+            convert_to_string(&values[num_values]);
+            writes[num_writes].data= Z_STRVAL(values[num_values]);
+            writes[num_writes].len=  Z_STRLEN(values[num_values]);
+            num_values++;
+        }
+        if (writes[num_writes].len > dir_table_entry->len) writes[num_writes].len = dir_table_entry->len;
+        if (writes[num_writes].len > 0) num_writes++;
+    }
+    qsort(writes, num_writes, sizeof(struct elphel_exif_write_t), exif_write_compare);
+    /// merge writes that continue each other into runs, one pwritev() per run
+    for (i=0; i < num_writes; ) {
+        run_start= writes[i].src;
+        run_end=   run_start;
+        num_iov=   0;
+        while ((i < num_writes) && (writes[i].src == run_end) && (num_iov < EXIF_WRITE_MAX_IOV)) {
+            iov[num_iov].iov_base= (void *) writes[i].data;
+            iov[num_iov].iov_len=  writes[i].len;
+            run_end+= writes[i].len;
+            num_iov++;
+            i++;
+        }
+        rslt= pwritev(fd_exifmeta, iov, num_iov, run_start);
+        if (rslt < 0) {
+            total= -errno;
+            break;
+        }
+        total+= rslt;
+    }
+    for (i=0; i < num_values; i++) zval_dtor(&values[i]);
+    efree(values);
+    efree(writes);
+    RETURN_LONG(total);
 }
 
+/// Read 16/32-bit value from the TIFF structure in the Exif page
+#define EXIF_TIFF16(p, be) ((be)? (((p)[0] << 8) | (p)[1]) : (((p)[1] << 8) | (p)[0]))
+#define EXIF_TIFF32(p, be) ((be)? (((unsigned long) (p)[0] << 24) | ((unsigned long) (p)[1] << 16) | ((unsigned long) (p)[2] << 8) | (unsigned long) (p)[3]) : \
+                                 (((unsigned long) (p)[3] << 24) | ((unsigned long) (p)[2] << 16) | ((unsigned long) (p)[1] << 8) | (unsigned long) (p)[0]))
+
 /**
- * @brief Use current (for the specified frame) gamma table to convert input data (fraction <1.0) into output value (used by histograms)
- * @param port - sensor port (0..3)
- * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
- * @param color - needed color (0..3)
- * @param sensorLevel - level (0.0 <=level<1.0) proportional to the sensor output, normalized to 0.0..1.0 scale
- * @param frame (optional) absolute frame number for which gamma table is needed. NOTE: Will not wait if it is in the future - just return -1
- *               if frame is not specified - will use the previous to current frame - same as the one for which histogram is availble (or will be very soon)
- * @return -1 if too late (or other errors), otherwise a fraction of the full output level (0.0..1.0)
+ * @brief Parse TIFF IFD entries of the Exif page: IFD0 (and the following IFDs), Exif and GPS sub-IFDs
+ * @param page - Exif page, starts with APP1 marker (or "Exif\0\0" header)
+ * @param page_len - number of bytes in the page
+ * @param entries - array to receive the entries
+ * @param max_entries - size of the entries array
+ * @param big_endian - set to 1 for "MM" (Motorola) byte order, 0 - "II"
+ * @return number of entries found, <0 - no valid TIFF header in the page
  */
-
-PHP_FUNCTION(elphel_gamma)
-{
-    long port, sub_chn;
-    long   color;
-    long frame =-1;
-    double sensorLevel;
-    int indx,gamma_index;
-    unsigned long hash32; /// combined black, gamma, scale
-    unsigned long  write_data[2];
-    int rslt;
-    unsigned short * gamma_direct;
-    long lsensorLevel;
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llld|l", &port, &sub_chn, &color, &sensorLevel, &frame ) == FAILURE) {
-        RETURN_LONG (-1);
-    }
-    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
-    if ((port <0) || (port >= SENSOR_PORTS))
-        RETURN_LONG (-1);
-    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
-        RETURN_LONG (-1);
-
-    if (frame <0) {
-        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
-    }
-    //  php_printf ("frame=0x%lx, color=0x%lx\n",frame, color);
-    hash32=get_imageParamsThat (port, P_GTAB_R+color, frame); // FIXME: No sub_chn yet !!!
-    //  php_printf ("hash32=0x%lx\n",hash32);
-    if (hash32 == 0xffffffff) RETURN_LONG (-1);
-    /// now request gamma table for that hash32, including reverse
-    write_data[0]=hash32;
-    write_data[1]=0; /// GAMMA_MODE_NEED_REVERSE;
-    rslt=write(ELPHEL_G(fd_gamma_cache), write_data, 6);
-    //  php_printf ("frame=0x%lx, write_data[0]=0x%lx, write_data[1]=0x%lx,rslt=0x%x\n",frame, write_data[0], write_data[1],rslt);
-
-    if (rslt<= 0) {
-        RETURN_LONG (-1);
+int parse_exif_ifds (const unsigned char * page, long page_len, struct elphel_exif_entry_t * entries, int max_entries, int * big_endian) {
+    static const int type_sizes[] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8}; /// TIFF type 1..12 element sizes
+    unsigned long ifds[EXIF_MAX_IFDS];
+    int num_ifds=1, num_entries=0, ifd, i, num_dir, be, type_size;
+    unsigned long tiff, offs, next, data_len;
+    const unsigned char * entry;
+    for (tiff=0; (tiff + 14) <= page_len; tiff++) if (!memcmp(&page[tiff], "Exif\0\0", 6)) break;
+    tiff += 6;
+    if ((tiff + 8) > page_len) return -1;
+    if      (!memcmp(&page[tiff], "MM\0*", 4)) be=1;
+    else if (!memcmp(&page[tiff], "II*\0", 4)) be=0;
+    else return -1;
+    *big_endian= be;
+    ifds[0]= EXIF_TIFF32(&page[tiff + 4], be);
+    for (ifd=0; ifd < num_ifds; ifd++) {
+        if ((ifds[ifd] > (page_len - tiff)) || ((page_len - tiff - ifds[ifd]) < 2)) continue; /// no wrap with untrusted offsets
+        offs= tiff + ifds[ifd];
+        num_dir= EXIF_TIFF16(&page[offs], be);
+        for (i=0; (i < num_dir) && ((offs + 2 + 12 * (i + 1)) <= page_len); i++) {
+            entry= &page[offs + 2 + 12 * i];
+            if (num_entries >= max_entries) return num_entries;
+            entries[num_entries].tag=   EXIF_TIFF16(entry, be);
+            entries[num_entries].type=  EXIF_TIFF16(entry + 2, be);
+            entries[num_entries].count= EXIF_TIFF32(entry + 4, be);
+            type_size= (entries[num_entries].type < (sizeof(type_sizes)/sizeof(type_sizes[0])))? type_sizes[entries[num_entries].type] : 1;
+            if (type_size && (entries[num_entries].count > (page_len / type_size))) continue; /// can not fit in the page, type_size * count may wrap
+            data_len= type_size * entries[num_entries].count;
+            if (data_len <= 4)                                          entries[num_entries].data= offs + 2 + 12 * i + 8;
+            else if (EXIF_TIFF32(entry + 8, be) <= (page_len - tiff)) entries[num_entries].data= tiff + EXIF_TIFF32(entry + 8, be);
+            else                                                        entries[num_entries].data= page_len; /// outside - value will be NULL
+            entries[num_entries].len=  data_len;
+            /// follow Exif and GPS sub-IFD pointers
+            if (((entries[num_entries].tag == 0x8769) || (entries[num_entries].tag == 0x8825)) && (num_ifds < EXIF_MAX_IFDS))
+                ifds[num_ifds++]= EXIF_TIFF32(entry + 8, be);
+            num_entries++;
+        }
+        /// next IFD in chain (IFD1 with thumbnail)
+        if ((ifd == 0) && ((offs + 2 + 12 * num_dir + 4) <= page_len)) {
+            next= EXIF_TIFF32(&page[offs + 2 + 12 * num_dir], be);
+            if (next && (num_ifds < EXIF_MAX_IFDS)) ifds[num_ifds++]= next;
+        }
     }
-    gamma_index=lseek(ELPHEL_G(fd_gamma_cache), 0, SEEK_CUR);
-    //  php_printf ("gamma_index=0x%x\n",gamma_index);
+    return num_entries;
+}
 
-    if (gamma_index <= 0) {
-        RETURN_LONG (-2); /// gamma table may be lost in cache - need reload/recalculation through elphel_gamma_add()
+/**
+ * @brief Convert a TIFF value (type and count from the Exif template) to PHP value
+ * @param value - zval to set (initialized)
+ * @param page - Exif page
+ * @param page_len - number of bytes in the page
+ * @param entry - TIFF IFD entry of the field
+ * @param big_endian - TIFF byte order
+ * @param flags - EXIF_TYPED_* flags
+ */
+void exif_entry_to_zval (zval * value, const unsigned char * page, long page_len, const struct elphel_exif_entry_t * entry, int big_endian, long flags) {
+    const unsigned char * data= &page[entry->data];
+    long count= entry->count;
+    long i, len, type_size;
+    long num;
+    double dval;
+    zval * pair;
+    if ((entry->data > page_len) || (entry->len > (page_len - entry->data))) { /// value is not inside the page
+        ZVAL_NULL(value);
+        return;
+    }
+    switch (entry->type) {
+    case 2: /// ASCII - up to the first NUL, trailing spaces removed
+        for (len=0; (len < entry->len) && data[len]; len++);
+        while ((len > 0) && (data[len - 1] == ' ')) len--;
+        ZVAL_STRINGL(value, (char *) data, len, 1);
+        return;
+    case 7: /// UNDEFINED - MakerNote is an array of 32-bit big-endian values, others - binary strings
+        if (entry->tag == (Exif_Photo_MakerNote & 0xffff)) {
+            array_init(value);
+            for (i=0; (i + 4) <= entry->len; i+=4) add_next_index_long(value, (long) EXIF_TIFF32(data + i, 1));
+        } else {
+            ZVAL_STRINGL(value, (char *) data, entry->len, 1);
+        }
+        return;
+    }
+    /// never read past entry->len, even if count does not match it
+    switch (entry->type) {
+    case 3:  case 8:  type_size= 2; break;
+    case 4:  case 9:  type_size= 4; break;
+    case 5:  case 10: type_size= 8; break;
+    default:          type_size= 1;
+    }
+    if (count > (entry->len / type_size)) count= entry->len / type_size;
+    if (count != 1) array_init(value);
+    for (i=0; i < count; i++) {
+        switch (entry->type) {
+        case 1:  num= data[i];                                      break; /// BYTE
+        case 6:  num= (signed char) data[i];                        break; /// SBYTE
+        case 3:  num= EXIF_TIFF16(data + 2 * i, big_endian);         break; /// SHORT
+        case 8:  num= (short) EXIF_TIFF16(data + 2 * i, big_endian); break; /// SSHORT
+        case 4:  num= EXIF_TIFF32(data + 4 * i, big_endian);         break; /// LONG
+        case 9:  num= (int) EXIF_TIFF32(data + 4 * i, big_endian);   break; /// SLONG
+        case 5:  /// RATIONAL
+        case 10: /// SRATIONAL
+            if (flags & EXIF_TYPED_PAIRS) {
+                if (count == 1) {
+                    pair= value;
+                } else {
+                    ALLOC_INIT_ZVAL(pair);
+                }
+                array_init(pair);
+                if (entry->type == 5) {
+                    add_next_index_long(pair, EXIF_TIFF32(data + 8 * i,     big_endian));
+                    add_next_index_long(pair, EXIF_TIFF32(data + 8 * i + 4, big_endian));
+                } else {
+                    add_next_index_long(pair, (int) EXIF_TIFF32(data + 8 * i,     big_endian));
+                    add_next_index_long(pair, (int) EXIF_TIFF32(data + 8 * i + 4, big_endian));
+                }
+                if (count != 1) add_next_index_zval(value, pair);
+                continue;
+            }
+            if (entry->type == 5) dval= (1.0 * EXIF_TIFF32(data + 8 * i, big_endian)) / EXIF_TIFF32(data + 8 * i + 4, big_endian);
+            else                  dval= (1.0 * (int) EXIF_TIFF32(data + 8 * i, big_endian)) / (int) EXIF_TIFF32(data + 8 * i + 4, big_endian);
+            if (count == 1) ZVAL_DOUBLE(value, dval);
+            else            add_next_index_double(value, dval);
+            continue;
+        default: /// FLOAT, DOUBLE and unknown types - raw bytes
+            if (count != 1) zval_dtor(value);
+            ZVAL_STRINGL(value, (char *) data, entry->len, 1);
+            return;
+        }
+        if (count == 1) ZVAL_LONG(value, num);
+        else            add_next_index_long(value, num);
     }
-    gamma_direct= &(((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[gamma_index].direct[0]);/// [257]  "Gamma" table, 16-bit for both non-scaled prototypes
-    ///  and scaled, 0..0xffff range (hardware will use less)
-    lsensorLevel=0x10000*sensorLevel;
-    //  php_printf ("lsensorLevel=0x%lx\n",lsensorLevel);
-
-    if (lsensorLevel <0) RETURN_LONG (-1);
-    if (lsensorLevel >0xffff) lsensorLevel=0xffff;
-    //  php_printf ("(long) gamma_direct[%lx]=0x%lx\n",lsensorLevel>>8, (long) gamma_direct[lsensorLevel>>8]);
-    //  php_printf ("(long) gamma_direct[%lx]=0x%lx\n",(lsensorLevel>>8)+1, (long) gamma_direct[(lsensorLevel>>8)+1]);
-
-    RETURN_DOUBLE ((1.0/(1<<24))* ((((long) gamma_direct[lsensorLevel>>8])<<8) +
-            (((long) gamma_direct[(lsensorLevel>>8)+1] - ((long) gamma_direct[lsensorLevel>>8]))*(lsensorLevel & 0xff))));
 }
 
 /**
- * @brief Use current (for the specified frame) gamma table to back-translate gamma converter output data (fraction <1.0) into the  input (sensor) data
+ * @brief Get Exif fields as typed PHP values, using TIFF type and count of each field in the Exif page:
+ * BYTE/SHORT/LONG (and signed) - integers, RATIONAL/SRATIONAL - doubles (or [numerator, denominator] pairs),
+ * ASCII - strings up to the first NUL with trailing spaces removed, MakerNote - array of integers, other UNDEFINED - binary strings.
+ * Fields with count > 1 are returned as arrays.
  * @param port - sensor port (0..3)
- * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
- * @param color - needed color (0..3)
- * @param gammaLevel - level (0.0 <=level<1.0) proportional to the senosor output, normalized to 0.0..1.0 scale
- * @param frame (optional) absolute frame number for which gamma table is needed. NOTE: Will not wait if it is in the future - just return -1
- *               if frame is not specified - will use the previous to current frame - same as the one for which histogram is availble (or will be very soon)
- * @return -1 if too late (or other errors), otherwise a fraction of the full output level (0.0..1.0)
+ * @param ltags - array of long tags (IFD in bits 16..19, Exif tag in bits 0..15), or a single ltag
+ * @param exif_page - (optional) Exif page number (meta_index of the frame), 0 (default) - page of the frame currently being acquired
+ * @param flags - (optional) bit 0 (1) - return rationals as [numerator, denominator] pairs
+ * @return NULL - error, otherwise associative array ltag=>value, NULL values for tags that are not in the Exif template
  */
-
-PHP_FUNCTION(elphel_reverse_gamma)
+PHP_FUNCTION(elphel_get_exif_typed)
 {
-    long port, sub_chn;
-    long   color;
-    long   frame=-1;
-    double gammaLevel;
-    int indx,gamma_index;
-    unsigned long hash32; /// combined black, gamma, scale
-    unsigned long  write_data[2];
+    long port;
+    long exif_page=0;
+    long flags=0;
+    long ltag, page_len;
+    zval *arr, **data;
+    zval *value;
+    HashTable *arr_hash;
+    HashPosition pointer;
+    unsigned char * page;
+    struct elphel_exif_entry_t * entries;
+    struct exif_dir_table_t * dir_table_entry;
+    long * ltags;
+    int num_entries, big_endian=1, i, n, num_ltags=0;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "lz|ll", &port, &arr, &exif_page, &flags) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    /// ltags - array or a single value
+    if (Z_TYPE_P(arr) == IS_ARRAY) {
+        arr_hash = Z_ARRVAL_P(arr);
+        ltags= (long *) emalloc((zend_hash_num_elements(arr_hash) + 1) * sizeof(long));
+        for(zend_hash_internal_pointer_reset_ex(arr_hash, &pointer);
+                zend_hash_get_current_data_ex(arr_hash, (void**) &data, &pointer) == SUCCESS;
+                zend_hash_move_forward_ex(arr_hash, &pointer)) {
+            if (Z_TYPE_PP(data) == IS_LONG) ltags[num_ltags++]= Z_LVAL_PP(data);
+        }
+    } else if (Z_TYPE_P(arr) == IS_LONG) {
+        ltags= (long *) emalloc(sizeof(long));
+        ltags[num_ltags++]= Z_LVAL_P(arr);
+    } else {
+        RETURN_NULL();
+    }
+    createExifDirectory(0); /// make sure directory is current
+    page= (ELPHEL_G(exif_size) > 0)? (unsigned char *) emalloc(ELPHEL_G(exif_size)) : NULL;
+    page_len= page? read_exif_page(port, exif_page, page, ELPHEL_G(exif_size)) : -1;
+    if (page_len < 0) {
+        if (page) efree(page);
+        efree(ltags);
+        RETURN_NULL(); //exif_page may be out of range
+    }
+    entries= (struct elphel_exif_entry_t *) emalloc(EXIF_MAX_ENTRIES * sizeof(struct elphel_exif_entry_t));
+    num_entries= parse_exif_ifds(page, page_len, entries, EXIF_MAX_ENTRIES, &big_endian);
+    array_init(return_value);
+    for (n=0; n < num_ltags; n++) {
+        ltag= ltags[n];
+        ALLOC_INIT_ZVAL(value);
+        /// template field is the IFD entry with the same tag, whose data is located at the field destination
+        dir_table_entry= exif_dir_find(ltag);
+        if (dir_table_entry) for (i=0; i < num_entries; i++) {
+            if ((entries[i].tag == (ltag & 0xffff)) && (entries[i].data == dir_table_entry->dst)) {
+                exif_entry_to_zval(value, page, page_len, &entries[i], big_endian, flags);
+                break;
+            }
+        }
+        add_index_zval(return_value, ltag, value);
+    }
+    efree(ltags);
+    efree(entries);
+    efree(page);
+}
+
+
+//! wait for the next frame to be compressed (and related parameters updated
+PHP_FUNCTION(elphel_wait_frame)
+{
+    long port;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &port) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_CIRCBUF) < 0) RETURN_NULL();
+    lseek((int) ELPHEL_G( fd_circ[port]), LSEEK_CIRC_TOWP, SEEK_END );
+    lseek((int) ELPHEL_G( fd_circ[port]), LSEEK_CIRC_WAIT, SEEK_END );
+    RETURN_NULL();
+}
+
+/**
+ * @brief Get integer value from the options array
+ * @param options - options (associative array), may be NULL
+ * @param key - option name
+ * @param default_value - value to use when the option is not specified
+ * @return option value converted to integer
+ */
+long get_option_long (HashTable * options, const char * key, long default_value) {
+    zval **data;
+    if (!options || (zend_hash_find(options, key, strlen(key)+1, (void**) &data) == FAILURE)) return default_value;
+    switch (Z_TYPE_PP(data)) {
+    case IS_LONG:   return Z_LVAL_PP(data);
+    case IS_BOOL:   return Z_BVAL_PP(data)? 1 : 0;
+    case IS_DOUBLE: return (long) Z_DVAL_PP(data);
+    case IS_STRING: return strtol(Z_STRVAL_PP(data), NULL, 0);
+    }
+    return default_value;
+}
+
+/**
+ * @brief Get floating point value from the options array
+ * @param options - options (associative array), may be NULL
+ * @param key - option name
+ * @param default_value - value to use when the option is not specified
+ * @return option value converted to double
+ */
+double get_option_double (HashTable * options, const char * key, double default_value) {
+    zval **data;
+    if (!options || (zend_hash_find(options, key, strlen(key)+1, (void**) &data) == FAILURE)) return default_value;
+    switch (Z_TYPE_PP(data)) {
+    case IS_LONG:   return Z_LVAL_PP(data);
+    case IS_BOOL:   return Z_BVAL_PP(data)? 1.0 : 0.0;
+    case IS_DOUBLE: return Z_DVAL_PP(data);
+    case IS_STRING: return strtod(Z_STRVAL_PP(data), NULL);
+    }
+    return default_value;
+}
+
+/**
+ * @brief Get string value from the options array
+ * @param options - options (associative array), may be NULL
+ * @param key - option name
+ * @param default_value - value to use when the option is not specified or is not a string
+ * @return pointer to the option string (owned by the array) or default_value
+ */
+const char * get_option_string (HashTable * options, const char * key, const char * default_value) {
+    zval **data;
+    if (!options || (zend_hash_find(options, key, strlen(key)+1, (void**) &data) == FAILURE)) return default_value;
+    if (Z_TYPE_PP(data) != IS_STRING) return default_value;
+    return Z_STRVAL_PP(data);
+}
+
+/**
+ * @brief Open JPEG header device for the sensor port (header is generated by the driver for each frame in the circbuf)
+ * @param port - sensor port (0..3)
+ * @return file descriptor or <0 on error. Caller should close() it
+ */
+int open_jpeghead (long port) {
+    const char *jpegheadPaths[] = { DEV393_PATH(DEV393_JPEGHEAD0), DEV393_PATH(DEV393_JPEGHEAD1),
+                                    DEV393_PATH(DEV393_JPEGHEAD2), DEV393_PATH(DEV393_JPEGHEAD3)};
+    int fd;
+    if ((port <0) || (port >= SENSOR_PORTS)) return -1;
+    fd= open(jpegheadPaths[port], O_RDWR);
+    if (fd < 0) php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open file %s",jpegheadPaths[port]);
+    return fd;
+}
+
+/**
+ * @brief Prepare complete JPEG file for a frame in the circbuf as a list of chunks:
+ * SOI, Exif (optional), rest of the header, compressed data (2 chunks if it wraps around the circbuf end), EOI.
+ * Compressed data is not copied - chunks point to the mmap-ed circbuf, so they should be used before the frame is overwritten
+ * @param port - sensor port (0..3)
+ * @param fd_head - JPEG header device, opened with open_jpeghead()
+ * @param circbuf_pointer - frame pointer in the circbuf
+ * @param exif_buf - buffer for the Exif data (at least exif_size bytes) or NULL to skip Exif
+ * @param exif_size - Exif page size (ELPHEL_G(exif_size) after createExifDirectory())
+ * @param frame - structure to fill
+ * @return <0 - error, otherwise total length of the JPEG file
+ */
+long get_jpeg_frame (long port, int fd_head, long circbuf_pointer, unsigned char * exif_buf, long exif_size, struct elphel_jpeg_frame_t * frame) {
+    static const unsigned char jpeg_trailer[2]={0xff, 0xd9};
+    char * ccam_dma_buf_char= (char *) ELPHEL_G( ccam_dma_buf[port]);
+    long circbuf_size=ELPHEL_G(ccam_dma_buf_len[port]);
+    long head_len, exif_len=0, exif_page_start, tail;
+    int i;
+    frame->frame_length= get_interframe_meta (port, circbuf_pointer, &frame->frame_params);
+    if ((frame->frame_length <= 0) || (frame->frame_length >= circbuf_size)) return -1;
+    lseek(fd_head, circbuf_pointer + 1, SEEK_END); /// select frame for the header
+    head_len= read(fd_head, frame->head, JPEG_HEADER_MAXSIZE);
+    if (head_len < 2) return -1;
+    if (exif_buf && (exif_size > 0)) {
+        exif_page_start=lseek ((int) ELPHEL_G(fd_exif[port]), frame->frame_params.meta_index, SEEK_END); /// select specified Exif page
+        if (exif_page_start >= 0) exif_len= read(ELPHEL_G(fd_exif[port]), exif_buf, exif_size);
+        if (exif_len < 0) exif_len=0;
+    }
+    frame->num_chunks=0;
+    frame->chunks[frame->num_chunks].iov_base=  frame->head;
+    frame->chunks[frame->num_chunks++].iov_len= 2;
+    if (exif_len) {
+        frame->chunks[frame->num_chunks].iov_base=  exif_buf;
+        frame->chunks[frame->num_chunks++].iov_len= exif_len;
+    }
+    frame->chunks[frame->num_chunks].iov_base=  frame->head + 2;
+    frame->chunks[frame->num_chunks++].iov_len= head_len - 2;
+    tail= circbuf_pointer + frame->frame_length - circbuf_size; /// >0 - frame wraps around the buffer end
+    frame->chunks[frame->num_chunks].iov_base=  &ccam_dma_buf_char[circbuf_pointer];
+    frame->chunks[frame->num_chunks++].iov_len= (tail > 0)? (frame->frame_length - tail) : frame->frame_length;
+    if (tail > 0) {
+        frame->chunks[frame->num_chunks].iov_base=  ccam_dma_buf_char;
+        frame->chunks[frame->num_chunks++].iov_len= tail;
+    }
+    frame->chunks[frame->num_chunks].iov_base=  (void *) jpeg_trailer;
+    frame->chunks[frame->num_chunks++].iov_len= 2;
+    for (i=0, frame->length=0; i < frame->num_chunks; i++) frame->length += frame->chunks[i].iov_len;
+    return frame->length;
+}
+
+/**
+ * @brief Copy JPEG file prepared by get_jpeg_frame() out of the circbuf, replace the chunks with the copy
+ * @param frame - frame prepared with get_jpeg_frame()
+ * @param buf - buffer of at least frame->length bytes
+ */
+void copy_jpeg_frame (struct elphel_jpeg_frame_t * frame, unsigned char * buf) {
+    long len;
+    int i;
+    for (i=0, len=0; i < frame->num_chunks; i++) {
+        memcpy(buf + len, frame->chunks[i].iov_base, frame->chunks[i].iov_len);
+        len += frame->chunks[i].iov_len;
+    }
+    frame->num_chunks=        1;
+    frame->chunks[0].iov_base= buf;
+    frame->chunks[0].iov_len=  len;
+}
+
+/// Current time (CLOCK_MONOTONIC) in seconds
+double monotonic_seconds (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 0.000000001 * ts.tv_nsec;
+}
+
+/// State of elphel_record() - output segment, staging buffer and statistics
+struct elphel_recorder_t {
+    const char *    path;          ///< output path prefix
+    int             fd;            ///< current segment file, -1 - none
+    long            segment;       ///< current segment number
+    long long       segment_bytes; ///< bytes written to the current segment (including buffer)
+    double          segment_start; ///< monotonic time when segment was opened
+    long            segment_size;  ///< rotate segments after this size (at most RECORD_SEGMENT_MAX)
+    double          segment_time;  ///< rotate segments after this time, seconds (0 - no limit)
+    int             direct;        ///< use O_DIRECT
+    int             preallocate;   ///< preallocate segment_size bytes for each segment
+    unsigned char * buffer;        ///< staging buffer, aligned to RECORD_ALIGN
+    long            buffer_size;
+    long            buffer_used;
+    FILE *          index;         ///< index file, NULL - not used
+    long            segments;      ///< number of segments opened
+    long            errors;        ///< number of write errors
+};
+
+/**
+ * @brief Write out full staging buffer, or flush the partial one at the segment end
+ * When O_DIRECT is used the last partial block is padded, the file is truncated to the real length when closed
+ * @param rec - recorder state
+ * @return 0 - OK, <0 - -errno
+ */
+int recorder_flush (struct elphel_recorder_t * rec) {
+    long len=rec->buffer_used;
+    long rslt;
+    if (!len || (rec->fd < 0)) return 0;
+    if (rec->direct && (len & (RECORD_ALIGN-1))) {
+        len= (len + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+        memset(rec->buffer + rec->buffer_used, 0, len - rec->buffer_used);
+    }
+    rslt=write(rec->fd, rec->buffer, len);
+    rec->buffer_used=0;
+    if (rslt < len) {
+        rec->errors++;
+        return (rslt < 0)? -errno : -EIO;
+    }
+    return 0;
+}
+
+/// Close current segment file (flush staging buffer, trim preallocated/padded tail)
+void recorder_close_segment (struct elphel_recorder_t * rec) {
+    if (rec->fd < 0) return;
+    recorder_flush(rec);
+    ftruncate(rec->fd, rec->segment_bytes);
+    close(rec->fd);
+    rec->fd=-1;
+}
+
+/**
+ * @brief Open next segment file <path>_NNNNN.mjpeg (concatenated JPEG files)
+ * @param rec - recorder state
+ * @return 0 - OK, <0 - -errno
+ */
+int recorder_open_segment (struct elphel_recorder_t * rec) {
+    char name[MAXPATHLEN];
+    recorder_close_segment(rec);
+    snprintf(name, sizeof(name), "%s_%05ld.mjpeg", rec->path, rec->segment + 1);
+    rec->fd= open(name, O_WRONLY | O_CREAT | O_TRUNC | (rec->direct? O_DIRECT : 0), 0644);
+    if (rec->fd < 0) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not create file %s, errno=%d", name, errno);
+        return -errno;
+    }
+    if (rec->preallocate) posix_fallocate(rec->fd, 0, rec->segment_size); /// not supported on all file systems - ignore errors
+    rec->segment++;
+    rec->segments++;
+    rec->segment_bytes=0;
+    rec->segment_start=monotonic_seconds();
+    return 0;
+}
+
+/**
+ * @brief Append frame to the current segment through the staging buffer, start a new segment if needed
+ * @param rec - recorder state
+ * @param frame - frame prepared with get_jpeg_frame()
+ * @param offset - set to the frame offset in the current segment
+ * @return 0 - OK, <0 - -errno
+ */
+int recorder_write_frame (struct elphel_recorder_t * rec, struct elphel_jpeg_frame_t * frame, long * offset) {
+    long copy_len;
+    int i, rslt;
+    unsigned char * src;
+    long left;
+    if ((rec->fd < 0) ||
+            (rec->segment_bytes && ((rec->segment_bytes + frame->length) > rec->segment_size)) ||
+            ((rec->segment_time > 0) && ((monotonic_seconds() - rec->segment_start) >= rec->segment_time))) {
+        if (((rslt=recorder_open_segment(rec))) < 0) return rslt;
+    }
+    *offset= rec->segment_bytes;
+    for (i=0; i < frame->num_chunks; i++) {
+        src=  (unsigned char *) frame->chunks[i].iov_base;
+        left= frame->chunks[i].iov_len;
+        while (left > 0) {
+            copy_len= rec->buffer_size - rec->buffer_used;
+            if (copy_len > left) copy_len=left;
+            memcpy(rec->buffer + rec->buffer_used, src, copy_len);
+            rec->buffer_used += copy_len;
+            src  += copy_len;
+            left -= copy_len;
+            if ((rec->buffer_used == rec->buffer_size) && (((rslt=recorder_flush(rec))) < 0)) return rslt;
+        }
+    }
+    rec->segment_bytes += frame->length;
+    return 0;
+}
+
+/**
+ * @brief Add frame record to the index file
+ * @param rec - recorder state
+ * @param frame - frame written with recorder_write_frame()
+ * @param offset - frame offset in the current segment
+ * @param circbuf_pointer - frame pointer in the circbuf
+ */
+void recorder_index_frame (struct elphel_recorder_t * rec, struct elphel_jpeg_frame_t * frame, long offset, long circbuf_pointer) {
+    struct elphel_record_index_t index_record;
+    if (!rec->index) return;
+    index_record.segment=         rec->segment;
+    index_record.offset=          offset;
+    index_record.length=          frame->length;
+    index_record.timestamp_sec=   frame->frame_params.timestamp_sec;
+    index_record.timestamp_usec=  frame->frame_params.timestamp_usec;
+    index_record.circbuf_pointer= circbuf_pointer;
+    fwrite(&index_record, sizeof(index_record), 1, rec->index);
+}
+
+/**
+ * @brief Record compressed frames from the circbuf to disk, runs until one of the stop conditions is met
+ * Each new frame is written as a complete JPEG file to the segment files <path>_NNNNN.mjpeg, with optional index <path>.idx
+ * of struct elphel_record_index_t records (native byte order). Each frame is copied out of the circbuf and verified before it is
+ * written, frames overwritten while being copied are skipped. When the recorder is overrun by the compressor it continues from
+ * the oldest frame still in the circbuf. Skipped frames are counted as dropped by the gaps in the frame timestamps.
+ * @param port - sensor port (0..3)
+ * @param path - output path prefix
+ * @param options - (optional) associative array:
+ * - "frames"       - stop after recording this number of frames
+ * - "bytes"        - stop after recording this number of bytes
+ * - "duration"     - stop after this time, seconds
+ * - "stop_file"    - stop when this file exists (checked before each frame)
+ * - "exif"         - include Exif in each frame (default true)
+ * - "segment_size" - start new segment when it would exceed this size, bytes (default 0 - RECORD_SEGMENT_MAX, <4GB as index
+ *                    offsets are 32-bit)
+ * - "segment_time" - start new segment after this time, seconds (default 0 - no limit)
+ * - "buffer_size"  - size of the write buffer, bytes (default 1MB, rounded up to 4096)
+ * - "direct"       - open segments with O_DIRECT (default false)
+ * - "preallocate"  - preallocate segment_size for each segment if it is specified (default true)
+ * - "index"        - write index file (default true)
+ * - "metalog"      - also write metadata log of the recorded frames to this file (see elphel_metalog_open())
+ * - "frame_timeout"- stop if there are no new frames for this time, seconds (default 10.0, 0 - wait forever)
+ * At least one of "frames", "bytes", "duration" or "stop_file" is required.
+ * @return NULL - error, otherwise associative array with statistics: "frames", "bytes", "segments", "dropped" (frames lost
+ *         because the recorder was overrun by the compressor), "errors", "stalled" (stopped by frame_timeout),
+ *         "duration" (seconds), "first_timestamp", "last_timestamp"
+ */
+PHP_FUNCTION(elphel_record)
+{
+    long port;
+    char * path;
+    int path_len;
+    zval * zoptions=NULL;
+    HashTable * options=NULL;
+    char name[MAXPATHLEN];
+    struct elphel_recorder_t rec;
+    struct elphel_metalog_t metalog;
+    struct elphel_jpeg_frame_t frame;
+    struct stat stop_stat;
+    unsigned char * exif_buf=NULL;
+    long exif_size=0;
+    long max_frames, max_bytes;
+    double max_duration, start_time;
+    const char * stop_file;
+    volatile long frames=0, dropped=0;
+    volatile long long bytes=0;
+    volatile double first_timestamp=0.0, last_timestamp=0.0;
+    volatile double frame_interval=0.0; /// shortest interval between the recorded frames (frame period)
+    volatile int aborted=0, stalled=0;
+    unsigned char * volatile frame_buf=NULL;
+    volatile long frame_buf_size=0;
+    double frame_time, gap, frame_timeout, last_frame_time;
+    struct timespec poll= {0, RECORD_POLL_NSEC};
+    long p, offset;
+    int fd_head, fd_circ;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ls|a", &port, &path, &path_len, &zoptions) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_CIRCBUF | ELPHEL_OPEN_EXIF) < 0) RETURN_NULL();
+    if (zoptions) options=Z_ARRVAL_P(zoptions);
+    max_frames=   get_option_long  (options, "frames",   0);
+    max_bytes=    get_option_long  (options, "bytes",    0);
+    max_duration= get_option_double(options, "duration", 0.0);
+    stop_file=    get_option_string(options, "stop_file", NULL);
+    if ((max_frames <= 0) && (max_bytes <= 0) && (max_duration <= 0.0) && !stop_file) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "No stop condition specified (frames, bytes, duration or stop_file)");
+        RETURN_NULL();
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.path=         path;
+    rec.fd=           -1;
+    rec.segment_size= get_option_long  (options, "segment_size", 0);
+    rec.segment_time= get_option_double(options, "segment_time", 0.0);
+    rec.direct=       get_option_long  (options, "direct",       0);
+    rec.preallocate=  get_option_long  (options, "preallocate",  1);
+    rec.buffer_size=  get_option_long  (options, "buffer_size",  RECORD_BUFFER_SIZE);
+    frame_timeout=    get_option_double(options, "frame_timeout", RECORD_FRAME_TIMEOUT);
+    if (rec.segment_size <= 0) rec.preallocate= 0;
+    if ((rec.segment_size <= 0) || ((unsigned long) rec.segment_size > RECORD_SEGMENT_MAX)) rec.segment_size= RECORD_SEGMENT_MAX; /// index offsets are 32-bit
+    if (rec.buffer_size < RECORD_ALIGN) rec.buffer_size=RECORD_ALIGN;
+    rec.buffer_size= (rec.buffer_size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+    if (posix_memalign((void **) &rec.buffer, RECORD_ALIGN, rec.buffer_size)) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not allocate %ld bytes for the write buffer", rec.buffer_size);
+        RETURN_NULL();
+    }
+    if (get_option_long(options, "index", 1)) {
+        snprintf(name, sizeof(name), "%s.idx", path);
+        rec.index= fopen(name, "w");
+        if (!rec.index) php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not create index file %s", name);
+    }
+    if (get_option_long(options, "exif", 1)) {
+        createExifDirectory(0); /// updates ELPHEL_G(exif_size) - Exif page length
+        exif_size= ELPHEL_G(exif_size);
+        if (exif_size > 0) exif_buf= (unsigned char *) emalloc(exif_size);
+    }
+    fd_head= open_jpeghead(port);
+    if (fd_head < 0) {
+        if (rec.index) fclose(rec.index);
+        if (exif_buf) efree(exif_buf);
+        free(rec.buffer);
+        RETURN_NULL();
+    }
+    memset(&metalog, 0, sizeof(metalog));
+    metalog.fd= -1;
+    if (get_option_string(options, "metalog", NULL) && (metalog_open(&metalog, get_option_string(options, "metalog", NULL), port, 0) < 0)) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not create metadata log %s", get_option_string(options, "metalog", NULL));
+    }
+    fd_circ= ELPHEL_G(fd_circ[port]);
+    start_time= monotonic_seconds();
+    last_frame_time= start_time;
+    lseek(fd_circ, LSEEK_CIRC_TOWP, SEEK_END); /// start from the next frame to be compressed
+    /// bail out (e.g. max_execution_time) should not leak the buffers and files
+    zend_try {
+        while (!((max_frames > 0) && (frames >= max_frames)) &&
+                !((max_bytes > 0) && (bytes >= max_bytes)) &&
+                !((max_duration > 0.0) && ((monotonic_seconds() - start_time) >= max_duration)) &&
+                !(stop_file && (stat(stop_file, &stop_stat) == 0))) {
+            p= lseek(fd_circ, LSEEK_CIRC_READY, SEEK_END); /// does not block, unlike LSEEK_CIRC_WAIT
+            if (p < 0) {
+                if (lseek(fd_circ, LSEEK_CIRC_VALID, SEEK_END) >= 0) { /// not compressed yet - poll, so the stop conditions are checked
+                    if ((frame_timeout > 0.0) && ((monotonic_seconds() - last_frame_time) >= frame_timeout)) {
+                        stalled=1; /// sensor or compressor stopped
+                        break;
+                    }
+                    nanosleep(&poll, NULL);
+                    continue;
+                }
+                /// overrun by the compressor - continue from the oldest frame that is still safe to read
+                lseek(fd_circ, LSEEK_CIRC_SCND, SEEK_END);
+                continue;
+            }
+            last_frame_time= monotonic_seconds();
+            if (get_jpeg_frame (port, fd_head, p, exif_buf, exif_size, &frame) > 0) {
+                if (frame.length > frame_buf_size) {
+                    frame_buf_size= frame.length;
+                    frame_buf= (unsigned char *) erealloc(frame_buf, frame_buf_size);
+                }
+                copy_jpeg_frame (&frame, frame_buf);
+                /// frame could be overwritten while it was being copied - verify before writing it out
+                lseek(fd_circ, p, SEEK_SET);
+                if (lseek(fd_circ, LSEEK_CIRC_VALID, SEEK_END) >= 0) {
+                    if (recorder_write_frame(&rec, &frame, &offset) < 0) break; /// can not create segment
+                    recorder_index_frame(&rec, &frame, offset, p);
+                    if (metalog.header) metalog_append(&metalog, p);
+                    frame_time= frame.frame_params.timestamp_sec + 0.000001 * frame.frame_params.timestamp_usec;
+                    if (frames) {
+                        gap= frame_time - last_timestamp;
+                        if ((gap > 0.0) && ((frame_interval <= 0.0) || (gap < frame_interval))) frame_interval= gap;
+                        if ((frame_interval > 0.0) && (gap > 1.5 * frame_interval)) dropped += (long) (gap / frame_interval + 0.5) - 1; /// frames missing between the recorded ones
+                    } else {
+                        first_timestamp= frame_time;
+                    }
+                    last_timestamp= frame_time;
+                    frames++;
+                    bytes+= frame.length;
+                }
+            }
+            lseek(fd_circ, p, SEEK_SET);
+            lseek(fd_circ, LSEEK_CIRC_NEXT, SEEK_END);
+        }
+    } zend_catch {
+        aborted=1;
+    } zend_end_try();
+    recorder_close_segment(&rec);
+    if (rec.index) fclose(rec.index);
+    metalog_close(&metalog);
+    close(fd_head);
+    if (exif_buf) efree(exif_buf);
+    if (frame_buf) efree(frame_buf);
+    free(rec.buffer);
+    if (aborted) zend_bailout();
+    array_init(return_value);
+    add_assoc_long  (return_value, "frames",          frames);
+    if (bytes > LONG_MAX) add_assoc_double(return_value, "bytes", (double) bytes);
+    else                  add_assoc_long  (return_value, "bytes", (long) bytes);
+    add_assoc_long  (return_value, "segments",        rec.segments);
+    add_assoc_long  (return_value, "dropped",         dropped);
+    add_assoc_long  (return_value, "errors",          rec.errors);
+    add_assoc_bool  (return_value, "stalled",         stalled);
+    add_assoc_double(return_value, "duration",        monotonic_seconds() - start_time);
+    add_assoc_double(return_value, "first_timestamp", first_timestamp);
+    add_assoc_double(return_value, "last_timestamp",  last_timestamp);
+}
+
+/**
+ * @brief Stream compressed frames to the client as multipart/x-mixed-replace (MJPEG), runs until the client disconnects
+ * or max_frames are sent. Waits for each new frame, so frames compressed while the previous one was being sent are skipped.
+ * Frames are copied out of the circbuf before sending, so slow clients do not get partially overwritten frames.
+ * @param port - sensor port (0..3)
+ * @param max_fps - (optional) maximal frame rate sent to the client (by frame timestamps), 0 (default) - no limit
+ * @param max_frames - (optional) stop after sending this number of frames, 0 (default) - no limit
+ * @return NULL - error, otherwise number of frames sent
+ */
+PHP_FUNCTION(elphel_mjpeg_stream)
+{
+    long port;
+    double max_fps=0.0;
+    long max_frames=0;
+    char part_header[128];
+    int part_header_len;
+    struct elphel_jpeg_frame_t frame;
+    unsigned char * volatile frame_buf=NULL; /// changed in zend_try, used after zend_catch
+    volatile long frame_buf_size=0;
+    volatile long frames=0;
+    volatile int aborted=0;
+    double frame_time, last_sent=-1.0;
+    long p, len;
+    int fd_head, fd_circ;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|dl", &port, &max_fps, &max_frames) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_CIRCBUF | ELPHEL_OPEN_EXIF) < 0) RETURN_NULL();
+    fd_head= open_jpeghead(port);
+    if (fd_head < 0) RETURN_NULL();
+    fd_circ= ELPHEL_G(fd_circ[port]);
+    sapi_add_header("Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY,
+            sizeof("Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY) - 1, 1);
+    sapi_add_header("Cache-Control: no-cache", sizeof("Cache-Control: no-cache") - 1, 1);
+    sapi_add_header("Pragma: no-cache",        sizeof("Pragma: no-cache") - 1,        1);
+    php_output_end_all(); /// frames should go straight to the client, not to the output buffers
+    /// write errors (client disconnect) may bail out of the loop - close the JPEG header device first
+    zend_try {
+        while (!(PG(connection_status) & PHP_CONNECTION_ABORTED) && (!max_frames || (frames < max_frames))) {
+            lseek(fd_circ, LSEEK_CIRC_TOWP, SEEK_END);
+            lseek(fd_circ, LSEEK_CIRC_WAIT, SEEK_END);
+            p= lseek(fd_circ, LSEEK_CIRC_READY, SEEK_END);
+            if (p < 0) continue;
+            if (get_jpeg_frame (port, fd_head, p, NULL, 0, &frame) <= 0) continue;
+            frame_time= frame.frame_params.timestamp_sec + 0.000001 * frame.frame_params.timestamp_usec;
+            if ((max_fps > 0.0) && (last_sent >= 0.0) && ((frame_time - last_sent) < (1.0 / max_fps))) continue; /// too early
+            if (frame.length > frame_buf_size) {
+                frame_buf_size= frame.length;
+                frame_buf= (unsigned char *) erealloc(frame_buf, frame_buf_size);
+            }
+            copy_jpeg_frame (&frame, frame_buf);
+            len= frame.length;
+            lseek(fd_circ, p, SEEK_SET);
+            if (lseek(fd_circ, LSEEK_CIRC_VALID, SEEK_END) < 0) continue; /// overwritten while copying
+            part_header_len= snprintf(part_header, sizeof(part_header),
+                    "--" MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %ld\r\n\r\n", len);
+            PHPWRITE(part_header, part_header_len);
+            PHPWRITE(frame_buf, len);
+            PHPWRITE("\r\n", 2);
+            sapi_flush();
+            last_sent= frame_time;
+            frames++;
+        }
+    } zend_catch {
+        aborted=1;
+    } zend_end_try();
+    close(fd_head);
+    if (frame_buf) efree(frame_buf);
+    if (aborted) zend_bailout();
+    RETURN_LONG(frames);
+}
+
+
+/**
+ * @brief Map (or remap after growing) the metadata log file
+ * @param ml - metadata log
+ * @param capacity - number of records the file should hold
+ * @return 0 - OK, <0 - -errno
+ */
+int metalog_map (struct elphel_metalog_t * ml, long capacity) {
+    long size= sizeof(struct elphel_metalog_header_t) + capacity * sizeof(struct elphel_metalog_record_t);
+    void * map;
+    if (ftruncate(ml->fd, size) < 0) return -errno;
+    if (ml->header) munmap(ml->header, ml->map_size);
+    ml->header= NULL;
+    map= mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, ml->fd, 0);
+    if (map == MAP_FAILED) return -errno;
+    ml->header=   (struct elphel_metalog_header_t *) map;
+    ml->records=  (struct elphel_metalog_record_t *) (((char *) map) + sizeof(struct elphel_metalog_header_t));
+    ml->map_size= size;
+    ml->capacity= capacity;
+    return 0;
+}
+
+/**
+ * @brief Open (create) the metadata log file
+ * @param ml - metadata log to initialize
+ * @param path - file path
+ * @param port - sensor port (0..3), saved in the header
+ * @param append - continue existing log (if it is valid), otherwise the file is truncated
+ * @return 0 - OK, <0 - -errno (-EINVAL - existing file is not a metadata log or has different record format)
+ */
+int metalog_open (struct elphel_metalog_t * ml, const char * path, long port, int append) {
+    struct stat file_stat;
+    long num_records=0, sorted_records=0;
     int rslt;
-    unsigned short * gamma_direct;
-    unsigned char * gamma_reverse;
-    long lgammaLevel, sensor_high8,delta, sensor_full;
+    memset(ml, 0, sizeof(struct elphel_metalog_t));
+    ml->fd= -1;
+    if ((rslt= ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS)) < 0) return rslt; /// records include acquisition parameters
+    ml->fd= open(path, O_RDWR | O_CREAT | (append? 0 : O_TRUNC), 0644);
+    if (ml->fd < 0) return -errno;
+    if (append && (fstat(ml->fd, &file_stat) == 0) && (file_stat.st_size >= sizeof(struct elphel_metalog_header_t))) {
+        struct elphel_metalog_header_t header;
+        if ((pread(ml->fd, &header, sizeof(header), 0) != sizeof(header)) || memcmp(header.magic, METALOG_MAGIC, sizeof(header.magic)) ||
+                (header.record_size != sizeof(struct elphel_metalog_record_t)) || (header.header_size != sizeof(struct elphel_metalog_header_t))) {
+            metalog_close(ml);
+            return -EINVAL;
+        }
+        num_records= header.num_records;
+        /// do not trust a counter that points past the end of the file (interrupted writer)
+        if (num_records > ((file_stat.st_size - sizeof(struct elphel_metalog_header_t)) / sizeof(struct elphel_metalog_record_t)))
+            num_records= (file_stat.st_size - sizeof(struct elphel_metalog_header_t)) / sizeof(struct elphel_metalog_record_t);
+        sorted_records= (header.sorted_records < num_records)? header.sorted_records : num_records;
+    }
+    rslt= metalog_map(ml, num_records + METALOG_GROW_RECORDS);
+    if (rslt < 0) {
+        metalog_close(ml);
+        return rslt;
+    }
+    memcpy(ml->header->magic, METALOG_MAGIC, sizeof(ml->header->magic));
+    ml->header->version=     METALOG_VERSION;
+    ml->header->header_size= sizeof(struct elphel_metalog_header_t);
+    ml->header->record_size= sizeof(struct elphel_metalog_record_t);
+    ml->header->port=        port;
+    ml->header->num_records= num_records;
+    ml->header->sorted_records= sorted_records;
+    ml->port=                port;
+    ml->last_pointer=        -1;
+    return 0;
+}
 
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llld|l",&port, &sub_chn,  &color, &gammaLevel, &frame ) == FAILURE) {
-        RETURN_LONG (-1);
+/**
+ * @brief Append a record for the compressed frame to the metadata log. Frame number, exposure and gains, GPS are
+ * taken from the Exif page and pastPars, the rest - from the interframe parameters in the circbuf
+ * @param ml - metadata log
+ * @param circbuf_pointer - frame pointer in the circbuf
+ * @return 1 - record added, 0 - frame is not valid (or was already logged), <0 - -errno
+ */
+int metalog_append (struct elphel_metalog_t * ml, long circbuf_pointer) {
+    struct interframe_params_t frame_params;
+    struct elphel_exif_elphel_t exif;
+    struct elphel_metalog_record_t * record;
+    long jpeg_len, page_len;
+    int rslt, sorted;
+    if (circbuf_pointer == ml->last_pointer) return 0;
+    jpeg_len= get_interframe_meta(ml->port, circbuf_pointer, &frame_params);
+    if (jpeg_len < 0) return 0;
+    if (ml->header->num_records >= ml->capacity) {
+        rslt= metalog_map(ml, ml->capacity + METALOG_GROW_RECORDS);
+        if (rslt < 0) return rslt;
+    }
+    createExifDirectory(0); /// make sure directory is current
+    if (ELPHEL_G(exif_size) > ml->page_size) {
+        ml->page= (unsigned char *) perealloc(ml->page, ELPHEL_G(exif_size), 1);
+        ml->page_size= ELPHEL_G(exif_size);
+    }
+    page_len= (ml->page_size > 0)? read_exif_page(ml->port, frame_params.meta_index, ml->page, ml->page_size) : -1;
+    if (page_len >= 0) decode_exif_elphel(ml->page, page_len, &exif);
+    else               memset(&exif, 0, sizeof(exif));
+
+    record= &ml->records[ml->header->num_records];
+    memset(record, 0, sizeof(struct elphel_metalog_record_t));
+    record->timestamp_sec=   frame_params.timestamp_sec;
+    record->timestamp_usec=  frame_params.timestamp_usec;
+    record->circbuf_pointer= circbuf_pointer;
+    record->frame_length=    jpeg_len;
+    record->quality2=        frame_params.quality2;
+    record->hash32_r=        frame_params.hash32_r;
+    record->hash32_g=        frame_params.hash32_g;
+    record->hash32_gb=       frame_params.hash32_gb;
+    record->hash32_b=        frame_params.hash32_b;
+    if (exif.present & EXIF_ELPHEL_FRAME_NUMBER) {
+        record->frame=    exif.frame_number;
+        record->flags|=   METALOG_FLAG_FRAME;
+        /// acquisition parameters of that frame, 0xffffffff if they are already lost from pastPars
+        record->exposure= get_imageParamsThat(ml->port, P_EXPOS,  record->frame);
+        record->gain_r=   get_imageParamsThat(ml->port, P_GAINR,  record->frame);
+        record->gain_g=   get_imageParamsThat(ml->port, P_GAING,  record->frame);
+        record->gain_b=   get_imageParamsThat(ml->port, P_GAINB,  record->frame);
+        record->gain_gb=  get_imageParamsThat(ml->port, P_GAINGB, record->frame);
+        if (record->exposure != 0xffffffff) record->flags|= METALOG_FLAG_PARS;
+    }
+    if ((exif.present & (EXIF_ELPHEL_LONGITUDE | EXIF_ELPHEL_LATITUDE)) == (EXIF_ELPHEL_LONGITUDE | EXIF_ELPHEL_LATITUDE)) {
+        record->latitude=  exif.latitude;
+        record->longitude= exif.longitude;
+        record->altitude=  exif.altitude;
+        record->flags|=    METALOG_FLAG_GPS;
+    }
+    /// After restarting in append mode (or a frame number reset) frames and timestamps may go back - such records
+    /// and all the following ones are outside of the sorted part and are scanned by elphel_metalog_query()
+    sorted= (ml->header->sorted_records == ml->header->num_records) &&
+            ((ml->header->num_records == 0) ||
+             ((record->frame > record[-1].frame) &&
+              ((record->timestamp_sec > record[-1].timestamp_sec) ||
+               ((record->timestamp_sec == record[-1].timestamp_sec) && (record->timestamp_usec > record[-1].timestamp_usec)))));
+    __sync_synchronize(); /// record stores must be visible to other processes before the counter
+    ml->header->num_records++; /// only after the record is complete, so readers never see partial records
+    if (sorted) ml->header->sorted_records= ml->header->num_records;
+    ml->last_pointer= circbuf_pointer;
+    return 1;
+}
+
+/**
+ * @brief Close the metadata log, truncating the file to the records actually written
+ * @param ml - metadata log
+ */
+void metalog_close (struct elphel_metalog_t * ml) {
+    long size=0;
+    if (ml->header) {
+        size= sizeof(struct elphel_metalog_header_t) + ml->header->num_records * sizeof(struct elphel_metalog_record_t);
+        munmap(ml->header, ml->map_size);
+    }
+    if (ml->fd >= 0) {
+        if (size) ftruncate(ml->fd, size);
+        close(ml->fd);
+    }
+    if (ml->page) pefree(ml->page, 1);
+    memset(ml, 0, sizeof(struct elphel_metalog_t));
+    ml->fd= -1;
+}
+
+/**
+ * @brief Start logging metadata of the compressed frames of the port to a compact binary file (header and fixed size records,
+ * struct elphel_metalog_record_t). Frames are added by elphel_metalog_update(), starting from the next frame to be compressed.
+ * @param port - sensor port (0..3)
+ * @param path - log file path
+ * @param append - (optional) continue existing log, default false - start a new one
+ * @return <0 - -errno, otherwise number of records already in the log
+ */
+PHP_FUNCTION(elphel_metalog_open)
+{
+    long port;
+    char * path;
+    int path_len;
+    zend_bool append=0;
+    int rslt;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ls|b", &port, &path, &path_len, &append) == FAILURE) {
+        RETURN_NULL();
     }
-    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
     if ((port <0) || (port >= SENSOR_PORTS))
-        RETURN_LONG (-1);
-    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
-        RETURN_LONG (-1);
-    if (frame <0) {
-        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+        RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS | ELPHEL_OPEN_CIRCBUF | ELPHEL_OPEN_EXIF) < 0) RETURN_NULL();
+    metalog_close(&ELPHEL_G(metalog[port]));
+    rslt= metalog_open(&ELPHEL_G(metalog[port]), path, port, append);
+    if (rslt < 0) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open metadata log %s (%d)", path, rslt);
+        RETURN_LONG(rslt);
+    }
+    ELPHEL_G(metalog[port]).next_pointer= lseek((int) ELPHEL_G(fd_circ[port]), LSEEK_CIRC_TOWP, SEEK_END);
+    RETURN_LONG(ELPHEL_G(metalog[port]).header->num_records);
+}
+
+/**
+ * @brief Add all the frames compressed since the previous call to the metadata log of the port (does not wait for new frames)
+ * @param port - sensor port (0..3)
+ * @return NULL - log is not open, <0 - -errno, otherwise number of records added. Frames overwritten before they were
+ *         logged are skipped (call it at least once per buffer turnover)
+ */
+PHP_FUNCTION(elphel_metalog_update)
+{
+    long port;
+    long p, added=0;
+    int rslt, fd_circ;
+    struct elphel_metalog_t * ml;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &port) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS | ELPHEL_OPEN_CIRCBUF | ELPHEL_OPEN_EXIF) < 0) RETURN_NULL();
+    ml= &ELPHEL_G(metalog[port]);
+    if (!ml->header) RETURN_NULL();
+    fd_circ= ELPHEL_G(fd_circ[port]);
+    lseek(fd_circ, ml->next_pointer, SEEK_SET);
+    if (lseek(fd_circ, LSEEK_CIRC_VALID, SEEK_END) < 0) { /// overrun since the last update - continue from the oldest frame
+        lseek(fd_circ, LSEEK_CIRC_FIRST, SEEK_END);
+    }
+    while ((p= lseek(fd_circ, LSEEK_CIRC_READY, SEEK_END)) >= 0) {
+        rslt= metalog_append(ml, p);
+        if (rslt < 0) RETURN_LONG(rslt);
+        added+= rslt;
+        ml->next_pointer= p;
+        p= lseek(fd_circ, LSEEK_CIRC_NEXT, SEEK_END);
+        if (p < 0) break;
+        ml->next_pointer= p;
+    }
+    RETURN_LONG(added);
+}
+
+/**
+ * @brief Stop metadata logging for the port, truncate the log file to the written records
+ * @param port - sensor port (0..3)
+ * @return NULL - wrong port, otherwise number of records in the log (0 if it was not open)
+ */
+PHP_FUNCTION(elphel_metalog_close)
+{
+    long port;
+    long num_records=0;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &port) == FAILURE) {
+        RETURN_NULL();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_NULL();
+    if (ELPHEL_G(metalog[port]).header) num_records= ELPHEL_G(metalog[port]).header->num_records;
+    metalog_close(&ELPHEL_G(metalog[port]));
+    RETURN_LONG(num_records);
+}
+
+/**
+ * @brief Add a metadata log record to the columns of elphel_metalog_query() result
+ * @param columns - METALOG_COLUMNS indexed arrays
+ * @param record - metadata log record
+ */
+void metalog_add_record (zval ** columns, const struct elphel_metalog_record_t * record) {
+    add_next_index_long  (columns[0],  record->frame);
+    add_next_index_double(columns[1],  record->timestamp_sec + 0.000001 * record->timestamp_usec);
+    add_next_index_long  (columns[2],  record->timestamp_sec);
+    add_next_index_long  (columns[3],  record->timestamp_usec);
+    add_next_index_long  (columns[4],  record->circbuf_pointer);
+    add_next_index_long  (columns[5],  record->frame_length);
+    add_next_index_long  (columns[6],  record->quality2);
+    add_next_index_long  (columns[7],  record->hash32_r);
+    add_next_index_long  (columns[8],  record->hash32_g);
+    add_next_index_long  (columns[9],  record->hash32_gb);
+    add_next_index_long  (columns[10], record->hash32_b);
+    add_next_index_long  (columns[11], record->exposure);
+    add_next_index_long  (columns[12], record->gain_r);
+    add_next_index_long  (columns[13], record->gain_g);
+    add_next_index_long  (columns[14], record->gain_b);
+    add_next_index_long  (columns[15], record->gain_gb);
+    add_next_index_bool  (columns[16], (record->flags & METALOG_FLAG_GPS) != 0);
+    add_next_index_double(columns[17], record->latitude);
+    add_next_index_double(columns[18], record->longitude);
+    add_next_index_double(columns[19], record->altitude);
+}
+
+/**
+ * @brief Read records from the metadata log file. Records are appended in capture order, so frame numbers and timestamps
+ * increase and the range is found with a binary search over the sorted part (header sorted_records). Records after it
+ * (frames or timestamps went back after restarting in append mode) are checked one by one
+ * @param path - log file path
+ * @param from - first frame number (or time, seconds) to return
+ * @param to - last frame number (or time, seconds) to return, inclusive
+ * @param by_time - (optional) from/to are timestamps (seconds since epoch, fractional), default false - frame numbers
+ * @return NULL - error, otherwise associative array of indexed arrays (columns): "frame", "timestamp" (double),
+ *         "timestamp_sec", "timestamp_usec", "circbuf_pointer", "frame_length", "quality2", "hash32_r", "hash32_g",
+ *         "hash32_gb", "hash32_b", "exposure", "gain_r", "gain_g", "gain_b", "gain_gb", "gps" (bool), "latitude", "longitude", "altitude"
+ */
+PHP_FUNCTION(elphel_metalog_query)
+{
+    const char * column_names[] = {"frame", "timestamp", "timestamp_sec", "timestamp_usec", "circbuf_pointer", "frame_length", "quality2",
+                                   "hash32_r", "hash32_g", "hash32_gb", "hash32_b", "exposure", "gain_r", "gain_g", "gain_b", "gain_gb",
+                                   "gps", "latitude", "longitude", "altitude"};
+    zval * columns[METALOG_COLUMNS];
+    char * path;
+    int path_len;
+    double from, to;
+    zend_bool by_time=0;
+    int fd, i;
+    struct stat file_stat;
+    struct elphel_metalog_header_t * header;
+    struct elphel_metalog_record_t * records, * record;
+    long num_records, sorted_records, low, high, mid, first, last;
+    double key;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sdd|b", &path, &path_len, &from, &to, &by_time) == FAILURE) {
+        RETURN_NULL();
+    }
+    fd= open(path, O_RDONLY);
+    if (fd < 0) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open metadata log %s", path);
+        RETURN_NULL();
+    }
+    if ((fstat(fd, &file_stat) < 0) || (file_stat.st_size < sizeof(struct elphel_metalog_header_t))) {
+        close(fd);
+        RETURN_NULL();
     }
-    hash32=get_imageParamsThat (port, P_GTAB_R+color, frame);
-    if (hash32 == 0xffffffff) RETURN_LONG (-1);
+    header= (struct elphel_metalog_header_t *) mmap(0, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ((void *) header == MAP_FAILED) RETURN_NULL();
+    if (memcmp(header->magic, METALOG_MAGIC, sizeof(header->magic)) || (header->record_size != sizeof(struct elphel_metalog_record_t)) ||
+            (header->header_size != sizeof(struct elphel_metalog_header_t))) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "%s is not a metadata log of this version", path);
+        munmap(header, file_stat.st_size);
+        RETURN_NULL();
+    }
+    records= (struct elphel_metalog_record_t *) (((char *) header) + header->header_size);
+    num_records= header->num_records; /// may grow while the log is being written - use the snapshot
+    __sync_synchronize(); /// pairs with the barrier in metalog_append(), records below num_records are complete
+    /// header_size <= st_size was checked above, compare without multiplying (untrusted num_records)
+    if (num_records > ((file_stat.st_size - header->header_size) / sizeof(struct elphel_metalog_record_t)))
+        num_records= (file_stat.st_size - header->header_size) / sizeof(struct elphel_metalog_record_t);
+#define METALOG_KEY(r) (by_time? ((r)->timestamp_sec + 0.000001 * (r)->timestamp_usec) : (double) (r)->frame)
+    sorted_records= header->sorted_records;
+    if (sorted_records > num_records) sorted_records= num_records;
+    /// first record with key >= from
+    for (low=0, high=sorted_records; low < high; ) {
+        mid= (low + high) >> 1;
+        if (METALOG_KEY(&records[mid]) < from) low= mid + 1;
+        else                                   high= mid;
+    }
+    first= low;
+    /// first record with key > to
+    for (high=sorted_records; low < high; ) {
+        mid= (low + high) >> 1;
+        if (METALOG_KEY(&records[mid]) <= to) low= mid + 1;
+        else                                  high= mid;
+    }
+    last= low;
+    array_init(return_value);
+    for (i=0; i < METALOG_COLUMNS; i++) {
+        ALLOC_INIT_ZVAL(columns[i]);
+        array_init(columns[i]);
+    }
+    for (record= &records[first]; record < &records[last]; record++) metalog_add_record(columns, record);
+    /// unsorted tail (frames/timestamps went back after a restart) - check every record
+    for (record= &records[sorted_records]; record < &records[num_records]; record++) {
+        key= METALOG_KEY(record);
+        if ((key >= from) && (key <= to)) metalog_add_record(columns, record);
+    }
+#undef METALOG_KEY
+    munmap(header, file_stat.st_size);
+    for (i=0; i < METALOG_COLUMNS; i++) add_assoc_zval(return_value, column_names[i], columns[i]);
+}
+
+/**
+ * @brief Find the gamma cache entry of the gamma table used for the specified frame.
+ * Resolved hash32 are remembered in ELPHEL_G(gamma_index_cache), a remembered index is used while the mmap-ed
+ * gamma_cache entry still holds the same hash32 and is marked valid. The driver may drop the reverse table
+ * of an entry at any time, so requests that need it always go to the driver.
+ * @param port - sensor port (0..3), should be valid
+ * @param color - needed color (0..3)
+ * @param frame - absolute frame number
+ * @param need_reverse - also need reverse table (GAMMA_MODE_NEED_REVERSE)
+ * @return -1 if too late (or other errors), -2 if the table is not in the cache, otherwise gamma cache index
+ */
+int gamma_frame_index (long port, long color, long frame, int need_reverse) {
+    unsigned long hash32; /// combined black, gamma, scale
+    unsigned long  write_data[2];
+    int rslt;
+    int gamma_index;
+    struct elphel_gamma_index_t * cached;
+    //  php_printf ("frame=0x%lx, color=0x%lx\n",frame, color);
+    hash32=get_imageParamsThat (port, P_GTAB_R+color, frame); // FIXME: No sub_chn yet !!!
+    //  php_printf ("hash32=0x%lx\n",hash32);
+    if (hash32 == 0xffffffff) return -1;
+    cached= &ELPHEL_G(gamma_index_cache)[GAMMA_INDEX_HASH(hash32)];
+    if (!need_reverse && (cached->index > 0) && (cached->hash32 == hash32) &&
+            (((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[cached->index].hash32 == hash32) &&
+            (((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[cached->index].valid & GAMMA_VALID_MASK)) return cached->index;
     /// now request gamma table for that hash32, including reverse
     write_data[0]=hash32;
-    write_data[1]= GAMMA_MODE_NEED_REVERSE;
+    write_data[1]= need_reverse? GAMMA_MODE_NEED_REVERSE : 0;
     rslt=write(ELPHEL_G(fd_gamma_cache), write_data, 6);
-    if (rslt<= 0) {
-        RETURN_LONG (-1);
-    }
+    if (rslt<= 0) return -1;
     gamma_index=lseek(ELPHEL_G(fd_gamma_cache), 0, SEEK_CUR);
-    if (gamma_index <= 0) {
-        RETURN_LONG (-2); /// gamma table may be lost in cache - need reload/recalculation through elphel_gamma_add()
+    if (gamma_index <= 0) return -2; /// gamma table may be lost in cache - need reload/recalculation through elphel_gamma_add()
+    if (gamma_index < GAMMA_CACHE_NUMBER) {
+        cached->hash32= hash32;
+        cached->index=  gamma_index;
     }
-    gamma_direct= &(((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[gamma_index].direct[0]); /// [257]  "Gamma" table, 16-bit for both non-scaled prototypes
-    ///  and scaled, 0..0xffff range (hardware will use less)
-    gamma_reverse=&(((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[gamma_index].reverse[0]);/// [256] reverse table to speed-up reversing (still need
-    /// interpolation).Index - most significant 8 bits, data - largest direct
-    lgammaLevel=0x10000*gammaLevel;
-    if (lgammaLevel <0) RETURN_LONG (-1);
-    if (lgammaLevel >0xffff) lgammaLevel=0xffff;
+    return gamma_index;
+}
+
+/**
+ * @brief Convert sensor level to the gamma converter output using the direct table (linear interpolation between entries)
+ * @param gamma_direct - [257]  "Gamma" table, 16-bit for both non-scaled prototypes and scaled, 0..0xffff range
+ * @param sensorLevel - level (0.0 <=level<1.0)
+ * @return -1.0 for negative levels, otherwise a fraction of the full output level (0.0..1.0)
+ */
+double gamma_direct_level (const unsigned short * gamma_direct, double sensorLevel) {
+    long lsensorLevel=0x10000*sensorLevel;
+    if (lsensorLevel <0) return -1.0;
+    if (lsensorLevel >0xffff) lsensorLevel=0xffff;
+    return (1.0/(1<<24))* ((((long) gamma_direct[lsensorLevel>>8])<<8) +
+            (((long) gamma_direct[(lsensorLevel>>8)+1] - ((long) gamma_direct[lsensorLevel>>8]))*(lsensorLevel & 0xff)));
+}
+
+/**
+ * @brief Back-translate gamma converter output to the sensor level using the direct and reverse tables
+ * @param gamma_direct - [257]  "Gamma" table
+ * @param gamma_reverse - [256] reverse table to speed-up reversing (still need interpolation).
+ *                        Index - most significant 8 bits, data - largest direct
+ * @param lgammaLevel - level, 0..0xffff
+ * @return sensor level, 0..0xffff
+ */
+long gamma_reverse_full (const unsigned short * gamma_direct, const unsigned char * gamma_reverse, long lgammaLevel) {
+    long sensor_high8,delta, sensor_full;
     sensor_high8=gamma_reverse[lgammaLevel >> 8]; /// 8 MSBs used as index
     if (sensor_high8>0) sensor_high8--;                                                     /// seems gamma_reverse[] rounds up, not down
     while ((sensor_high8>0) &&  (gamma_direct[sensor_high8] > lgammaLevel)) sensor_high8--;    /// adjust down (is that needed at all?)
@@ -2107,35 +4116,322 @@ PHP_FUNCTION(elphel_reverse_gamma)
     /// limit just in case?
     if      (sensor_full <      0) sensor_full=0;
     else if (sensor_full > 0xffff) sensor_full=0xffff;
-    RETURN_DOUBLE ((1.0/(1<<16))* sensor_full);
+    return sensor_full;
 }
 
 /**
- * @brief common function to get index of the histogram cache for the specified color. May wait for the frame to become available
- * @param port - sensor port (0..3)
- * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
- * @param color 0..3 - requested color (0 -R, 1 - G (used as Y ), 2 - GB (second green), 3 - blue
- * @param frame absolute frame number (histogrames are available for the previous (to current) frame
- * @param needreverse 0 if only cumulative histogram is needed, >0 if the reverse is also needed
- * @return <0 if histogram can not be found fo the specified frame (i.e. too late), otherwise it is an index in histogram cache.
- */
-int get_histogram_index (long port, long sub_chn, long color,long frame, long needreverse) { /// histogram is available for previous frame, not for the current one
-    long hist_index;
-    if ((color<0)    || (color >=   4))           return -1; /// wrong color
-    if ((port <0)    || (port >=   SENSOR_PORTS)) return -1;
-    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS)) return -1;
-#ifdef DELAY_HISTOGRAMS_INIT
-    if (ELPHEL_G(fd_histogram_cache) <0) php_elphel_init_histograms();
-#endif
-    lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_SET_CHN + (4 * port) + sub_chn, SEEK_END); /// specify port/sub-channel is needed
-    if (color == COLOR_Y_NUMBER) lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_WAIT_Y, SEEK_END); /// wait for just Y (G1)
-    else                         lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_WAIT_C, SEEK_END); /// wait for all histograms, not just Y (G1)
-    lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_NEEDED + ((1 << color) << (needreverse? 8:4)), SEEK_END); /// specify what color is needed and if reverse is needed
-    return lseek(ELPHEL_G(fd_histogram_cache), frame, SEEK_SET);                                             /// request histogram for the specified frame
+ * @brief Back-translate gamma converter output to the sensor level using the direct and reverse tables
+ * @param gamma_direct - [257]  "Gamma" table
+ * @param gamma_reverse - [256] reverse table
+ * @param gammaLevel - level (0.0 <=level<1.0)
+ * @return -1.0 for negative levels, otherwise a fraction of the full sensor level (0.0..1.0)
+ */
+double gamma_reverse_level (const unsigned short * gamma_direct, const unsigned char * gamma_reverse, double gammaLevel) {
+    long lgammaLevel=0x10000*gammaLevel;
+    if (lgammaLevel <0) return -1.0;
+    if (lgammaLevel >0xffff) lgammaLevel=0xffff;
+    return (1.0/(1<<16))* gamma_reverse_full (gamma_direct, gamma_reverse, lgammaLevel);
 }
 
 /**
- * @brief return value of parameter 'index' from frame 'frame' - use pastPars if too late for framePars
+ * @brief Get full resolution (65536 entries) inverse of the gamma cache entry, build it on first use.
+ * Inverse tables are kept for GAMMA_INVERSE_NUMBER most recently used gamma tables (one LRU cache shared by all ports and
+ * colors, large enough for a different table on each of them), they are matched by hash32 and
+ * the direct table contents (custom tables may be replaced with the same hash32)
+ * @param gamma_index - gamma cache index resolved with GAMMA_MODE_NEED_REVERSE
+ * @param build - build (possibly evicting the least recently used table) if there is no inverse yet, 0 - only look up
+ * @return inverse table (same values as gamma_reverse_full() for each level) or NULL if it is not built or could not be allocated
+ */
+const unsigned short * gamma_inverse_table (int gamma_index, int build) {
+    struct gamma_stuct_t * gamma= &((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[gamma_index];
+    struct elphel_gamma_inverse_t * inverse= ELPHEL_G(gamma_inverse);
+    unsigned short gamma_direct[257];
+    unsigned char  gamma_reverse[256];
+    int i, lru=0;
+    long level;
+    /// copy the tables so they can not change while building
+    memcpy(gamma_direct,  &gamma->direct[0],  sizeof(gamma_direct));
+    memcpy(gamma_reverse, &gamma->reverse[0], sizeof(gamma_reverse));
+    ELPHEL_G(gamma_inverse_clock)++;
+    for (i=0; i < GAMMA_INVERSE_NUMBER; i++) {
+        if (inverse[i].used && (inverse[i].hash32 == gamma->hash32) && !memcmp(inverse[i].direct, gamma_direct, sizeof(gamma_direct))) {
+            inverse[i].used= ELPHEL_G(gamma_inverse_clock);
+            return inverse[i].table;
+        }
+        if (inverse[i].used < inverse[lru].used) lru= i;
+    }
+    if (!build) return NULL;
+    if (!inverse[lru].table) {
+        inverse[lru].table= (unsigned short *) malloc(0x10000 * sizeof(unsigned short)); /// not pemalloc() - it aborts instead of failing
+        if (!inverse[lru].table) return NULL; /// callers fall back to gamma_reverse_level()
+    }
+    for (level=0; level < 0x10000; level++) inverse[lru].table[level]= gamma_reverse_full (gamma_direct, gamma_reverse, level);
+    memcpy(inverse[lru].direct, gamma_direct, sizeof(gamma_direct));
+    inverse[lru].hash32= gamma->hash32;
+    inverse[lru].used=   ELPHEL_G(gamma_inverse_clock);
+    return inverse[lru].table;
+}
+
+/**
+ * @brief Back-translate gamma converter output to the sensor level with the full resolution inverse table
+ * @param inverse - table from gamma_inverse_table()
+ * @param gammaLevel - level (0.0 <=level<1.0)
+ * @return -1.0 for negative levels, otherwise a fraction of the full sensor level (0.0..1.0)
+ */
+double gamma_inverse_level (const unsigned short * inverse, double gammaLevel) {
+    long lgammaLevel=0x10000*gammaLevel;
+    if (lgammaLevel <0) return -1.0;
+    if (lgammaLevel >0xffff) lgammaLevel=0xffff;
+    return (1.0/(1<<16))* inverse[lgammaLevel];
+}
+
+/**
+ * @brief Use current (for the specified frame) gamma table to convert input data (fraction <1.0) into output value (used by histograms)
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @param color - needed color (0..3)
+ * @param sensorLevel - level (0.0 <=level<1.0) proportional to the sensor output, normalized to 0.0..1.0 scale
+ * @param frame (optional) absolute frame number for which gamma table is needed. NOTE: Will not wait if it is in the future - just return -1
+ *               if frame is not specified - will use the previous to current frame - same as the one for which histogram is availble (or will be very soon)
+ * @return -1 if too late (or other errors), otherwise a fraction of the full output level (0.0..1.0)
+ */
+
+PHP_FUNCTION(elphel_gamma)
+{
+    long port, sub_chn;
+    long   color;
+    long frame =-1;
+    double sensorLevel;
+    int gamma_index;
+    unsigned short * gamma_direct;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llld|l", &port, &sub_chn, &color, &sensorLevel, &frame ) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    if ((ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) || (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_GAMMA) < 0)) RETURN_LONG (-1);
+    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
+        RETURN_LONG (-1);
+
+    if (frame <0) {
+        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+    }
+    gamma_index= gamma_frame_index (port, color, frame, 0);
+    if (gamma_index < 0) RETURN_LONG (gamma_index);
+    gamma_direct= &(((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[gamma_index].direct[0]);/// [257]  "Gamma" table, 16-bit for both non-scaled prototypes
+    ///  and scaled, 0..0xffff range (hardware will use less)
+    sensorLevel= gamma_direct_level (gamma_direct, sensorLevel);
+    if (sensorLevel < 0.0) RETURN_LONG (-1);
+    RETURN_DOUBLE (sensorLevel);
+}
+
+/**
+ * @brief Use current (for the specified frame) gamma table to back-translate gamma converter output data (fraction <1.0) into the  input (sensor) data
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @param color - needed color (0..3)
+ * @param gammaLevel - level (0.0 <=level<1.0) proportional to the senosor output, normalized to 0.0..1.0 scale
+ * @param frame (optional) absolute frame number for which gamma table is needed. NOTE: Will not wait if it is in the future - just return -1
+ *               if frame is not specified - will use the previous to current frame - same as the one for which histogram is availble (or will be very soon)
+ * @return -1 if too late (or other errors), otherwise a fraction of the full output level (0.0..1.0)
+ */
+
+PHP_FUNCTION(elphel_reverse_gamma)
+{
+    long port, sub_chn;
+    long   color;
+    long   frame=-1;
+    double gammaLevel;
+    int gamma_index;
+    unsigned short * gamma_direct;
+    unsigned char * gamma_reverse;
+    const unsigned short * inverse;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llld|l",&port, &sub_chn,  &color, &gammaLevel, &frame ) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    if ((ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) || (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_GAMMA) < 0)) RETURN_LONG (-1);
+    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
+        RETURN_LONG (-1);
+    if (frame <0) {
+        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+    }
+    gamma_index= gamma_frame_index (port, color, frame, 1);
+    if (gamma_index < 0) RETURN_LONG (gamma_index);
+    gamma_direct= &(((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[gamma_index].direct[0]); /// [257]  "Gamma" table, 16-bit for both non-scaled prototypes
+    ///  and scaled, 0..0xffff range (hardware will use less)
+    gamma_reverse=&(((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[gamma_index].reverse[0]);/// [256] reverse table to speed-up reversing (still need
+    /// interpolation).Index - most significant 8 bits, data - largest direct
+    inverse= gamma_inverse_table (gamma_index, 0); /// a single level does not justify building (and evicting) a 64K table
+    if (inverse) gammaLevel= gamma_inverse_level (inverse, gammaLevel);
+    else         gammaLevel= gamma_reverse_level (gamma_direct, gamma_reverse, gammaLevel);
+    if (gammaLevel < 0.0) RETURN_LONG (-1);
+    RETURN_DOUBLE (gammaLevel);
+}
+
+/**
+ * @brief Convert array of levels with the gamma table used for the specified frame (table is looked up once, same
+ * interpolation as elphel_gamma()/elphel_reverse_gamma())
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @param color - needed color (0..3)
+ * @param levels - array of levels (0.0 <=level<1.0)
+ * @param frame (optional) absolute frame number for which gamma table is needed, -1 - previous to current frame
+ * @param reverse (optional) - back-translate gamma converter output into sensor levels (as elphel_reverse_gamma())
+ * @return -1 if too late (or other errors), -2 if the gamma table is not in the cache, otherwise array with the same keys as levels,
+ *         converted levels (-1 for negative levels)
+ */
+PHP_FUNCTION(elphel_gamma_array)
+{
+    long port, sub_chn;
+    long   color;
+    long   frame=-1;
+    zend_bool reverse=0;
+    zval *arr, **data, level;
+    HashTable *arr_hash;
+    HashPosition pointer;
+    char *key;
+    int   key_len;
+    ulong index;
+    int gamma_index;
+    unsigned short gamma_direct[257];
+    unsigned char  gamma_reverse[256];
+    const unsigned short * inverse=NULL;
+    double value;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llla|lb",&port, &sub_chn,  &color, &arr, &frame, &reverse) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    if ((ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) || (ELPHEL_NEED_GLOBAL(ELPHEL_OPEN_GAMMA) < 0)) RETURN_LONG (-1);
+    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
+        RETURN_LONG (-1);
+    if (frame <0) {
+        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+    }
+    gamma_index= gamma_frame_index (port, color, frame, reverse);
+    if (gamma_index < 0) RETURN_LONG (gamma_index);
+    /// copy the tables so they can not change while converting
+    memcpy(gamma_direct, &(((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[gamma_index].direct[0]), sizeof(gamma_direct));
+    if (reverse) {
+        memcpy(gamma_reverse, &(((struct gamma_stuct_t *) ELPHEL_G(gamma_cache))[gamma_index].reverse[0]), sizeof(gamma_reverse));
+        inverse= gamma_inverse_table (gamma_index, 1);
+    }
+    array_init(return_value);
+    arr_hash = Z_ARRVAL_P(arr);
+    for(zend_hash_internal_pointer_reset_ex(arr_hash, &pointer);
+            zend_hash_get_current_data_ex(arr_hash, (void**) &data, &pointer) == SUCCESS;
+            zend_hash_move_forward_ex(arr_hash, &pointer)) {
+        level= **data;
+        zval_copy_ctor(&level);
+        convert_to_double(&level);
+        if      (inverse) value= gamma_inverse_level (inverse, Z_DVAL(level));
+        else if (reverse) value= gamma_reverse_level (gamma_direct, gamma_reverse, Z_DVAL(level));
+        else              value= gamma_direct_level (gamma_direct, Z_DVAL(level));
+        zval_dtor(&level);
+        if (zend_hash_get_current_key_ex(arr_hash, &key, &key_len, &index, 0, &pointer) == HASH_KEY_IS_STRING) {
+            if (value < 0.0) add_assoc_long  (return_value, key, -1);
+            else             add_assoc_double(return_value, key, value);
+        } else {
+            if (value < 0.0) add_index_long  (return_value, index, -1);
+            else             add_index_double(return_value, index, value);
+        }
+    }
+}
+
+/**
+ * @brief Get histograms for the specified frame. A copy of the histogram cache entry is kept in ELPHEL_G(hist_snapshot) for
+ * HIST_SNAPSHOT_NUMBER most recently used (port, sub_chn, frame), repeated requests for the same frame do not access the driver
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @param frame absolute frame number (histogrames are available for the previous (to current) frame
+ * @param needed - bitmask of the needed tables (as in elphel_histogram_get()), raw (FPGA) bits are not requested from the driver
+ * @param wait_y - wait for just Y (G1) histogram, not for all colors
+ * @param error - if not NULL, receives 1 if histograms are not available for the frame (i.e. too late), 2 - wrong cache index,
+ *                3 - frame changed while retrieving histograms
+ * @return snapshot of the histograms or NULL on error. Snapshot stays valid until the next call
+ */
+struct histogram_stuct_t * get_histogram_snapshot (long port, long sub_chn, long frame, long needed, int wait_y, int * error) {
+    struct elphel_hist_snapshot_t * snapshot= ELPHEL_G(hist_snapshot);
+    struct histogram_stuct_t * hist_cache;
+    long index, total_hist_entries;
+    unsigned long this_frame;
+    int i, lru=0;
+    if (error) *error= 0;
+    needed &= 0xfff;
+    ELPHEL_G(hist_snapshot_clock)++;
+    /// frame number went backwards (sensor restarted) - snapshots of the "future" frames are stale
+    this_frame= ELPHEL_GLOBALPARS(port, G_THIS_FRAME);
+    for (i=0; i < HIST_SNAPSHOT_NUMBER; i++) if (snapshot[i].used && (snapshot[i].port == port) && ((long) (snapshot[i].hist.frame - this_frame) >= 0))
+        snapshot[i].used= 0;
+    for (i=0; i < HIST_SNAPSHOT_NUMBER; i++) {
+        if (snapshot[i].used && (snapshot[i].port == port) && (snapshot[i].sub_chn == sub_chn) && ((long) snapshot[i].hist.frame == frame)) {
+            if ((snapshot[i].hist.valid & needed) == needed) {
+                snapshot[i].used= ELPHEL_G(hist_snapshot_clock);
+                return &snapshot[i].hist;
+            }
+            lru= i; /// replace with the more complete copy
+            break;
+        }
+        if (snapshot[i].used < snapshot[lru].used) lru= i;
+    }
+#ifdef DELAY_HISTOGRAMS_INIT
+    if (ELPHEL_G(fd_histogram_cache) <0) php_elphel_init_histograms();
+#endif
+    total_hist_entries= lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_SET_CHN + (4 * port) + sub_chn, SEEK_END); /// specify port/sub-channel is needed
+    if (wait_y) lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_WAIT_Y, SEEK_END); /// wait for just Y (G1)
+    else        lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_WAIT_C, SEEK_END); /// wait for all histograms, not just Y (G1)
+    lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_NEEDED + (needed & 0xff0), SEEK_END); /// mask out needed raw (fpga) bits
+    index=lseek(ELPHEL_G(fd_histogram_cache), frame, SEEK_SET);    /// request histograms for frame=frame, wait until available if needed
+    if (index <0) {
+        if (error) *error= 1;
+        return NULL;
+    }
+    if (index >= total_hist_entries) {
+        if (error) *error= 2;
+        return NULL;
+    }
+    hist_cache= &(((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[index]);
+    memcpy(&snapshot[lru].hist, hist_cache, sizeof(struct histogram_stuct_t));
+    /// verify that histogram is still valid
+    if (((long) snapshot[lru].hist.frame != frame) || ((long) hist_cache->frame != frame)) {
+        snapshot[lru].used= 0;
+        if (error) *error= 3;
+        return NULL;
+    }
+    snapshot[lru].port=    port;
+    snapshot[lru].sub_chn= sub_chn;
+    snapshot[lru].used=    ELPHEL_G(hist_snapshot_clock);
+    return &snapshot[lru].hist;
+}
+
+/**
+ * @brief report get_histogram_snapshot() error
+ * @param frame absolute frame number
+ * @param needed - bitmask of the needed tables
+ * @param error - error code from get_histogram_snapshot()
+ */
+void histogram_snapshot_error (long frame, long needed, int error) {
+    switch (error) {
+    case 1:
+        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Requested histograms are not available (frame=%d, needed=0x%x)", (int) frame, (int) needed);
+        break;
+    case 2:
+        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Internal error: frame=%d, histogram cache index >= total_hist_entries", (int) frame);
+        break;
+    default:
+        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Frame changed while retrieving histograms (frame requested=%d)", (int) frame);
+    }
+}
+
+/**
+ * @brief return value of parameter 'index' from frame 'frame' - use pastPars if too late for framePars
  * @param port sensor port (0..3)
  * @param indx parameter indx
  * @param frame absolute frame number
@@ -2154,175 +4450,1122 @@ unsigned long get_imageParamsThat     (int port, int indx, unsigned long frame)
         if (((struct framepars_past_t *) ELPHEL_G(pastPars[port]))[frame_index].past_pars[P_FRAME-PARS_SAVE_FROM] != frame) { /// too late even for pastPars? Or a bug?
             return 0xffffffff;
         }
-    } else {
-        value=((struct framepars_t *) ELPHEL_G(framePars[port]))[frame_index].pars[indx];
+    } else {
+        value=((struct framepars_t *) ELPHEL_G(framePars[port]))[frame_index].pars[indx];
+    }
+    return value;
+}
+
+/**
+ * @brief Interpolate cumulative histogram - fraction of all pixels below the specified level
+ * @param hist_cumul - 256 of cumulated histogram values (in pixels) for the color
+ * @param dlevel - level (0.0 <=level<1.0) to compare pixel values to (-1 - error)
+ * @return -1.0 on error, otherwise a fraction of pixels (0..1.0) that are below the specified level
+ */
+double histogram_level_fraction (const unsigned long * hist_cumul, double dlevel) {
+    long llevel, total_pixels, hist;
+    llevel=0x10000*dlevel;
+    if      (llevel< -0.5) return -1.0; /// if input level was ==-1 - error, don't try
+    if      (llevel<0) llevel=0;
+    else if (llevel>0xffff) llevel=0xffff;
+    total_pixels=  hist_cumul[255];
+    hist=  (llevel>>8)?hist_cumul[(llevel>>8)-1]:0;
+    hist +=((hist_cumul[llevel>>8]-hist)*(llevel & 0xff))>>8;
+    return ((double) hist)/total_pixels;
+}
+
+/**
+ * @brief Interpolate percentile - level so that specified fraction of all pixels are below it
+ * @param hist_cumul - 256 of cumulated histogram values (in pixels) for the color
+ * @param hist_percentile - 256 of rounded percentiles (1 byte) - used as a starting point for linear interpolation
+ * @param fraction - fraction  (0.0 <=fraction<1.0) of all pixels to have value under the output (-1 - error)
+ * @return -1.0 on error, otherwise a level (in the 0.0<1.0 range)
+ */
+double histogram_fraction_level (const unsigned long * hist_cumul, const unsigned char * hist_percentile, double fraction) {
+    long frac_pixels, total_pixels, frac_256, delta;
+    long perc, perc_frac;
+    if (fraction < -0.5) return -1.0; /// if input level was ==-1 - error, don't try
+    total_pixels=  hist_cumul[255];
+    frac_pixels=total_pixels*fraction;
+    if      (frac_pixels<0) frac_pixels=0;
+    else if (frac_pixels>=total_pixels) frac_pixels=total_pixels-1;
+    frac_256=256*fraction; ///floor()
+    if      (frac_256 < 0)   frac_256=0;
+    else if (frac_256 > 255) frac_256=255;
+    perc=hist_percentile[frac_256];
+    if (perc>0) perc--;                                              /// seems hist_percentile[perc] rounds up, not down
+    while ((perc>0) &&  (hist_cumul[perc] > frac_pixels)) perc--;    /// adjust down  (is that needed at all?)
+    perc++;
+    while ((perc<255) &&  (hist_cumul[perc] <= frac_pixels)) perc++; /// adjust up  (is that needed at all?)
+    perc--;
+    delta=hist_cumul[perc+1] - hist_cumul[perc];
+    if (delta) {
+        perc_frac=((frac_pixels-hist_cumul[perc]) << 8)/delta;
+    } else perc_frac=0;
+    perc_frac += perc << 8;
+    return (1.0/(1<<16)) * ((double) perc_frac);
+}
+
+/**
+ * @brief Get cumulative histogram (fraction of all pixels below specified level)
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @param color - needed color (0..3)
+ * @param level - level (0.0 <=level<1.0) to compare pixel values to (-1 will return -1, error)
+ * @param frame (optional) absolute frame number for which histogram is needed. NOTE: If specified in the future - will wait
+ *               if frame is not specified - will use lates histogram (previous to current frame)
+ * @return -1 if too late (or other errors), otherwise a fraction of pixels (0..1.0) that are below the specified level
+ */
+PHP_FUNCTION(elphel_histogram)
+{
+    long port, sub_chn;
+    long frame=-1;
+    struct histogram_stuct_t * histogram;
+    double dlevel;
+    long  color;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llld|l", &port, &sub_chn, &color, &dlevel, &frame ) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_LONG (-1);
+    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
+        RETURN_LONG (-1);
+    if (frame <0) {
+        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+    }
+#ifdef DELAY_HISTOGRAMS_INIT
+    if (!ELPHEL_G(histogram_cache)) php_elphel_init_histograms();
+#endif
+    if (!(histogram=get_histogram_snapshot (port, sub_chn, frame, (1 << color) << 4, color == COLOR_Y_NUMBER, NULL))) RETURN_LONG (-1);
+    dlevel= histogram_level_fraction (&histogram->cumul_hist[color<<8], dlevel);
+    if (dlevel < 0.0) RETURN_LONG(-1) ; /// if input level was ==-1 - error
+    RETURN_DOUBLE(dlevel);
+}
+
+/**
+ * @brief Get percentile (reverse cumulative histogram) - level (as a fraction 0..1.0) so that specified fraction of all pixels
+ *        are below it
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @param color - needed color (0..3)
+ * @param fraction - fraction  (0.0 <=fraction<1.0) of all pixels to have value under the output (-1 will return -1, error)
+ * @param frame (optional) absolute frame number for which histogram is needed. NOTE: If specified in the future - will wait
+ *               if frame is not specified - will use latest histogram (previous to current frame)
+ * @return -1 if too late (or other errors), otherwise a level (in the 0.0<1.0 range) so that a specified fraction of all pixels are below it
+ */
+PHP_FUNCTION(elphel_reverse_histogram)
+{
+    long port, sub_chn;
+    long frame=-1;
+    struct histogram_stuct_t * histogram;
+    double fraction;
+    long  color;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llld|l", &port, &sub_chn, &color, &fraction, &frame ) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_LONG (-1);
+    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
+        RETURN_LONG (-1);
+    if (frame <0) {
+        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+    }
+#ifdef DELAY_HISTOGRAMS_INIT
+    if (!ELPHEL_G(histogram_cache)) php_elphel_init_histograms();
+#endif
+    if (!(histogram=get_histogram_snapshot (port, sub_chn, frame, ((1 << color) << 4) | ((1 << color) << 8), color == COLOR_Y_NUMBER, NULL))) RETURN_LONG (-1);
+    fraction= histogram_fraction_level (&histogram->cumul_hist[color<<8], &histogram->percentile[color<<8], fraction);
+    if (fraction < 0.0) RETURN_LONG(-1) ; /// if input level was ==-1 - error
+    RETURN_DOUBLE(fraction);
+}
+
+/**
+ * @brief Add array of histogram_level_fraction() or histogram_fraction_level() results to the result array
+ * @param result - result array
+ * @param name - key in the result array
+ * @param arr_hash - array of levels or fractions, result has the same keys
+ * @param histogram - histograms for the frame
+ * @param color - needed color (0..3)
+ * @param reverse - 0 - arr_hash has levels (cumulative histogram), 1 - fractions (percentiles)
+ */
+void histogram_query_array (zval * result, const char * name, HashTable * arr_hash, struct histogram_stuct_t * histogram, long color, int reverse) {
+    zval *values, **data, level;
+    HashPosition pointer;
+    char *key;
+    int   key_len;
+    ulong index;
+    double value;
+    MAKE_STD_ZVAL(values);
+    array_init(values);
+    for(zend_hash_internal_pointer_reset_ex(arr_hash, &pointer);
+            zend_hash_get_current_data_ex(arr_hash, (void**) &data, &pointer) == SUCCESS;
+            zend_hash_move_forward_ex(arr_hash, &pointer)) {
+        level= **data;
+        zval_copy_ctor(&level);
+        convert_to_double(&level);
+        if (reverse) value= histogram_fraction_level (&histogram->cumul_hist[color<<8], &histogram->percentile[color<<8], Z_DVAL(level));
+        else         value= histogram_level_fraction (&histogram->cumul_hist[color<<8], Z_DVAL(level));
+        zval_dtor(&level);
+        if (zend_hash_get_current_key_ex(arr_hash, &key, &key_len, &index, 0, &pointer) == HASH_KEY_IS_STRING) {
+            if (value < 0.0) add_assoc_long  (values, key, -1);
+            else             add_assoc_double(values, key, value);
+        } else {
+            if (value < 0.0) add_index_long  (values, index, -1);
+            else             add_index_double(values, index, value);
+        }
+    }
+    add_assoc_zval(result, name, values);
+}
+
+/**
+ * @brief Get many cumulative histogram values and percentiles for one color from the same histogram (retrieved once, same
+ * interpolation as elphel_histogram()/elphel_reverse_histogram())
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @param color - needed color (0..3)
+ * @param query - associative array:
+ * - 'levels'    - array of levels (0.0 <=level<1.0) to get fractions of pixels below them (as elphel_histogram())
+ * - 'fractions' - array of fractions (0.0 <=fraction<1.0) to get levels with that fraction of pixels below (as elphel_reverse_histogram())
+ * @param frame (optional) absolute frame number for which histogram is needed. NOTE: If specified in the future - will wait
+ *               if frame is not specified - will use latest histogram (previous to current frame)
+ * @return -1 if too late (or other errors), otherwise array with 'levels' and/or 'fractions' subarrays with the same keys as in the
+ *         query (-1 for negative input values)
+ */
+PHP_FUNCTION(elphel_histogram_query)
+{
+    long port, sub_chn;
+    long frame=-1;
+    long color, needed;
+    zval *query, **levels, **fractions;
+    HashTable *query_hash;
+    struct histogram_stuct_t * histogram;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llla|l", &port, &sub_chn, &color, &query, &frame ) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_LONG (-1);
+    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
+        RETURN_LONG (-1);
+    if (frame <0) {
+        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+    }
+    query_hash= Z_ARRVAL_P(query);
+    if ((zend_hash_find(query_hash, "levels", sizeof("levels"), (void**) &levels) == FAILURE) || (Z_TYPE_PP(levels) != IS_ARRAY)) levels=NULL;
+    if ((zend_hash_find(query_hash, "fractions", sizeof("fractions"), (void**) &fractions) == FAILURE) || (Z_TYPE_PP(fractions) != IS_ARRAY)) fractions=NULL;
+    needed= (1 << color) << 4;                /// cumulative histogram
+    if (fractions) needed |= (1 << color) << 8; /// percentiles
+#ifdef DELAY_HISTOGRAMS_INIT
+    if (!ELPHEL_G(histogram_cache)) php_elphel_init_histograms();
+#endif
+    if (!(histogram=get_histogram_snapshot (port, sub_chn, frame, needed, color == COLOR_Y_NUMBER, NULL))) RETURN_LONG (-1);
+    array_init(return_value);
+    if (levels)    histogram_query_array (return_value, "levels",    Z_ARRVAL_PP(levels),    histogram, color, 0);
+    if (fractions) histogram_query_array (return_value, "fractions", Z_ARRVAL_PP(fractions), histogram, color, 1);
+}
+
+/**
+ * @brief Calculate statistics of a 256-bin histogram. Bin i is treated as level (i+0.5)/256
+ * @param hist - 256 histogram values (in pixels)
+ * @param stats - receives the statistics (all 0 if the histogram is empty)
+ */
+void histogram_stats (const unsigned long * hist, struct elphel_hist_stats_t * stats) {
+    unsigned long long sum=0, sum1=0, sum2=0, inner, below;
+    double half, p, mean_bin;
+    long i;
+    memset(stats, 0, sizeof(struct elphel_hist_stats_t));
+    /// moments - no branches, so the loop can be vectorized
+    for (i=0; i < 256; i++) {
+        sum  += hist[i];
+        sum1 += (unsigned long long) hist[i] * i;
+        sum2 += (unsigned long long) hist[i] * (i * i);
+    }
+    if (!sum) return;
+    stats->count=        sum;
+    mean_bin=            ((double) sum1) / sum;
+    stats->mean=         (mean_bin + 0.5) / 256;
+    stats->variance=     (((double) sum2) / sum - mean_bin * mean_bin) / (256.0 * 256.0);
+    stats->clipped_low=  ((double) hist[0]) / sum;
+    stats->clipped_high= ((double) hist[255]) / sum;
+    inner= sum - hist[0] - hist[255];
+    if (inner) stats->center= (((double) (sum1 - 255ULL * hist[255])) / inner + 0.5) / 256;
+    else       stats->center= stats->mean;
+    /// median - interpolate inside the bin where cumulative histogram reaches half of the pixels
+    half=  0.5 * sum;
+    below= 0;
+    for (i=0; (i < 255) && ((below + hist[i]) < half); i++) below += hist[i];
+    stats->median= (i + (hist[i] ? ((half - below) / hist[i]) : 0.0)) / 256;
+    for (i=0; i < 256; i++) if (hist[i]) {
+        p= ((double) hist[i]) / sum;
+        stats->entropy -= p * log2(p);
+    }
+}
+
+/**
+ * @brief Get statistics of the raw histograms for the specified frame, calculated for each of the selected colors
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @param frame (optional) absolute frame number for which histogram is needed, -1 - previous to current frame
+ * @param color_mask (optional) - bitmask of the colors (bit 0 - R, 1 - G, 2 - GB, 3 - B), default 0xf
+ * @return -1 if too late (or other errors), otherwise array indexed by color number, each element is an associative array
+ *         with 'count', 'mean', 'variance', 'median', 'clipped_low', 'clipped_high', 'entropy' and 'center' (see struct elphel_hist_stats_t)
+ */
+PHP_FUNCTION(elphel_histogram_stats)
+{
+    long port, sub_chn;
+    long frame=-1;
+    long color_mask=0xf;
+    long color;
+    struct histogram_stuct_t * histogram;
+    struct elphel_hist_stats_t stats;
+    zval * color_stats;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll|ll", &port, &sub_chn, &frame, &color_mask) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_LONG (-1);
+    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
+        RETURN_LONG (-1);
+    color_mask &= 0xf;
+    if (!color_mask) RETURN_LONG (-1);
+    if (frame <0) {
+        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+    }
+#ifdef DELAY_HISTOGRAMS_INIT
+    if (!ELPHEL_G(histogram_cache)) php_elphel_init_histograms();
+#endif
+    /// raw (FPGA) histograms can not be calculated by the driver, only verify they are in the cache
+    if (!(histogram=get_histogram_snapshot (port, sub_chn, frame, color_mask, color_mask == (1 << COLOR_Y_NUMBER), NULL))) RETURN_LONG (-1);
+    if ((histogram->valid & color_mask) != color_mask) RETURN_LONG (-1);
+    array_init(return_value);
+    for (color=0; color < 4; color++) if (color_mask & (1 << color)) {
+        histogram_stats (&histogram->hist[color<<8], &stats);
+        MAKE_STD_ZVAL(color_stats);
+        array_init(color_stats);
+        add_assoc_long  (color_stats, "count",        stats.count);
+        add_assoc_double(color_stats, "mean",         stats.mean);
+        add_assoc_double(color_stats, "variance",     stats.variance);
+        add_assoc_double(color_stats, "median",       stats.median);
+        add_assoc_double(color_stats, "clipped_low",  stats.clipped_low);
+        add_assoc_double(color_stats, "clipped_high", stats.clipped_high);
+        add_assoc_double(color_stats, "entropy",      stats.entropy);
+        add_assoc_double(color_stats, "center",       stats.center);
+        add_index_zval(return_value, color, color_stats);
+    }
+}
+
+/**
+ * @brief Read autoexposure settings from the options array, use defaults for the missing ones
+ * @param options - elphel_autoexp_start() $config (associative array), may be NULL
+ * @param config - receives the settings
+ */
+void autoexp_config (HashTable * options, struct elphel_autoexp_config_t * config) {
+    config->sub_chn=       get_option_long   (options, "sub_chn",       0);
+    config->color=         get_option_long   (options, "color",         COLOR_Y_NUMBER) & 3;
+    config->percentile=    get_option_double (options, "percentile",    0.95);
+    config->level=         get_option_double (options, "level",         0.75);
+    config->exp_min=       get_option_long   (options, "exp_min",       1);
+    config->exp_max=       get_option_long   (options, "exp_max",       100000);
+    config->overexp_max=   get_option_double (options, "overexp_max",   0.01);
+    config->overexp_scale= get_option_double (options, "overexp_scale", 0.7);
+    config->skip_pmin=     get_option_double (options, "skip_pmin",     0.03);
+    config->skip_pmax=     get_option_double (options, "skip_pmax",     0.5);
+    config->skip_frames=   get_option_long   (options, "skip_frames",   1);
+    config->wb=            get_option_long   (options, "wb",            0);
+    config->wb_percentile= get_option_double (options, "wb_percentile", 0.5);
+    config->wb_min=        get_option_double (options, "wb_min",        0.25);
+    config->wb_max=        get_option_double (options, "wb_max",        4.0);
+}
+
+/**
+ * @brief Calculate exposure (and optionally white balance) correction from the frame histograms, schedule the new
+ * parameters (all in a single FRAMEPARS_SETFRAME write, FRAME_DEAFAULT_AHEAD frames ahead) and add a log record.
+ * Runs in the autoexposure thread
+ * @param port - sensor port (0..3)
+ * @param ae - port autoexposure state
+ * @param histogram - histograms (copy) of the frame, with the needed tables valid
+ */
+void autoexp_frame (long port, struct elphel_autoexp_t * ae, struct histogram_stuct_t * histogram) {
+    static const long gain_pars[4]= {P_GAINR, P_GAING, P_GAINGB, P_GAINB};
+    struct elphel_autoexp_config_t config;
+    struct elphel_autoexp_log_t record;
+    struct timespec ts;
+    unsigned long * hist_cumul;
+    unsigned long write_data[2 + 2 * 5]; /// FRAMEPARS_SETFRAME, frame, then address/value pairs: exposure and 4 gains
+    int    num_data=2;
+    double scale, ratio, level, level_g;
+    long   exposure, gain;
+    int    color;
+
+    pthread_mutex_lock(&ae->lock);
+    config= ae->config;
+    pthread_mutex_unlock(&ae->lock);
+    memset(&record, 0, sizeof(record));
+    record.frame=    histogram->frame;
+    record.exposure= get_imageParamsThat(port, P_EXPOS, record.frame);
+    if (record.exposure == 0xffffffff) return; /// too late for the frame parameters
+    for (color=0; color < 4; color++) record.gains[color]= get_imageParamsThat(port, gain_pars[color], record.frame);
+    hist_cumul= &histogram->cumul_hist[config.color<<8];
+    if (!hist_cumul[255]) return; /// no pixels
+    /// exposure - scale so config.percentile of pixels are below config.level
+    record.n_level= histogram_fraction_level (hist_cumul, &histogram->percentile[config.color<<8], config.percentile);
+    record.overexp= 1.0 - ((double) hist_cumul[254]) / hist_cumul[255];
+    scale= (record.n_level > 0.0)? (config.level / record.n_level) : AUTOEXP_SCALE_MAX;
+    if ((record.overexp > config.overexp_max) && (scale > config.overexp_scale)) scale= config.overexp_scale;
+    if      (scale > AUTOEXP_SCALE_MAX)       scale= AUTOEXP_SCALE_MAX;
+    else if (scale < 1.0 / AUTOEXP_SCALE_MAX) scale= 1.0 / AUTOEXP_SCALE_MAX;
+    record.t_scale= scale;
+    if (fabs(scale - 1.0) < config.skip_pmin) {
+        scale= 1.0;
+        ae->pending_scale= 0.0;
+    } else if ((fabs(scale - 1.0) > config.skip_pmax) && ((ae->pending_scale == 0.0) || ((ae->pending_scale > 1.0) != (scale > 1.0)))) {
+        ae->pending_scale= scale; /// wait one frame to confirm the large change
+        scale= 1.0;
+    } else {
+        ae->pending_scale= 0.0;
+    }
+    exposure= record.exposure * scale + 0.5;
+    if      (exposure < config.exp_min) exposure= config.exp_min;
+    else if (exposure > config.exp_max) exposure= config.exp_max;
+    if ((unsigned long) exposure != record.exposure) {
+        write_data[num_data++]= P_EXPOS;
+        write_data[num_data++]= exposure;
+        record.exposure= exposure;
+        record.changed |= AUTOEXP_CHANGED_EXPOS;
+    }
+    /// white balance - match levels of other colors to G at config.wb_percentile
+    if (config.wb && (record.gains[COLOR_Y_NUMBER] != 0xffffffff)) {
+        level_g= histogram_fraction_level (&histogram->cumul_hist[COLOR_Y_NUMBER<<8], &histogram->percentile[COLOR_Y_NUMBER<<8], config.wb_percentile);
+        for (color=0; (level_g > 0.0) && (color < 4); color++) {
+            if ((color == COLOR_Y_NUMBER) || (record.gains[color] == 0xffffffff) || !histogram->cumul_hist[(color<<8) + 255]) continue;
+            level= histogram_fraction_level (&histogram->cumul_hist[color<<8], &histogram->percentile[color<<8], config.wb_percentile);
+            if (level <= 0.0) continue;
+            ratio= level_g / level;
+            if (fabs(ratio - 1.0) < config.skip_pmin) continue;
+            gain= record.gains[color] * ratio + 0.5;
+            if      (gain < record.gains[COLOR_Y_NUMBER] * config.wb_min) gain= record.gains[COLOR_Y_NUMBER] * config.wb_min;
+            else if (gain > record.gains[COLOR_Y_NUMBER] * config.wb_max) gain= record.gains[COLOR_Y_NUMBER] * config.wb_max;
+            if ((unsigned long) gain != record.gains[color]) {
+                write_data[num_data++]= gain_pars[color];
+                write_data[num_data++]= gain;
+                record.gains[color]= gain;
+                record.changed |= AUTOEXP_CHANGED_EXPOS << (color + 1);
+            }
+        }
+    }
+    /// all changed parameters go to the same frame, so no frame gets new exposure with old gains
+    if (record.changed) {
+        write_data[0]= FRAMEPARS_SETFRAME;
+        write_data[1]= ELPHEL_GLOBALPARS(port, G_THIS_FRAME) + FRAME_DEAFAULT_AHEAD;
+        if (write(ELPHEL_G(fd_fparmsall[port]), write_data, num_data * sizeof(write_data[0])) == (num_data * sizeof(write_data[0]))) {
+            ae->settle_frame= write_data[1] + config.skip_frames; /// histograms of the earlier frames are for the old settings
+        } else { /// nothing was applied
+            record.exposure= get_imageParamsThat(port, P_EXPOS, record.frame);
+            for (color=0; color < 4; color++) record.gains[color]= get_imageParamsThat(port, gain_pars[color], record.frame);
+            record.changed= 0;
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record.tv_sec=  ts.tv_sec;
+    record.tv_usec= ts.tv_nsec / 1000;
+    pthread_mutex_lock(&ae->lock);
+    ae->log[ae->log_count & (AUTOEXP_LOG_SIZE - 1)]= record;
+    ae->log_count++;
+    pthread_mutex_unlock(&ae->lock);
+}
+
+/**
+ * @brief Autoexposure thread - waits for histograms of each new frame and runs autoexp_frame() for them.
+ * Uses its own histogram device file and a copy of the histograms, polls G_THIS_FRAME and G_HIST_Y_FRAME/G_HIST_C_FRAME
+ * so it never blocks in the driver and can be stopped even if the sensor stalls. Only the mmap-ed driver data is shared
+ * with the PHP thread
+ * @param arg - sensor port
+ * @return NULL
+ */
+void * autoexp_thread (void * arg) {
+    long port= (long) arg;
+    struct elphel_autoexp_t * ae= &ELPHEL_G(autoexp[port]);
+    struct histogram_stuct_t histogram;
+    struct timespec poll= {0, AUTOEXP_POLL_NSEC};
+    unsigned long this_frame, frame;
+    long index, total_hist_entries, needed, sub_chn;
+    int color, wb, wait_y;
+
+    while (ae->running) {
+        this_frame= ELPHEL_GLOBALPARS(port, G_THIS_FRAME);
+        frame= this_frame - 1; /// histograms are available for the previous frame
+        if ((frame == ae->last_frame) || ((long) (frame - ae->settle_frame) < 0)) {
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        pthread_mutex_lock(&ae->lock);
+        sub_chn= ae->config.sub_chn;
+        color=   ae->config.color;
+        wb=      ae->config.wb;
+        pthread_mutex_unlock(&ae->lock);
+        /// request only histograms the driver already has - lseek() below would block (and autoexp_stop() with it) if the sensor stalls
+        wait_y= !wb && (color == COLOR_Y_NUMBER);
+        if ((long) (ELPHEL_GLOBALPARS(port, (wait_y ? G_HIST_Y_FRAME : G_HIST_C_FRAME) + sub_chn) - frame) < 0) {
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        ae->last_frame= frame;
+        needed= wb ? 0xff0 : (0x110 << color); /// cumulative and percentile tables
+        total_hist_entries= lseek(ae->fd_hist, LSEEK_HIST_SET_CHN + (4 * port) + sub_chn, SEEK_END); /// specify port/sub-channel is needed
+        if (wait_y) lseek(ae->fd_hist, LSEEK_HIST_WAIT_Y, SEEK_END); /// wait for just Y (G1)
+        else        lseek(ae->fd_hist, LSEEK_HIST_WAIT_C, SEEK_END); /// wait for all histograms, not just Y (G1)
+        lseek(ae->fd_hist, LSEEK_HIST_NEEDED + (needed & 0xff0), SEEK_END); /// mask out needed raw (fpga) bits
+        index= lseek(ae->fd_hist, frame, SEEK_SET);
+        if (!ae->running) break; /// stopped while reading
+        if ((index < 0) || (index >= total_hist_entries)) continue; /// too late
+        memcpy(&histogram, &(((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[index]), sizeof(struct histogram_stuct_t));
+        if ((histogram.frame != frame) || ((histogram.valid & needed) != needed)) continue;
+        autoexp_frame (port, ae, &histogram);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Stop the autoexposure thread of the port (if running) and wait for it to finish, release the port lock file
+ * @param port - sensor port (0..3)
+ * @return 0 - stopped, -1 - the loop is not running in this process
+ */
+int autoexp_stop (long port) {
+    struct elphel_autoexp_t * ae= &ELPHEL_G(autoexp[port]);
+    if (!ae->running) return -1;
+    ae->running= 0;
+    pthread_join(ae->thread, NULL);
+    close(ae->fd_hist);
+    ae->fd_hist= -1;
+    if (ftruncate(ae->fd_lock, 0) < 0) {} /// stale pid is harmless, the lock is what matters
+    close(ae->fd_lock); /// releases the flock
+    ae->fd_lock= -1;
+    return 0;
+}
+
+/**
+ * @brief Start native autoexposure (and white balance) control loop for the port in a background thread. If it is already
+ * running - just replace the settings. Each new frame histograms are used to scale exposure so the specified fraction of
+ * pixels is below the specified level, new parameters are written FRAME_DEAFAULT_AHEAD frames ahead
+ * @param port - sensor port (0..3)
+ * @param config (optional) associative array of settings (see struct elphel_autoexp_config_t):
+ * - 'sub_chn' (0), 'color' (COLOR_Y_NUMBER) - histogram to use for exposure
+ * - 'percentile' (0.95), 'level' (0.75) - fraction of pixels that should be below the level
+ * - 'exp_min' (1), 'exp_max' (100000) - exposure limits, P_EXPOS units
+ * - 'overexp_max' (0.01), 'overexp_scale' (0.7) - scale exposure down at least by overexp_scale if the fraction of pixels
+ *   in the highest bin exceeds overexp_max
+ * - 'skip_pmin' (0.03) - ignore smaller relative changes, 'skip_pmax' (0.5) - wait for the next frame before applying larger ones
+ * - 'skip_frames' (1) - frames to skip after applying new settings
+ * - 'wb' (0) - adjust R, GB, B gains so their levels at 'wb_percentile' (0.5) match G, limited to 'wb_min' (0.25)..'wb_max' (4.0) of G gain
+ * The loop lives in the calling process, so it is only available in the CLI SAPI (a daemon script) - web server workers
+ * are recycled and do not share state. Only one process may run the loop of a port (AUTOEXP_LOCK_FILE), elphel_autoexp_stop()
+ * and elphel_autoexp_log() work in that process only.
+ * @return 0 - OK, -1 - error (including not CLI or the port loop is run by another process)
+ */
+PHP_FUNCTION(elphel_autoexp_start)
+{
+    long port;
+    zval *options=NULL;
+    struct elphel_autoexp_config_t config;
+    struct elphel_autoexp_t * ae;
+    char lock_path[64];
+    char pid_text[16];
+    int  pid_len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|a", &port, &options) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    if (strcmp(sapi_module.name, "cli")) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Native autoexposure needs a long-running CLI process, not available in \"%s\" SAPI", sapi_module.name);
+        RETURN_LONG (-1);
+    }
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_LONG (-1); /// open here - the thread should not open files shared with PHP
+    autoexp_config (options? Z_ARRVAL_P(options) : NULL, &config);
+    if ((config.sub_chn < 0) || (config.sub_chn >= MAX_SENSORS) ||
+            (config.percentile <= 0.0) || (config.percentile >= 1.0) || (config.level <= 0.0) || (config.level > 1.0) ||
+            (config.exp_min < 1) || (config.exp_max < config.exp_min) || (config.wb_min <= 0.0) || (config.wb_max < config.wb_min)) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid autoexposure settings");
+        RETURN_LONG (-1);
+    }
+#ifdef DELAY_HISTOGRAMS_INIT
+    if (!ELPHEL_G(histogram_cache)) php_elphel_init_histograms();
+#endif
+    if (!ELPHEL_G(histogram_cache)) RETURN_LONG (-1);
+    ae= &ELPHEL_G(autoexp[port]);
+    pthread_mutex_lock(&ae->lock);
+    ae->config= config;
+    pthread_mutex_unlock(&ae->lock);
+    if (ae->running) RETURN_LONG (0);
+    snprintf(lock_path, sizeof(lock_path), AUTOEXP_LOCK_FILE, (int) port);
+    ae->fd_lock= open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (ae->fd_lock < 0) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open file %s", lock_path);
+        RETURN_LONG (-1);
+    }
+    if (flock(ae->fd_lock, LOCK_EX | LOCK_NB) < 0) {
+        close(ae->fd_lock);
+        ae->fd_lock= -1;
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Autoexposure for port %d is already run by another process (%s)", (int) port, lock_path);
+        RETURN_LONG (-1);
+    }
+    pid_len= snprintf(pid_text, sizeof(pid_text), "%d\n", (int) getpid());
+    if ((ftruncate(ae->fd_lock, 0) < 0) || (pwrite(ae->fd_lock, pid_text, pid_len, 0) != pid_len)) {} /// informational only
+    ae->fd_hist= open(DEV393_PATH(DEV393_HISTOGRAM), O_RDWR);
+    if (ae->fd_hist < 0) {
+        close(ae->fd_lock);
+        ae->fd_lock= -1;
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open file %s", DEV393_PATH(DEV393_HISTOGRAM));
+        RETURN_LONG (-1);
+    }
+    ae->last_frame=    0;
+    ae->settle_frame=  0;
+    ae->pending_scale= 0.0;
+    ae->running=       1;
+    if (pthread_create(&ae->thread, NULL, autoexp_thread, (void *) port)) {
+        ae->running= 0;
+        close(ae->fd_hist);
+        ae->fd_hist= -1;
+        close(ae->fd_lock);
+        ae->fd_lock= -1;
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not start autoexposure thread for port %d", (int) port);
+        RETURN_LONG (-1);
+    }
+    RETURN_LONG (0);
+}
+
+/**
+ * @brief Stop native autoexposure control loop for the port
+ * @param port - sensor port (0..3)
+ * @return 0 - OK, -1 - error or the loop is not run by this process
+ */
+PHP_FUNCTION(elphel_autoexp_stop)
+{
+    long port;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &port) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    RETURN_LONG (autoexp_stop (port));
+}
+
+/**
+ * @brief Read autoexposure log records (last AUTOEXP_LOG_SIZE are kept), only the process running the loop has them
+ * @param port - sensor port (0..3)
+ * @param since (optional) first record number to return (last returned key + 1), default 0 - all available
+ * @return -1 on error, otherwise array indexed by record number, each element is an associative array with 'frame', 'tv_sec',
+ *         'tv_usec', 'n_level', 'overexp', 't_scale', 'exposure', 'gain_r', 'gain_g', 'gain_gb', 'gain_b' and 'changed'
+ *         (see struct elphel_autoexp_log_t)
+ */
+PHP_FUNCTION(elphel_autoexp_log)
+{
+    long port, since=0, seq, first;
+    struct elphel_autoexp_t * ae;
+    struct elphel_autoexp_log_t * record;
+    zval * record_zval;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|l", &port, &since) == FAILURE) {
+        RETURN_LONG (-1);
+    }
+    if ((port <0) || (port >= SENSOR_PORTS))
+        RETURN_LONG (-1);
+    ae= &ELPHEL_G(autoexp[port]);
+    array_init(return_value);
+    pthread_mutex_lock(&ae->lock);
+    first= ae->log_count - AUTOEXP_LOG_SIZE;
+    if (first < 0)     first= 0;
+    if (since > first) first= since;
+    for (seq= first; seq < ae->log_count; seq++) {
+        record= &ae->log[seq & (AUTOEXP_LOG_SIZE - 1)];
+        MAKE_STD_ZVAL(record_zval);
+        array_init(record_zval);
+        add_assoc_long  (record_zval, "frame",    record->frame);
+        add_assoc_long  (record_zval, "tv_sec",   record->tv_sec);
+        add_assoc_long  (record_zval, "tv_usec",  record->tv_usec);
+        add_assoc_double(record_zval, "n_level",  record->n_level);
+        add_assoc_double(record_zval, "overexp",  record->overexp);
+        add_assoc_double(record_zval, "t_scale",  record->t_scale);
+        add_assoc_long  (record_zval, "exposure", record->exposure);
+        add_assoc_long  (record_zval, "gain_r",   record->gains[0]);
+        add_assoc_long  (record_zval, "gain_g",   record->gains[1]);
+        add_assoc_long  (record_zval, "gain_gb",  record->gains[2]);
+        add_assoc_long  (record_zval, "gain_b",   record->gains[3]);
+        add_assoc_long  (record_zval, "changed",  record->changed);
+        add_index_zval(return_value, seq, record_zval);
+    }
+    pthread_mutex_unlock(&ae->lock);
+}
+
+/**
+ * @brief Add cumulative histograms of a frame to the aggregate
+ * @param aggregate - port/sub-channel aggregate
+ * @param cumul_hist - 1024 cumulative histogram values (r, g, gb, b)
+ */
+void hist_aggregate_add (struct elphel_hist_aggregate_t * aggregate, const unsigned long * cumul_hist) {
+    unsigned long * slot;
+    double * sum= aggregate->sum;
+    double alpha= aggregate->alpha;
+    int i;
+    if (aggregate->mode == HIST_AGGREGATE_WINDOW) {
+        slot= &aggregate->ring[(aggregate->frames % aggregate->window) << 10];
+        if (aggregate->frames >= aggregate->window) for (i=0; i < 1024; i++) sum[i] -= slot[i];
+        for (i=0; i < 1024; i++) sum[i] += (slot[i]= cumul_hist[i]);
+    } else if (!aggregate->frames) {
+        for (i=0; i < 1024; i++) sum[i]= cumul_hist[i];
+    } else {
+        for (i=0; i < 1024; i++) sum[i] += alpha * (cumul_hist[i] - sum[i]);
+    }
+    aggregate->frames++;
+}
+
+/**
+ * @brief Add histograms of the frames since the last update (that are still available) to the port/sub-channel aggregate,
+ * up to the previous to the current frame (may wait for it). Cumulative histograms are copied directly from the driver
+ * histogram cache (not through get_histogram_snapshot(), catching up should not evict the snapshots), frames that are no
+ * longer available are counted in aggregate->skipped
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel
+ */
+void hist_aggregate_update (long port, long sub_chn) {
+    struct elphel_hist_aggregate_t * aggregate= &ELPHEL_G(hist_aggregate[port][sub_chn]);
+    struct histogram_stuct_t * hist_cache;
+    unsigned long cumul_hist[1024];
+    unsigned long frame, last_frame= ELPHEL_GLOBALPARS(port, G_THIS_FRAME) - 1;
+    long index, total_hist_entries;
+    aggregate->added=   0;
+    aggregate->skipped= 0;
+    if (aggregate->frames && ((long) (last_frame - aggregate->last_frame) < 0)) hist_aggregate_reset (aggregate); /// frame number was reset
+    frame= aggregate->last_frame + 1;
+    if (aggregate->frames && ((long) (last_frame - frame) >= aggregate->catchup)) aggregate->skipped= last_frame - frame + 1 - aggregate->catchup;
+    if (!aggregate->frames || ((long) (last_frame - frame) >= aggregate->catchup))
+        frame= (last_frame >= (unsigned long) aggregate->catchup) ? (last_frame - aggregate->catchup + 1) : 0;
+#ifdef DELAY_HISTOGRAMS_INIT
+    if (ELPHEL_G(fd_histogram_cache) <0) php_elphel_init_histograms();
+#endif
+    total_hist_entries= lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_SET_CHN + (4 * port) + sub_chn, SEEK_END); /// specify port/sub-channel is needed
+    lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_WAIT_C, SEEK_END);                                          /// wait for all colors (last frame only)
+    lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_NEEDED + 0x0f0, SEEK_END);                                  /// cumulative histograms for all colors
+    for (; (long) (last_frame - frame) >= 0; frame++) {
+        index= lseek(ELPHEL_G(fd_histogram_cache), frame, SEEK_SET);
+        if ((index < 0) || (index >= total_hist_entries)) { /// too late for this frame
+            aggregate->skipped++;
+            continue;
+        }
+        hist_cache= &(((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[index]);
+        if ((hist_cache->frame != frame) || ((hist_cache->valid & 0x0f0) != 0x0f0)) {
+            aggregate->skipped++;
+            continue;
+        }
+        memcpy(cumul_hist, hist_cache->cumul_hist, sizeof(cumul_hist));
+        if (hist_cache->frame != frame) { /// overwritten while copying
+            aggregate->skipped++;
+            continue;
+        }
+        hist_aggregate_add (aggregate, cumul_hist);
+        aggregate->last_frame= frame;
+        aggregate->added++;
     }
-    return value;
 }
 
 /**
- * @brief Get cumulative histogram (fraction of all pixels below specified level)
+ * @brief Clear the aggregated data (sum and window ring), next frame starts a new aggregate
+ * @param aggregate - port/sub-channel aggregate, started
+ */
+void hist_aggregate_reset (struct elphel_hist_aggregate_t * aggregate) {
+    memset(aggregate->sum, 0, 1024 * sizeof(double));
+    if (aggregate->ring) memset(aggregate->ring, 0, aggregate->window * 1024 * sizeof(unsigned long));
+    aggregate->frames=     0;
+    aggregate->last_frame= 0;
+}
+
+/**
+ * @brief Stop aggregation and free the aggregate memory
+ * @param aggregate - port/sub-channel aggregate
+ */
+void hist_aggregate_free (struct elphel_hist_aggregate_t * aggregate) {
+    if (aggregate->sum)  pefree (aggregate->sum, 1);
+    if (aggregate->ring) pefree (aggregate->ring, 1);
+    memset(aggregate, 0, sizeof(struct elphel_hist_aggregate_t));
+}
+
+/**
+ * @brief Start (or restart with the new settings) aggregation of the cumulative histograms of the port/sub-channel over frames.
+ * Frames are added when the aggregate is requested with elphel_histogram_aggregate() (those still in the histogram cache)
  * @param port - sensor port (0..3)
  * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
- * @param color - needed color (0..3)
- * @param level - level (0.0 <=level<1.0) to compare pixel values to (-1 will return -1, error)
- * @param frame (optional) absolute frame number for which histogram is needed. NOTE: If specified in the future - will wait
- *               if frame is not specified - will use lates histogram (previous to current frame)
- * @return -1 if too late (or other errors), otherwise a fraction of pixels (0..1.0) that are below the specified level
+ * @param options (optional) associative array:
+ * - 'mode'   - 'ewma' (default) - exponentially weighted moving average, 'window' - average over the last frames
+ * - 'alpha'  - EWMA weight of the new frame (0.0 < alpha <= 1.0), default 0.25
+ * - 'window' - number of frames to average (1..HIST_AGGREGATE_WINDOW_MAX), default 8. Limited to the number of the driver
+ *   histogram cache entries - older frames can not be read back
+ * @return 0 - OK, -1 - error
  */
-PHP_FUNCTION(elphel_histogram)
+PHP_FUNCTION(elphel_histogram_aggregate_start)
 {
     long port, sub_chn;
-    long frame=-1;
-    long hist_index;
-    double dlevel;
-    long   llevel,total_pixels;
-    unsigned long * hist_cumul;      /// 256 of cumulated histogram values (in pixels)
-    long  hist,color;
-
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llld|l", &port, &sub_chn, &color, &dlevel, &frame ) == FAILURE) {
+    zval *options=NULL;
+    HashTable *options_hash;
+    struct elphel_hist_aggregate_t * aggregate;
+    const char * mode;
+    double alpha;
+    long window, total_hist_entries;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll|a", &port, &sub_chn, &options) == FAILURE) {
         RETURN_LONG (-1);
     }
-    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
     if ((port <0) || (port >= SENSOR_PORTS))
         RETURN_LONG (-1);
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_LONG (-1);
     if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
         RETURN_LONG (-1);
-    if (frame <0) {
-        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+    options_hash= options ? Z_ARRVAL_P(options) : NULL;
+    mode=   get_option_string (options_hash, "mode",   "ewma");
+    alpha=  get_option_double (options_hash, "alpha",  0.25);
+    window= get_option_long   (options_hash, "window", 8);
+    aggregate= &ELPHEL_G(hist_aggregate[port][sub_chn]);
+    hist_aggregate_free (aggregate);
+    if      (!strcmp(mode, "ewma"))   aggregate->mode= HIST_AGGREGATE_EWMA;
+    else if (!strcmp(mode, "window")) aggregate->mode= HIST_AGGREGATE_WINDOW;
+    if (!aggregate->mode || (alpha <= 0.0) || (alpha > 1.0) || (window < 1) || (window > HIST_AGGREGATE_WINDOW_MAX)) {
+        aggregate->mode= 0;
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid histogram aggregation settings");
+        RETURN_LONG (-1);
     }
 #ifdef DELAY_HISTOGRAMS_INIT
-    if (!ELPHEL_G(histogram_cache)) php_elphel_init_histograms();
+    if (ELPHEL_G(fd_histogram_cache) <0) php_elphel_init_histograms();
 #endif
-    if (((hist_index=get_histogram_index (port, sub_chn, color, frame, 0)))<0) RETURN_LONG (-1);
-    llevel=0x10000*dlevel;
-    if      (llevel< -0.5) RETURN_LONG(-1) ; /// if input level was ==-1 - error, don't try
-    if      (llevel<0) llevel=0;
-    else if (llevel>0xffff) llevel=0xffff;
-    ///interpolate
-    hist_cumul= &(((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[hist_index].cumul_hist[color<<8]);
-    total_pixels=  hist_cumul[255];
-    hist=  (llevel>>8)?hist_cumul[(llevel>>8)-1]:0;
-    hist +=((hist_cumul[llevel>>8]-hist)*(llevel & 0xff))>>8;
-    RETURN_DOUBLE(((double) hist)/total_pixels);
+    total_hist_entries= lseek(ELPHEL_G(fd_histogram_cache), LSEEK_HIST_SET_CHN + (4 * port) + sub_chn, SEEK_END);
+    if (total_hist_entries < 1) {
+        aggregate->mode= 0;
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Histograms are not available for port %d, sub-channel %d", (int) port, (int) sub_chn);
+        RETURN_LONG (-1);
+    }
+    if (window > total_hist_entries) window= total_hist_entries;
+    aggregate->alpha=   alpha;
+    aggregate->window=  window;
+    aggregate->catchup= (aggregate->mode == HIST_AGGREGATE_WINDOW) ? window : HIST_AGGREGATE_CATCHUP;
+    if (aggregate->catchup > total_hist_entries) aggregate->catchup= total_hist_entries;
+    aggregate->sum= (double *) pemalloc(1024 * sizeof(double), 1);
+    if (aggregate->mode == HIST_AGGREGATE_WINDOW) aggregate->ring= (unsigned long *) pemalloc(window * 1024 * sizeof(unsigned long), 1);
+    hist_aggregate_reset (aggregate); /// persistent pemalloc() does not return NULL
+    RETURN_LONG (0);
 }
 
 /**
- * @brief Get percentile (reverse cumulative histogram) - level (as a fraction 0..1.0) so that specified fraction of all pixels
- *        are below it
+ * @brief Stop aggregation of the cumulative histograms of the port/sub-channel
  * @param port - sensor port (0..3)
  * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
- * @param color - needed color (0..3)
- * @param fraction - fraction  (0.0 <=fraction<1.0) of all pixels to have value under the output (-1 will return -1, error)
- * @param frame (optional) absolute frame number for which histogram is needed. NOTE: If specified in the future - will wait
- *               if frame is not specified - will use latest histogram (previous to current frame)
- * @return -1 if too late (or other errors), otherwise a level (in the 0.0<1.0 range) so that a specified fraction of all pixels are below it
+ * @return 0 - OK (also if it was not started), -1 - error
  */
-PHP_FUNCTION(elphel_reverse_histogram)
+PHP_FUNCTION(elphel_histogram_aggregate_stop)
 {
     long port, sub_chn;
-    long frame=-1;
-    long hist_index;
-    double fraction;
-    long   frac_pixels,total_pixels, frac_256, delta;
-    unsigned long * hist_cumul;      /// 256 of cumulated histogram values (in pixels)
-    unsigned char * hist_percentile; /// 256 of rounded percentiles (1 byte) - used as a starting point for linear interpolation
-
-    long  perc,perc_frac,color;
-
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "llld|l", &port, &sub_chn, &color, &fraction, &frame ) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll", &port, &sub_chn) == FAILURE) {
         RETURN_LONG (-1);
     }
-    if ((color <0) || (color > 3)) RETURN_LONG (-1); /// wrong color number
-    if ((port <0) || (port >= SENSOR_PORTS))
-        RETURN_LONG (-1);
-    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS))
+    if ((port <0) || (port >= SENSOR_PORTS) || (sub_chn <0) || (sub_chn >= MAX_SENSORS))
         RETURN_LONG (-1);
-    if (frame <0) {
-        frame=ELPHEL_GLOBALPARS(port, G_THIS_FRAME)-1;
+    hist_aggregate_free (&ELPHEL_G(hist_aggregate[port][sub_chn]));
+    RETURN_LONG (0);
+}
+
+/**
+ * @brief return aggregated (see elphel_histogram_aggregate_start()) cumulative histograms as a plain integer array, same
+ * as elphel_histogram_get() with cumulative histogram bits (4..7) in needed. Frames since the previous call are added first,
+ * elphel_histogram_aggregate_stats() reports how many of them were added or missed
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @param color (optional) - color (0..3) for 256 values, -1 (default) - all colors, 1024 values in the order r, g, gb, b
+ * @return NULL - error (aggregation is not started or no frames), otherwise array of the aggregated cumulative histograms (in pixels)
+ */
+PHP_FUNCTION(elphel_histogram_aggregate)
+{
+    long port, sub_chn;
+    long color=-1;
+    struct elphel_hist_aggregate_t * aggregate;
+    double * sum;
+    double scale;
+    int i, first, last;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll|l", &port, &sub_chn, &color) == FAILURE) {
+        RETURN_NULL ();
+    }
+    if ((port <0)    || (port >=   SENSOR_PORTS)) RETURN_NULL ();
+    if (ELPHEL_NEED(port, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL ();
+    if ((sub_chn <0) || (sub_chn >= MAX_SENSORS)) RETURN_NULL ();
+    if (color > 3) RETURN_NULL ();
+    aggregate= &ELPHEL_G(hist_aggregate[port][sub_chn]);
+    if (!aggregate->mode) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Histogram aggregation is not started for port %d, sub-channel %d", (int) port, (int) sub_chn);
+        RETURN_NULL ();
+    }
+    hist_aggregate_update (port, sub_chn);
+    if (!aggregate->frames) RETURN_NULL ();
+    sum= aggregate->sum;
+    scale= 1.0;
+    if (aggregate->mode == HIST_AGGREGATE_WINDOW) scale /= (aggregate->frames < aggregate->window) ? aggregate->frames : aggregate->window;
+    first= (color < 0) ? 0    : (color << 8);
+    last=  (color < 0) ? 1024 : ((color + 1) << 8);
+    array_init(return_value);
+    for (i= first; i < last; i++) add_next_index_long (return_value, (long) (scale * sum[i] + 0.5));
+}
+
+/**
+ * @brief Report the state of the histogram aggregate after the last elphel_histogram_aggregate() call (does not add frames)
+ * @param port - sensor port (0..3)
+ * @param sub_chn - sensor sub-channel (for mux-ed sensors), NC393 initially ignored !
+ * @return NULL - error (aggregation is not started), otherwise associative array:
+ * - 'frames'     - number of frames in the aggregate (for 'window' - in the current window)
+ * - 'added'      - frames added by the last elphel_histogram_aggregate() call
+ * - 'skipped'    - frames before that call that were no longer available and are missing from the aggregate
+ * - 'last_frame' - last frame added
+ */
+PHP_FUNCTION(elphel_histogram_aggregate_stats)
+{
+    long port, sub_chn;
+    struct elphel_hist_aggregate_t * aggregate;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll", &port, &sub_chn) == FAILURE) {
+        RETURN_NULL ();
+    }
+    if ((port <0) || (port >= SENSOR_PORTS) || (sub_chn <0) || (sub_chn >= MAX_SENSORS)) RETURN_NULL ();
+    aggregate= &ELPHEL_G(hist_aggregate[port][sub_chn]);
+    if (!aggregate->mode) RETURN_NULL ();
+    array_init(return_value);
+    add_assoc_long(return_value, "frames",     ((aggregate->mode == HIST_AGGREGATE_WINDOW) && (aggregate->frames > aggregate->window)) ?
+                                               aggregate->window : aggregate->frames);
+    add_assoc_long(return_value, "added",      aggregate->added);
+    add_assoc_long(return_value, "skipped",    aggregate->skipped);
+    add_assoc_long(return_value, "last_frame", aggregate->last_frame);
+}
+
+
+
+/**
+ * @brief Make sure FPGA register window is open for the current elphel.fpga_device/fpga_base/fpga_size settings.
+ * The device (and mmap-ed window) stay open between calls, they are reopened only when the settings change.
+ * If the window can not be mmap-ed (or the file is shorter than the window), registers are accessed with pread()/pwrite()
+ * @return 0 - OK, <0 - -errno
+ */
+int fpga_regs_open (void) {
+    struct elphel_fpga_regs_t * regs= &ELPHEL_G(fpga_regs);
+    const char * device= ELPHEL_G(fpga_device);
+    struct stat dev_stat;
+    void * map;
+    if (!device || !device[0]) return -ENODEV;
+    if ((regs->fd >= 0) && !strcmp(regs->device, device) && (regs->base == ELPHEL_G(fpga_base)) && (regs->size == ELPHEL_G(fpga_size))) return 0;
+    fpga_regs_close();
+    regs->fd= open(device, O_RDWR | O_SYNC);
+    if (regs->fd < 0) return -errno;
+    strncpy(regs->device, device, sizeof(regs->device) - 1);
+    regs->device[sizeof(regs->device) - 1]='\0';
+    regs->base= ELPHEL_G(fpga_base);
+    regs->size= ELPHEL_G(fpga_size);
+#ifndef NC353 /// NC353 /dev/fpgaio is accessed by 32-bit word positions, no mmap
+    /// regular files (stand-in for the device) should cover the whole window, or SIGBUS on access
+    if ((regs->size > 0) && !(regs->base & (getpagesize() - 1)) && (fstat(regs->fd, &dev_stat) == 0) &&
+            (!S_ISREG(dev_stat.st_mode) || (dev_stat.st_size >= (regs->base + regs->size)))) {
+        map= mmap(0, regs->size, PROT_READ | PROT_WRITE, MAP_SHARED, regs->fd, regs->base);
+        if (map != MAP_FAILED) regs->map= (volatile unsigned int *) map;
     }
-#ifdef DELAY_HISTOGRAMS_INIT
-    if (!ELPHEL_G(histogram_cache)) php_elphel_init_histograms();
 #endif
-    if (((hist_index=get_histogram_index (port, sub_chn, color, frame, 1)))<0) RETURN_LONG (-1);
-    ///interpolate
-    hist_cumul= &(((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[hist_index].cumul_hist[color<<8]);
-    hist_percentile=&(((struct histogram_stuct_t *) ELPHEL_G(histogram_cache))[hist_index].percentile[color<<8]);
-    total_pixels=  hist_cumul[255];
-    frac_pixels=total_pixels*fraction;
-    if (fraction < -0.5) RETURN_LONG(-1) ; /// if input level was ==-1 - error, don't try
-    if      (frac_pixels<0) frac_pixels=0;
-    else if (frac_pixels>=total_pixels) frac_pixels=total_pixels-1;
-    frac_256=(1.0/256)*fraction; ///floor()
-    if (frac_256 > 255) frac_256=255;
-    perc=hist_percentile[frac_256];
-    if (perc>0) perc--;                                              /// seems hist_percentile[perc] rounds up, not down
-    while ((perc>0) &&  (hist_cumul[perc] > frac_pixels)) perc--;    /// adjust down  (is that needed at all?)
-    perc++;
-    while ((perc<255) &&  (hist_cumul[perc] <= frac_pixels)) perc++; /// adjust up  (is that needed at all?)
-    perc--;
-    delta=hist_cumul[perc+1] - hist_cumul[perc];
-    if (delta) {
-        perc_frac=((frac_pixels-hist_cumul[perc]) << 8)/delta;
-    } else perc_frac=0;
-    perc_frac += perc << 8;
-    RETURN_DOUBLE((1.0/(1<<16)) * ((double) perc_frac));
+    return 0;
+}
+
+/**
+ * @brief Close FPGA register window
+ */
+void fpga_regs_close (void) {
+    struct elphel_fpga_regs_t * regs= &ELPHEL_G(fpga_regs);
+    if (regs->map) munmap((void *) regs->map, regs->size);
+    if (regs->fd >= 0) close(regs->fd);
+    regs->map=       NULL;
+    regs->fd=        -1;
+    regs->device[0]= '\0';
 }
 
+/**
+ * @brief Read consecutive FPGA registers
+ * @param addr - first register address (32-bit words)
+ * @param count - number of registers
+ * @param data - buffer for count values
+ * @return 0 - OK, <0 - -errno
+ */
+int fpga_regs_read (long addr, long count, unsigned int * data) {
+    struct elphel_fpga_regs_t * regs= &ELPHEL_G(fpga_regs);
+    long i, rslt;
+    rslt= fpga_regs_open();
+    if (rslt < 0) return rslt;
+    if ((addr < 0) || (count < 0) || (count > (LONG_MAX >> 2)) || (addr > (LONG_MAX >> 2))) return -EINVAL;
+    /// same window for mmap and pread()/pwrite() access, no overflow with 32-bit long
+    if ((addr > (regs->size >> 2)) || (count > (regs->size >> 2) - addr)) return -EINVAL;
+    if (regs->map) {
+        for (i=0; i < count; i++) data[i]= regs->map[addr + i];
+        return 0;
+    }
+#ifdef NC353
+    for (i=0; i < count; i++) {
+        rslt= pread(regs->fd, &data[i], 4, regs->base + addr + i); //! 32-bit registers, not bytes
+        if (rslt < 4) return (rslt < 0)? -errno : -EIO;
+    }
+#else
+    rslt= pread(regs->fd, data, count << 2, regs->base + (addr << 2));
+    if (rslt < (count << 2)) return (rslt < 0)? -errno : -EIO;
+#endif
+    return 0;
+}
 
+/**
+ * @brief Write consecutive FPGA registers
+ * @param addr - first register address (32-bit words)
+ * @param count - number of registers
+ * @param data - count values to write
+ * @return 0 - OK, <0 - -errno
+ */
+int fpga_regs_write (long addr, long count, const unsigned int * data) {
+    struct elphel_fpga_regs_t * regs= &ELPHEL_G(fpga_regs);
+    long i, rslt;
+    rslt= fpga_regs_open();
+    if (rslt < 0) return rslt;
+    if ((addr < 0) || (count < 0) || (count > (LONG_MAX >> 2)) || (addr > (LONG_MAX >> 2))) return -EINVAL;
+    /// same window for mmap and pread()/pwrite() access, no overflow with 32-bit long
+    if ((addr > (regs->size >> 2)) || (count > (regs->size >> 2) - addr)) return -EINVAL;
+    if (regs->map) {
+        for (i=0; i < count; i++) regs->map[addr + i]= data[i];
+        return 0;
+    }
+#ifdef NC353
+    for (i=0; i < count; i++) {
+        rslt= pwrite(regs->fd, &data[i], 4, regs->base + addr + i); //! 32-bit registers, not bytes
+        if (rslt < 4) return (rslt < 0)? -errno : -EIO;
+    }
+#else
+    rslt= pwrite(regs->fd, data, count << 2, regs->base + (addr << 2));
+    if (rslt < (count << 2)) return (rslt < 0)? -errno : -EIO;
+#endif
+    return 0;
+}
 
-//! Low-level, direct FPGA read/write
+//! Low-level, direct FPGA read/write (register window is set by elphel.fpga_device, elphel.fpga_base, elphel.fpga_size)
 PHP_FUNCTION(elphel_fpga_read)
 {
-    long addr,data,res;
+    long addr;
+    unsigned int data;
+    int rslt;
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &addr) == FAILURE) {
         RETURN_LONG(-1);
     }
-#ifdef NC353
-    int fd=open("/dev/fpgaio", O_RDONLY);
-    if (fd<0) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not open file %s","/dev/fpgaio");
-        return ;
-    }
-    lseek (fd, addr,SEEK_SET) ; //! 32-bit registers, not bytes
-    res=read(fd,&data,4);
-    close (fd);
-    if (res<4) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not read file %s","/dev/fpgaio");
-        return ;
+    rslt= fpga_regs_read(addr, 1, &data);
+    if (rslt < 0) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not read FPGA register 0x%lx from %s (%d)", addr, ELPHEL_G(fpga_device), rslt);
+        RETURN_LONG(-1);
     }
     RETURN_LONG(data);
-#else
-    php_error_docref(NULL TSRMLS_CC, E_ERROR, "elphel_fpga_read() not implemented");
-    return ;
-//    RETURN_LONG(-1);
-#endif
 }
 
+/**
+ * @return 0 - OK, <0 - -errno
+ */
 PHP_FUNCTION(elphel_fpga_write)
 {
-    long addr,data,res;
+    long addr,data;
+    unsigned int udata;
+    int rslt;
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll", &addr,&data) == FAILURE) {
         RETURN_NULL();
     }
-#ifdef NC353 // Not implemented in NC393 - Add?
-    int fd=open("/dev/fpgaio", O_RDWR);
-    if (fd<0) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not open file %s","/dev/fpgaio");
-        return ;
+    udata= data;
+    rslt= fpga_regs_write(addr, 1, &udata);
+    if (rslt < 0) php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not write FPGA register 0x%lx to %s (%d)", addr, ELPHEL_G(fpga_device), rslt);
+    RETURN_LONG(rslt);
+}
+
+/**
+ * @brief Read block of consecutive FPGA registers (single access to the persistent register window)
+ * @param addr - first register address (32-bit words)
+ * @param count - number of registers to read
+ * @return NULL - error, otherwise array of register values
+ */
+PHP_FUNCTION(elphel_fpga_read_block)
+{
+    long addr, count, i;
+    unsigned int * data;
+    int rslt;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ll", &addr, &count) == FAILURE) {
+        RETURN_NULL();
     }
-    lseek (fd, addr,SEEK_SET) ; //! 32-bit registers, not bytes
-    res=write(fd,&data,4);
-    close (fd);
-    if (res<4) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not write to file %s","/dev/fpgaio");
-        return ;
+    if ((count <= 0) || (count > FPGA_BLOCK_MAX)) RETURN_NULL();
+    data= (unsigned int *) emalloc(count * sizeof(unsigned int));
+    rslt= fpga_regs_read(addr, count, data);
+    if (rslt < 0) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not read %ld FPGA registers at 0x%lx from %s (%d)", count, addr, ELPHEL_G(fpga_device), rslt);
+        efree(data);
+        RETURN_NULL();
     }
-#endif
-    php_error_docref(NULL TSRMLS_CC, E_ERROR, "elphel_fpga_write() not implemented");
-    return ;
-//
-//    RETURN_NULL();
+    array_init(return_value);
+    for (i=0; i < count; i++) add_next_index_long(return_value, data[i]);
+    efree(data);
+}
+
+/**
+ * @brief Write several FPGA registers in the specified order. Runs of consecutive addresses are written with a single access
+ * @param regs - associative array address=>value (addresses in 32-bit words)
+ * @return <0 - -errno of the first failed write, otherwise number of registers written
+ */
+PHP_FUNCTION(elphel_fpga_write_vec)
+{
+    zval *arr, **data;
+    HashTable *arr_hash;
+    HashPosition pointer;
+    char *key;
+    int   key_len;
+    ulong index;
+    unsigned int run[FPGA_WRITE_RUN];
+    long run_addr=0, run_len=0, written=0;
+    int rslt=0;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a", &arr) == FAILURE) {
+        RETURN_NULL();
+    }
+    arr_hash = Z_ARRVAL_P(arr);
+    for(zend_hash_internal_pointer_reset_ex(arr_hash, &pointer);
+            zend_hash_get_current_data_ex(arr_hash, (void**) &data, &pointer) == SUCCESS;
+            zend_hash_move_forward_ex(arr_hash, &pointer)) {
+        if ((zend_hash_get_current_key_ex(arr_hash, &key, &key_len, &index, 0, &pointer) != HASH_KEY_IS_LONG) ||
+                (Z_TYPE_PP(data) != IS_LONG)) {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Register address and value should be integers");
+            continue;
+        }
+        /// flush the run if this register does not continue it (order of writes is preserved)
+        if (run_len && ((index != (run_addr + run_len)) || (run_len >= FPGA_WRITE_RUN))) {
+            rslt= fpga_regs_write(run_addr, run_len, run);
+            if (rslt < 0) break;
+            written+= run_len;
+            run_len= 0;
+        }
+        if (!run_len) run_addr= index;
+        run[run_len++]= Z_LVAL_PP(data);
+    }
+    if ((rslt >= 0) && run_len) {
+        rslt= fpga_regs_write(run_addr, run_len, run);
+        if (rslt >= 0) written+= run_len;
+    }
+    if (rslt < 0) {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not write FPGA registers at 0x%lx to %s (%d)", run_addr, ELPHEL_G(fpga_device), rslt);
+        RETURN_LONG(rslt);
+    }
+    RETURN_LONG(written);
 }
 
 
@@ -2343,11 +5586,13 @@ PHP_FUNCTION(elphel_set_fpga_time) {
     }
     ltime_sec=dtime;
     ltime_usec=(dtime-ltime_sec)*1000000;
+    if (ELPHEL_NEED(0, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     write_data[3]=ltime_sec;
     write_data[5]=ltime_usec;
 
     long rslt=write(ELPHEL_G(fd_fparmsall[0]), write_data, sizeof(write_data)); // does not matter - which port
     if (rslt<0) RETURN_LONG(-errno);
+    ELPHEL_G(fpga_clock).valid=0; /// clock model (elphel_fpga_time_now()) is no longer valid
     dtime=ltime_usec;
     dtime=ltime_sec+0.000001*dtime;
     RETURN_DOUBLE(dtime);
@@ -2357,11 +5602,96 @@ PHP_FUNCTION(elphel_set_fpga_time) {
 PHP_FUNCTION(elphel_get_fpga_time) {
     double dtime;
     long ltime_sec,ltime_usec;
+    if (ELPHEL_NEED(0, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
     lseek((int) ELPHEL_G( fd_fparmsall[0]), LSEEK_GET_FPGA_TIME, SEEK_END );
     dtime= ELPHEL_GLOBALPARS(0, G_MICROSECONDS);
     dtime= ELPHEL_GLOBALPARS(0, G_SECONDS) + 0.000001*dtime;
     RETURN_DOUBLE(dtime);
 }
+
+/**
+ * @brief Read FPGA clock (through the driver) and host clocks around it
+ * @param sample - sample to fill, mono is the middle of the monotonic time interval around the FPGA clock reading
+ */
+void fpga_clock_sample (struct elphel_fpga_sample_t * sample) {
+    struct timespec ts0, ts1, tr;
+    clock_gettime(CLOCK_REALTIME,  &tr);
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    lseek((int) ELPHEL_G( fd_fparmsall[0]), LSEEK_GET_FPGA_TIME, SEEK_END );
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    sample->fpga= ELPHEL_GLOBALPARS(0, G_SECONDS) + 0.000001 * ELPHEL_GLOBALPARS(0, G_MICROSECONDS);
+    sample->mono= 0.5 * ((ts0.tv_sec + 0.000000001 * ts0.tv_nsec) + (ts1.tv_sec + 0.000000001 * ts1.tv_nsec));
+    sample->realtime_offset= (tr.tv_sec + 0.000000001 * tr.tv_nsec) - (ts0.tv_sec + 0.000000001 * ts0.tv_nsec);
+}
+
+/**
+ * @brief Update linear model fpga = fpga0 + rate * (mono - mono0) if it is older than FPGA_CLOCK_REFRESH seconds.
+ * The rate is averaged over refresh intervals, the model restarts if the FPGA clock jumps (was set or re-synchronized),
+ * i.e. the prediction error exceeds FPGA_CLOCK_MAX_ERROR plus FPGA_CLOCK_MAX_DRIFT per second of the span
+ * @param mono - current monotonic time, seconds
+ * @return pointer to the model
+ */
+struct elphel_fpga_clock_t * fpga_clock_model (double mono) {
+    struct elphel_fpga_clock_t * model= &ELPHEL_G(fpga_clock);
+    struct elphel_fpga_sample_t sample;
+    double span, rate, error, max_error;
+    if (model->valid && ((mono - model->ref.mono) < FPGA_CLOCK_REFRESH)) return model;
+    fpga_clock_sample(&sample);
+    if (model->valid) {
+        span=  sample.mono - model->ref.mono;
+        error= sample.fpga - (model->ref.fpga + model->rate * span);
+        max_error= FPGA_CLOCK_MAX_ERROR + FPGA_CLOCK_MAX_DRIFT * span; /// normal drift over the span is not a clock jump
+        if ((error > max_error) || (error < -max_error)) {
+            model->valid=0; /// FPGA clock was changed - restart
+        } else if (span >= FPGA_CLOCK_MIN_SPAN) {
+            rate= (sample.fpga - model->ref.fpga) / span;
+            model->rate= model->num_rates? (FPGA_CLOCK_RATE_ALPHA * rate + (1.0 - FPGA_CLOCK_RATE_ALPHA) * model->rate) : rate;
+            model->num_rates++;
+        }
+    }
+    if (!model->valid) {
+        model->rate=      1.0;
+        model->num_rates= 0;
+        model->valid=     1;
+    }
+    model->ref= sample;
+    return model;
+}
+
+/**
+ * @brief Get current FPGA time from the clock model (no driver calls unless the model needs refreshing)
+ * @return (double) seconds, same scale as elphel_get_fpga_time()
+ */
+PHP_FUNCTION(elphel_fpga_time_now) {
+    double mono;
+    struct elphel_fpga_clock_t * model;
+    if (ELPHEL_NEED(0, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
+    mono= monotonic_seconds();
+    model= fpga_clock_model(mono);
+    RETURN_DOUBLE(model->ref.fpga + model->rate * (mono - model->ref.mono));
+}
+
+/**
+ * @brief Convert FPGA timestamp (i.e. frame timestamp) to host time using the clock model
+ * @param sec - FPGA time, seconds (or fractional seconds if usec is not specified)
+ * @param usec - (optional) FPGA time, microseconds
+ * @param monotonic - (optional) return CLOCK_MONOTONIC time, default false - CLOCK_REALTIME
+ * @return (double) host time, seconds
+ */
+PHP_FUNCTION(elphel_fpga_to_host) {
+    double sec;
+    long usec=0;
+    zend_bool monotonic=0;
+    double mono;
+    struct elphel_fpga_clock_t * model;
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "d|lb", &sec, &usec, &monotonic) == FAILURE) {
+        RETURN_NULL();
+    }
+    if (ELPHEL_NEED(0, ELPHEL_OPEN_FRAMEPARS) < 0) RETURN_NULL();
+    model= fpga_clock_model(monotonic_seconds());
+    mono= model->ref.mono + (sec + 0.000001 * usec - model->ref.fpga) / model->rate;
+    RETURN_DOUBLE(monotonic? mono : (mono + model->ref.realtime_offset));
+}
 #if 0
 static struct framepars_all_t test_structure;
 static void php_elphel_init_globals(zend_elphel_globals *elphel_globals)
@@ -2444,66 +5774,54 @@ static void php_elphel_init_histograms(void){
 
 static void php_elphel_init_globals(zend_elphel_globals *elphel_globals)
 {
-    const char *frameparsPaths[] = { DEV393_PATH(DEV393_FRAMEPARS0), DEV393_PATH(DEV393_FRAMEPARS1),
-                                     DEV393_PATH(DEV393_FRAMEPARS2), DEV393_PATH(DEV393_FRAMEPARS3)};
-    const char *circbufPaths[] =   { DEV393_PATH(DEV393_CIRCBUF0), DEV393_PATH(DEV393_CIRCBUF1),
-                                     DEV393_PATH(DEV393_CIRCBUF2), DEV393_PATH(DEV393_CIRCBUF3)};
-    const char *exifPaths[] =      { DEV393_PATH(DEV393_EXIF0), DEV393_PATH(DEV393_EXIF1),
-                                     DEV393_PATH(DEV393_EXIF2), DEV393_PATH(DEV393_EXIF3)};
-    const char *exifMetaPaths[] =  { DEV393_PATH(DEV393_EXIF_META0), DEV393_PATH(DEV393_EXIF_META1),
-                                     DEV393_PATH(DEV393_EXIF_META2), DEV393_PATH(DEV393_EXIF_META3)};
-//DEV393_PATH(DEV393_CIRCBUF0
     int total_hist_entries;
     int i;
     int port;
-    //! open "/dev/sensorpars" and mmap array - only once
+    elphel_globals->exif_dir_all=       NULL;
+    elphel_globals->exif_dir_all_num=   0;
+    elphel_globals->exif_dir_hash=      NULL;
+    elphel_globals->exif_dir_hash_mask= 0;
+    memset(&elphel_globals->fpga_clock, 0, sizeof(struct elphel_fpga_clock_t));
+    memset(&elphel_globals->fpga_regs, 0, sizeof(struct elphel_fpga_regs_t));
+    memset(elphel_globals->gamma_memo, 0, sizeof(elphel_globals->gamma_memo));
+    memset(elphel_globals->gamma_index_cache, 0, sizeof(elphel_globals->gamma_index_cache));
+    memset(elphel_globals->gamma_inverse, 0, sizeof(elphel_globals->gamma_inverse));
+    elphel_globals->gamma_inverse_clock= 0;
+    memset(elphel_globals->hist_snapshot, 0, sizeof(elphel_globals->hist_snapshot));
+    elphel_globals->hist_snapshot_clock= 0;
+    memset(elphel_globals->hist_aggregate, 0, sizeof(elphel_globals->hist_aggregate));
+    for (port = 0; port < SENSOR_PORTS; port++){
+        memset(&elphel_globals->autoexp[port], 0, sizeof(struct elphel_autoexp_t));
+        elphel_globals->autoexp[port].fd_hist= -1;
+        elphel_globals->autoexp[port].fd_lock= -1;
+        pthread_mutex_init(&elphel_globals->autoexp[port].lock, NULL);
+    }
+    elphel_globals->gamma_memo_clock= 0;
+    elphel_globals->fpga_regs.fd= -1;
+    for (port = 0; port < SENSOR_PORTS; port++){
+        memset(&elphel_globals->metalog[port], 0, sizeof(struct elphel_metalog_t));
+        elphel_globals->metalog[port].fd= -1;
+    }
+    /// device files are opened on the first use (elphel_open_port(), elphel_open_global()) or in MINIT (elphel.preopen_ports)
     for (port = 0; port < SENSOR_PORTS; port++){
+        elphel_globals->opened[port] =       0;
         elphel_globals->frameParsAll[port] = NULL;
         elphel_globals->framePars[port] =    NULL;
         elphel_globals->pastPars[port] =     NULL;
         elphel_globals->funcs2call[port] =   NULL;
-        //DEV393_PATH(DEV393_FRAMEPARS0)
-        elphel_globals->fd_fparmsall[port] = open(frameparsPaths[port], O_RDWR); // "/dev/frameparsall", O_RDWR);
-        if (elphel_globals->fd_fparmsall[port] <0) {
-            php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not open file %s",frameparsPaths[port]);
-            return ;
-        }
-        //! now try to mmap (PROT_WRITE only for writing dependencies - func2call?
-        elphel_globals->frameParsAll[port] = (struct framepars_all_t *) mmap(0, sizeof (struct framepars_all_t) , PROT_READ | PROT_WRITE, MAP_SHARED, elphel_globals->fd_fparmsall[port], 0);
-        if((int)elphel_globals->frameParsAll[port] == -1) {
-            elphel_globals->frameParsAll[port]=NULL;
-            php_error_docref(NULL TSRMLS_CC, E_ERROR, "Error in mmap frameparsall");
-            close (elphel_globals->fd_fparmsall[port]);
-            elphel_globals->fd_fparmsall[port] = -1;
-            return ;
-        }
-        /// Shortcuts to the two sub-structures
-        elphel_globals->framePars[port] =          elphel_globals->frameParsAll[port]->framePars;
-        elphel_globals->pastPars[port] =           elphel_globals->frameParsAll[port]->pastPars;
-        elphel_globals->funcs2call[port]=          elphel_globals->frameParsAll[port]->func2call.pars;
-        elphel_globals->globalPars[port] =         elphel_globals->frameParsAll[port]->globalPars;
-        elphel_globals->multiSensIndex[port] =     elphel_globals->frameParsAll[port]->multiSensIndex;
-        elphel_globals->multiSensRvrsIndex[port] = elphel_globals->frameParsAll[port]->multiSensRvrsIndex; /// not yet used
+        elphel_globals->fd_fparmsall[port] = -1;
+        elphel_globals->ccam_dma_buf[port] = NULL;
+        elphel_globals->ccam_dma_buf_len[port] = 0;
+        elphel_globals->circbuf_rate[port] = 0.0;
+        elphel_globals->fd_circ[port] =      -1;
+        elphel_globals->fd_exif[port] =      -1;
+        elphel_globals->fd_exifmeta[port] =  -1;
     }
-
-    /// (gamma_tables.c) access to gammas
-
+    elphel_globals->opened_global= 0;
     elphel_globals->gamma_cache = NULL;
-    elphel_globals->fd_gamma_cache= open(DEV393_PATH(DEV393_GAMMA), O_RDWR); // "/dev/gamma_cache", O_RDWR);
-    if (elphel_globals->fd_gamma_cache <0) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not open file %s",DEV393_PATH(DEV393_GAMMA));
-        return ;
-    }
-    //! now try to mmap
-    elphel_globals->gamma_cache = (struct gamma_stuct_t *) mmap(0, sizeof (struct gamma_stuct_t) * GAMMA_CACHE_NUMBER , PROT_READ, MAP_SHARED, elphel_globals->fd_gamma_cache, 0);
-    if((int)elphel_globals->gamma_cache == -1) {
-        elphel_globals->gamma_cache=NULL;
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Error in mmap for gamma_cache");
-        close (elphel_globals->fd_gamma_cache);
-        elphel_globals->fd_gamma_cache = -1;
-        return ;
-    }
-    ///debug
+    elphel_globals->fd_gamma_cache= -1;
+    elphel_globals->fd_exifdir = -1;
+    elphel_globals->exif_size=0;
     /// (histogram.c) access to gammas
     elphel_globals->histogram_cache = NULL;
 #ifdef DELAY_HISTOGRAMS_INIT
@@ -2529,65 +5847,153 @@ static void php_elphel_init_globals(zend_elphel_globals *elphel_globals)
         return ;
     }
 #endif
-    //! Now - same for /dev/circbuf
-//    int dbg_i;
-    for (port = 0; port < SENSOR_PORTS; port++){
-        elphel_globals->ccam_dma_buf[port] = NULL;
-        elphel_globals->fd_circ[port]= open(circbufPaths[port], O_RDWR); // "/dev/circbuf", O_RDWR);
-        if (elphel_globals->fd_circ[0] <0) {
-            php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not open file %s",circbufPaths[port]);
-            return ;
-        }
-        elphel_globals->ccam_dma_buf_len[port]=lseek(elphel_globals->fd_circ[port],0,SEEK_END); //size of circbuf
+}
+#endif
 
-        //! now try to mmap
-        elphel_globals->ccam_dma_buf[port] = (unsigned long *) mmap(0,
-                                                                    elphel_globals->ccam_dma_buf_len[port] ,
-                                                                    PROT_READ | PROT_WRITE, MAP_SHARED,
-                                                                    elphel_globals->fd_circ[port],
-                                                                    0);
-        if((int)elphel_globals->ccam_dma_buf[port] == -1) {
-            elphel_globals->ccam_dma_buf[port]=NULL;
-            php_error_docref(NULL TSRMLS_CC, E_ERROR, "Error in mmap circbuf");
-            close (elphel_globals->fd_circ[port]);
-            elphel_globals->fd_circ[port] = -1;
-            return ;
+/**
+ * @brief Open (and mmap) device files of the sensor port subsystems that are not open yet. Called on the first use
+ * (ELPHEL_NEED()) or from MINIT for the ports listed in elphel.preopen_ports
+ * @param port - sensor port (0..3)
+ * @param what - bit mask of ELPHEL_OPEN_FRAMEPARS, ELPHEL_OPEN_CIRCBUF, ELPHEL_OPEN_EXIF
+ * @return 0 - OK, <0 - -errno
+ */
+int elphel_open_port (long port, int what) {
+    static const char *frameparsPaths[] = { DEV393_PATH(DEV393_FRAMEPARS0), DEV393_PATH(DEV393_FRAMEPARS1),
+                                            DEV393_PATH(DEV393_FRAMEPARS2), DEV393_PATH(DEV393_FRAMEPARS3)};
+    static const char *circbufPaths[] =   { DEV393_PATH(DEV393_CIRCBUF0), DEV393_PATH(DEV393_CIRCBUF1),
+                                            DEV393_PATH(DEV393_CIRCBUF2), DEV393_PATH(DEV393_CIRCBUF3)};
+    static const char *exifPaths[] =      { DEV393_PATH(DEV393_EXIF0), DEV393_PATH(DEV393_EXIF1),
+                                            DEV393_PATH(DEV393_EXIF2), DEV393_PATH(DEV393_EXIF3)};
+    static const char *exifMetaPaths[] =  { DEV393_PATH(DEV393_EXIF_META0), DEV393_PATH(DEV393_EXIF_META1),
+                                            DEV393_PATH(DEV393_EXIF_META2), DEV393_PATH(DEV393_EXIF_META3)};
+    int fd, fd_meta, err;
+    long len;
+    void * map;
+    if ((port <0) || (port >= SENSOR_PORTS)) return -EINVAL;
+    what &= ~ELPHEL_G(opened[port]);
+    if (what & ELPHEL_OPEN_FRAMEPARS) {
+        fd= open(frameparsPaths[port], O_RDWR); // "/dev/frameparsall", O_RDWR);
+        if (fd < 0) {
+            err= -errno;
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open file %s",frameparsPaths[port]);
+            return err;
         }
-        /*
-        php_error_docref(NULL TSRMLS_CC, E_WARNING, "%d: mmap=-ed %ld (0x%08lx) bytes to ccam_dma_buf[%d]",
-                __LINE__,elphel_globals->ccam_dma_buf_len[port],elphel_globals->ccam_dma_buf_len[port],port);
-
-        for (dbg_i=0;dbg_i<sizeof(struct interframe_params_t )/4; dbg_i++){
-            php_error_docref(NULL TSRMLS_CC, E_WARNING, "elphel_globals->ccam_dma_buf[%d][%d]=0x%08lx\n",
-                    port,dbg_i,elphel_globals->ccam_dma_buf[port][dbg_i]);
+        //! now try to mmap (PROT_WRITE only for writing dependencies - func2call?
+        map= mmap(0, sizeof (struct framepars_all_t) , PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            err= -errno;
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Error in mmap %s",frameparsPaths[port]);
+            close (fd);
+            return err;
         }
-*/
-
-
-
+        ELPHEL_G(fd_fparmsall[port]) =       fd;
+        ELPHEL_G(frameParsAll[port]) =       (struct framepars_all_t *) map;
+        /// Shortcuts to the two sub-structures
+        ELPHEL_G(framePars[port]) =          ELPHEL_G(frameParsAll[port])->framePars;
+        ELPHEL_G(pastPars[port]) =           ELPHEL_G(frameParsAll[port])->pastPars;
+        ELPHEL_G(funcs2call[port]) =         ELPHEL_G(frameParsAll[port])->func2call.pars;
+        ELPHEL_G(globalPars[port]) =         ELPHEL_G(frameParsAll[port])->globalPars;
+        ELPHEL_G(multiSensIndex[port]) =     ELPHEL_G(frameParsAll[port])->multiSensIndex;
+        ELPHEL_G(multiSensRvrsIndex[port]) = ELPHEL_G(frameParsAll[port])->multiSensRvrsIndex; /// not yet used
+        ELPHEL_G(opened[port]) |= ELPHEL_OPEN_FRAMEPARS;
+    }
+    if (what & ELPHEL_OPEN_CIRCBUF) {
+        fd= open(circbufPaths[port], O_RDWR); // "/dev/circbuf", O_RDWR);
+        if (fd < 0) {
+            err= -errno;
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open file %s",circbufPaths[port]);
+            return err;
+        }
+        len= lseek(fd, 0, SEEK_END); //size of circbuf
+        map= mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if ((len <= 0) || (map == MAP_FAILED)) {
+            err= (len <= 0)? -EINVAL : -errno;
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Error in mmap %s",circbufPaths[port]);
+            close (fd);
+            return err;
+        }
+        ELPHEL_G(fd_circ[port]) =          fd;
+        ELPHEL_G(ccam_dma_buf[port]) =     (unsigned long *) map;
+        ELPHEL_G(ccam_dma_buf_len[port]) = len;
+        ELPHEL_G(opened[port]) |= ELPHEL_OPEN_CIRCBUF;
+    }
+    if (what & ELPHEL_OPEN_EXIF) {
+        fd= open(exifPaths[port],O_RDONLY); // EXIF_DEV_NAME, O_RDONLY);
+        if (fd < 0) {
+            err= -errno;
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open file %s",exifPaths[port]);
+            return err;
+        }
+        fd_meta= open(exifMetaPaths[port], O_RDWR);
+        if (fd_meta < 0) {
+            err= -errno;
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open file %s",exifMetaPaths[port]);
+            close (fd);
+            return err;
+        }
+        ELPHEL_G(fd_exif[port]) =     fd;
+        ELPHEL_G(fd_exifmeta[port]) = fd_meta;
+        ELPHEL_G(opened[port]) |= ELPHEL_OPEN_EXIF;
     }
+    return 0;
+}
 
-    for (port = 0; port < SENSOR_PORTS; port++){
-        elphel_globals->fd_exif[port] = open(exifPaths[port],O_RDONLY); // EXIF_DEV_NAME, O_RDONLY);
-        if (elphel_globals->fd_exif[port] <0) {
-            php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not open file %s",exifPaths[port]);
-            return ;
+/**
+ * @brief Open (and mmap) device files shared by all ports that are not open yet
+ * @param what - bit mask of ELPHEL_OPEN_GAMMA, ELPHEL_OPEN_EXIFDIR
+ * @return 0 - OK, <0 - -errno
+ */
+int elphel_open_global (int what) {
+    int fd, err;
+    void * map;
+    what &= ~ELPHEL_G(opened_global);
+    if (what & ELPHEL_OPEN_GAMMA) {
+        /// (gamma_tables.c) access to gammas
+        fd= open(DEV393_PATH(DEV393_GAMMA), O_RDWR); // "/dev/gamma_cache", O_RDWR);
+        if (fd < 0) {
+            err= -errno;
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open file %s",DEV393_PATH(DEV393_GAMMA));
+            return err;
         }
-        elphel_globals->fd_exifmeta[port] = open(exifMetaPaths[port], O_RDWR);
-        if (elphel_globals->fd_exifmeta[port] <0) {
-            php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not open file %s",exifMetaPaths[port]);
-            return ;
+        map= mmap(0, sizeof (struct gamma_stuct_t) * GAMMA_CACHE_NUMBER , PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            err= -errno;
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Error in mmap for gamma_cache");
+            close (fd);
+            return err;
         }
+        ELPHEL_G(fd_gamma_cache)= fd;
+        ELPHEL_G(gamma_cache)=    (struct gamma_stuct_t *) map;
+        ELPHEL_G(opened_global) |= ELPHEL_OPEN_GAMMA;
+    }
+    if (what & ELPHEL_OPEN_EXIFDIR) {
+        fd= open(DEV393_PATH(DEV393_EXIF_METADIR), O_RDONLY);
+        if (fd < 0) {
+            err= -errno;
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can not open file %s",DEV393_PATH(DEV393_EXIF_METADIR));
+            return err;
+        }
+        ELPHEL_G(fd_exifdir)= fd;
+        ELPHEL_G(exif_size)=  0;
+        ELPHEL_G(opened_global) |= ELPHEL_OPEN_EXIFDIR;
     }
-    elphel_globals->fd_exifdir = open(DEV393_PATH(DEV393_EXIF_METADIR), O_RDONLY);
-    if (elphel_globals->fd_exifdir <0) {
-        php_error_docref(NULL TSRMLS_CC, E_ERROR, "Can not open file %s",DEV393_PATH(DEV393_EXIF_METADIR));
-        return ;
-    }
-    elphel_globals->exif_size=0;
-//    php_error_docref(NULL TSRMLS_CC, E_WARNING, "%d: elphel_globals->exif_size= 0x%x\n",  __LINE__,elphel_globals->exif_size);
+    return 0;
+}
+
+/**
+ * @brief Open all subsystems of the ports listed in elphel.preopen_ports ("0,2", "all"), and the global ones if any port is listed
+ */
+void elphel_preopen (void) {
+    const char * ports= ELPHEL_G(preopen_ports);
+    int port, mask=0;
+    if (!ports || !ports[0]) return;
+    if (!strcasecmp(ports, "all")) mask= (1 << SENSOR_PORTS) - 1;
+    else for (; *ports; ports++) {
+        if ((*ports >= '0') && (*ports < ('0' + SENSOR_PORTS))) mask |= 1 << (*ports - '0');
+    }
+    for (port = 0; port < SENSOR_PORTS; port++) if (mask & (1 << port)) elphel_open_port(port, ELPHEL_OPEN_PORT_ALL);
+    if (mask) elphel_open_global(ELPHEL_OPEN_GLOBAL_ALL);
 }
-#endif
 
 PHP_RINIT_FUNCTION(elphel)
 {
@@ -2612,7 +6018,8 @@ PHP_MINIT_FUNCTION(elphel)
     char full_constant_name[256];
 
     //! here initialize "ELPHEL_*" constants
-    REGISTER_INI_ENTRIES(); // not used yet
+    REGISTER_INI_ENTRIES();
+    elphel_preopen(); /// other device files are opened on the first use
     for (i=0;i< (sizeof(pname_arr)/sizeof(pname_arr[0])); i++) {
         if (strlen(pname_arr[i].name)>(sizeof(full_constant_name)-8)) return FAILURE;
         sprintf (full_constant_name,"ELPHEL_%s",pname_arr[i].name);
@@ -2641,8 +6048,9 @@ PHP_MINIT_FUNCTION(elphel)
 
 PHP_MSHUTDOWN_FUNCTION(elphel)
 {
-    int port;
+    int port, i;
     UNREGISTER_INI_ENTRIES();
+    for (port = 0; port < SENSOR_PORTS; port++) autoexp_stop (port); /// threads use mmap-ed data and fd_fparmsall
     for (port = 0; port < SENSOR_PORTS; port++){
         if (ELPHEL_G(fd_fparmsall[port])>=0)       close (ELPHEL_G(fd_fparmsall[port]));
         if (ELPHEL_G(fd_circ[port])>=0)            close (ELPHEL_G(fd_circ[port]));
@@ -2652,6 +6060,12 @@ PHP_MSHUTDOWN_FUNCTION(elphel)
     if (ELPHEL_G(fd_exifdir)>=0)         close (ELPHEL_G(fd_exifdir));
     if (ELPHEL_G(fd_gamma_cache)>=0)     close (ELPHEL_G(fd_gamma_cache));
     if (ELPHEL_G(fd_histogram_cache)>=0) close (ELPHEL_G(fd_histogram_cache));
+    for (port = 0; port < SENSOR_PORTS; port++) metalog_close(&ELPHEL_G(metalog[port]));
+    fpga_regs_close();
+    if (ELPHEL_G(exif_dir_all))          pefree (ELPHEL_G(exif_dir_all), 1);
+    if (ELPHEL_G(exif_dir_hash))         pefree (ELPHEL_G(exif_dir_hash), 1);
+    for (i = 0; i < GAMMA_INVERSE_NUMBER; i++) if (ELPHEL_G(gamma_inverse[i]).table) free (ELPHEL_G(gamma_inverse[i]).table);
+    for (port = 0; port < SENSOR_PORTS; port++) for (i = 0; i < MAX_SENSORS; i++) hist_aggregate_free (&ELPHEL_G(hist_aggregate[port][i]));
     return SUCCESS;
 }
 
@@ -14,18 +14,279 @@
 //#include <autoexp.h>
 //#include <elphel/x393_devices.h>
 
+#define METALOG_MAGIC        "ELPHMLOG"
+#define METALOG_VERSION      1
+#define METALOG_GROW_RECORDS 4096 /// metadata log file grows by this number of records
+#define METALOG_COLUMNS      20   /// columns returned by elphel_metalog_query()
+#define METALOG_FLAG_FRAME   0x01 /// frame number is known (from Exif)
+#define METALOG_FLAG_PARS    0x02 /// exposure and gains are valid (frame was still in pastPars)
+#define METALOG_FLAG_GPS     0x04 /// latitude, longitude and altitude are valid
+
+/// Header of the metadata log file (elphel_metalog_*()), followed by records
+struct elphel_metalog_header_t {
+    char          magic[8];     ///< METALOG_MAGIC
+    unsigned int  version;      ///< METALOG_VERSION
+    unsigned int  header_size;  ///< records start at this offset
+    unsigned int  record_size;  ///< sizeof(struct elphel_metalog_record_t)
+    unsigned int  port;         ///< sensor port
+    unsigned int  num_records;  ///< number of complete records, incremented after the record is written
+    unsigned int  sorted_records; ///< leading records with increasing frame numbers and timestamps (binary search), the rest is scanned
+    unsigned int  reserved[8];
+};
+
+/// Metadata log record (one per compressed frame), native byte order
+struct elphel_metalog_record_t {
+    unsigned int  frame;           ///< absolute frame number (from Exif)
+    unsigned int  timestamp_sec;
+    unsigned int  timestamp_usec;
+    unsigned int  circbuf_pointer;
+    unsigned int  frame_length;    ///< compressed data length
+    unsigned int  quality2;
+    unsigned int  hash32_r;        ///< gamma table hashes
+    unsigned int  hash32_g;
+    unsigned int  hash32_gb;
+    unsigned int  hash32_b;
+    unsigned int  exposure;        ///< P_EXPOS from pastPars
+    unsigned int  gain_r;          ///< P_GAINR .. P_GAINGB from pastPars
+    unsigned int  gain_g;
+    unsigned int  gain_b;
+    unsigned int  gain_gb;
+    unsigned int  flags;           ///< METALOG_FLAG_*
+    double        latitude;
+    double        longitude;
+    double        altitude;
+};
+
+/// Open metadata log (mmap-ed append-only file)
+struct elphel_metalog_t {
+    int                              fd;           ///< -1 - not open
+    long                             port;
+    struct elphel_metalog_header_t * header;       ///< mmap-ed file, NULL - not open
+    struct elphel_metalog_record_t * records;
+    long                             map_size;
+    long                             capacity;     ///< records that fit in the current file size
+    long                             next_pointer; ///< circbuf pointer of the next frame to log (elphel_metalog_update())
+    long                             last_pointer; ///< last logged frame, to avoid duplicates
+    unsigned char *                  page;         ///< Exif page buffer (persistent)
+    long                             page_size;
+};
+
+#define FPGA_CLOCK_REFRESH    10.0   /// refresh FPGA clock model after this time, seconds
+#define FPGA_CLOCK_MIN_SPAN   1.0    /// minimal interval between samples to update the clock rate, seconds
+#define FPGA_CLOCK_MAX_ERROR  0.001  /// restart the model if prediction is off by more than this (clock was set), seconds
+#define FPGA_CLOCK_MAX_DRIFT  0.0002 /// plus this much per second since the last sample (oscillator drift and rate error, 200 ppm)
+#define FPGA_CLOCK_RATE_ALPHA 0.25   /// weight of the new rate measurement in the running average
+
+/// FPGA and host clocks read at (nearly) the same time
+struct elphel_fpga_sample_t {
+    double fpga;            ///< FPGA time, seconds
+    double mono;            ///< CLOCK_MONOTONIC, seconds
+    double realtime_offset; ///< CLOCK_REALTIME - CLOCK_MONOTONIC, seconds
+};
+
+/// Linear model of the FPGA clock: fpga = ref.fpga + rate * (mono - ref.mono)
+struct elphel_fpga_clock_t {
+    int                         valid;
+    long                        num_rates; ///< number of rate measurements averaged
+    double                      rate;      ///< FPGA seconds per monotonic second (1.0 + drift)
+    struct elphel_fpga_sample_t ref;       ///< last sample
+};
+
+#define GAMMA_MEMO_SIZE 16 /// number of gamma tables memoized by gamma_memo_table()
+#define GAMMA_VECTOR_LANES 4    /// floats in gamma_v4sf
+#define GAMMA_ROUND_MARGIN 0.05 /// gamma_calc_vector() uses pow() when closer to the rounding threshold (LSB)
+typedef float gamma_v4sf __attribute__ ((vector_size (16)));
+typedef int   gamma_v4si __attribute__ ((vector_size (16)));
+
+/// Gamma table calculated by gamma_calc() for hash16 (see gamma_memo_table())
+struct elphel_gamma_memo_t {
+    int            hash16;
+    unsigned long  used;       ///< value of gamma_memo_clock when last used, 0 - empty
+    unsigned short table[257];
+};
+
+#define GAMMA_INDEX_CACHE_SIZE 16 /// number of remembered hash32 -> gamma cache index (power of 2)
+#define GAMMA_INDEX_HASH(hash32) (((((unsigned int) (hash32)) * 2654435761U) >> 16) & (GAMMA_INDEX_CACHE_SIZE - 1))
+
+#ifndef GAMMA_VALID_MASK
+#define GAMMA_VALID_MASK 1 /// gamma_stuct_t.valid bit: direct table is valid
+#endif
+
+/// Gamma cache index resolved for hash32 by gamma_frame_index()
+struct elphel_gamma_index_t {
+    unsigned long hash32;
+    int           index;   ///< gamma cache index, 0 - empty
+};
+
+#define GAMMA_INVERSE_NUMBER (SENSOR_PORTS * 4) /// inverse gamma tables kept in a shared LRU (128KB each, allocated on use) - room for all ports/colors
+
+/// Full resolution inverse of a gamma table (see gamma_inverse_table())
+struct elphel_gamma_inverse_t {
+    unsigned long    hash32;
+    unsigned long    used;        ///< value of gamma_inverse_clock when last used, 0 - empty
+    unsigned short   direct[257]; ///< direct table the inverse was built from
+    unsigned short * table;       ///< [65536] sensor level for each gamma converter output level (malloc(), kept until MSHUTDOWN)
+};
+
+#define HIST_SNAPSHOT_NUMBER 8 /// number of histogram snapshots kept by get_histogram_snapshot()
+
+/// Copy of the histogram cache entry for (port, sub_chn, hist.frame) (see get_histogram_snapshot())
+struct elphel_hist_snapshot_t {
+    long                     port;
+    long                     sub_chn;
+    unsigned long            used;  ///< value of hist_snapshot_clock when last used, 0 - empty
+    struct histogram_stuct_t hist;
+};
+
+/// Statistics of one color histogram (see histogram_stats()), levels are in the 0.0..1.0 range
+struct elphel_hist_stats_t {
+    long   count;        ///< number of pixels
+    double mean;         ///< mean level
+    double variance;     ///< variance of the level
+    double median;       ///< level with half of the pixels below it
+    double clipped_low;  ///< fraction of pixels in the lowest bin
+    double clipped_high; ///< fraction of pixels in the highest bin
+    double entropy;      ///< entropy of the histogram, bits
+    double center;       ///< mean level of the pixels not in the lowest and highest bins (center of mass without clipped pixels)
+};
+
+#define AUTOEXP_LOG_SIZE    256     /// records in the autoexposure log ring (power of 2)
+#define AUTOEXP_POLL_NSEC   2000000 /// autoexposure thread sleep while waiting for the next frame
+#define AUTOEXP_LOCK_FILE   "/var/run/elphel_autoexp_%d.pid" /// locked by the process running the port loop (contains its pid)
+#define AUTOEXP_CHANGED_EXPOS 0x01  /// elphel_autoexp_log_t.changed: exposure written, bits 1..4 - gains R, G, GB, B
+#define AUTOEXP_SCALE_MAX   8.0     /// maximal exposure change in one step (up or down)
+
+/// Autoexposure/white balance settings (elphel_autoexp_start() $config), modeled on autoexp_t
+struct elphel_autoexp_config_t {
+    long   sub_chn;       ///< sensor sub-channel
+    long   color;         ///< color used for exposure (0..3), default COLOR_Y_NUMBER
+    double percentile;    ///< fraction of pixels (s_percent) ...
+    double level;         ///< ... that should be below this level (s_index), 0.0..1.0
+    long   exp_min;       ///< minimal exposure (P_EXPOS units)
+    long   exp_max;       ///< maximal exposure (P_EXPOS units)
+    double overexp_max;   ///< maximal fraction of pixels in the highest bin
+    double overexp_scale; ///< exposure scale to use when overexp_max is exceeded
+    double skip_pmin;     ///< do not apply relative changes smaller than this
+    double skip_pmax;     ///< wait one frame to confirm relative changes larger than this
+    long   skip_frames;   ///< frames to skip after the new settings are applied (in addition to FRAME_DEAFAULT_AHEAD)
+    long   wb;            ///< adjust white balance (gains of R, GB, B relative to G)
+    double wb_percentile; ///< fraction of pixels to compare color levels at
+    double wb_min;        ///< minimal gain relative to G gain
+    double wb_max;        ///< maximal gain relative to G gain
+};
+
+/// Autoexposure log record (elphel_autoexp_log()), modeled on autoexp_log_t
+struct elphel_autoexp_log_t {
+    unsigned long frame;    ///< frame the histograms were taken from
+    unsigned long tv_sec;   ///< time of the record
+    unsigned long tv_usec;
+    double        n_level;  ///< measured level for the requested percentile (s_percent)
+    double        overexp;  ///< measured fraction of pixels in the highest bin
+    double        t_scale;  ///< calculated exposure scale
+    unsigned long exposure; ///< exposure after the correction
+    unsigned long gains[4]; ///< R, G, GB, B gains after the correction
+    int           changed;  ///< AUTOEXP_CHANGED_* bits of the written parameters
+};
+
+/// Per-port autoexposure control loop (elphel_autoexp_start())
+struct elphel_autoexp_t {
+    pthread_t       thread;
+    pthread_mutex_t lock;          ///< protects config and log
+    volatile int    running;       ///< thread is started, cleared to stop it
+    int             fd_hist;       ///< own histogram device file (driver lseek state is per file)
+    int             fd_lock;       ///< AUTOEXP_LOCK_FILE held (flock) while running, one loop per port across processes
+    struct elphel_autoexp_config_t config;
+    unsigned long   last_frame;    ///< last frame processed
+    unsigned long   settle_frame;  ///< do not process frames before this one (new settings are not applied yet)
+    double          pending_scale; ///< large exposure change waiting for confirmation, 0 - none
+    long            log_count;     ///< total number of records written to log
+    struct elphel_autoexp_log_t log[AUTOEXP_LOG_SIZE];
+};
+
+#define HIST_AGGREGATE_EWMA        1  /// elphel_hist_aggregate_t.mode: exponentially weighted moving average
+#define HIST_AGGREGATE_WINDOW      2  /// elphel_hist_aggregate_t.mode: average over the last frames
+#define HIST_AGGREGATE_WINDOW_MAX  64 /// maximal window, frames
+#define HIST_AGGREGATE_CATCHUP     8  /// maximal number of past frames added to EWMA at once
+
+/// Temporal aggregate of the cumulative histograms of one port/sub-channel (elphel_histogram_aggregate_start())
+struct elphel_hist_aggregate_t {
+    int             mode;       ///< HIST_AGGREGATE_*, 0 - off
+    double          alpha;      ///< EWMA weight of the new frame
+    long            window;     ///< number of frames in the window (not more than the driver histogram cache entries)
+    long            catchup;    ///< maximal number of past frames added at once
+    unsigned long   last_frame; ///< last frame added
+    long            frames;     ///< number of frames added
+    long            added;      ///< frames added by the last hist_aggregate_update()
+    long            skipped;    ///< frames missed by the last hist_aggregate_update() (no longer in the histogram cache)
+    double        * sum;        ///< [1024] EWMA or sum over window of cumul_hist (persistent)
+    unsigned long * ring;       ///< [window][1024] cumul_hist of the frames in the window (persistent), NULL for EWMA
+};
+
+/// Device subsystems opened on the first use (ELPHEL_NEED(), ELPHEL_NEED_GLOBAL()) or pre-opened for elphel.preopen_ports
+#define ELPHEL_OPEN_FRAMEPARS  0x01 /// per port: frameparsN (framePars, pastPars, globalPars)
+#define ELPHEL_OPEN_CIRCBUF    0x02 /// per port: circbufN
+#define ELPHEL_OPEN_EXIF       0x04 /// per port: exifN and exif_metaN
+#define ELPHEL_OPEN_PORT_ALL   0x07
+#define ELPHEL_OPEN_GAMMA      0x01 /// global: gamma_cache
+#define ELPHEL_OPEN_EXIFDIR    0x02 /// global: Exif metadir
+#define ELPHEL_OPEN_GLOBAL_ALL 0x03
+#define PREOPEN_PORTS_DEFAULT  ""   /// elphel.preopen_ports - comma-separated list of ports or "all"
+
+#ifdef NC353
+#define FPGA_DEVICE_DEFAULT "/dev/fpgaio"
+#define FPGA_BASE_DEFAULT   "0"
+#else
+#define FPGA_DEVICE_DEFAULT "/dev/mem"
+#define FPGA_BASE_DEFAULT   "0x40000000" /// MAXI0 register space, register address is in 32-bit words
+#endif
+#define FPGA_SIZE_DEFAULT   "0x10000"    /// register window size, bytes
+#define FPGA_BLOCK_MAX      0x10000      /// maximal number of registers in elphel_fpga_read_block()
+#define FPGA_WRITE_RUN      256          /// maximal number of consecutive registers written at once by elphel_fpga_write_vec()
+
+/// Persistent FPGA register window (elphel_fpga_*() register access)
+struct elphel_fpga_regs_t {
+    int                     fd;                 ///< -1 - not open
+    volatile unsigned int  * map;               ///< mmap-ed window, NULL - use pread()/pwrite()
+    char                    device[MAXPATHLEN]; ///< device (or file) that is open
+    long                    base;               ///< window offset in the device, bytes
+    long                    size;               ///< window size, bytes
+};
+
 ZEND_BEGIN_MODULE_GLOBALS(elphel)
 int fd_exif[SENSOR_PORTS];
 int fd_exifdir;
 int fd_exifmeta[SENSOR_PORTS];
 int exif_size; // to see if verify exif directory has changed
 struct exif_dir_table_t exif_dir[ExifKmlNumber] ;  //! store locations of the fields needed for KML generations in the Exif block
+struct exif_dir_table_t * exif_dir_all;  //! whole Exif directory (persistent), rebuilt with exif_dir when exif_size changes
+int exif_dir_all_num;                    //! number of entries in exif_dir_all
+unsigned short * exif_dir_hash;          //! ltag hash of exif_dir_all (entry index + 1, 0 - empty)
+unsigned int exif_dir_hash_mask;         //! hash size - 1
+struct elphel_metalog_t metalog[SENSOR_PORTS]; //! metadata logs opened by elphel_metalog_open()
+struct elphel_fpga_clock_t fpga_clock;         //! FPGA clock model (elphel_fpga_time_now(), elphel_fpga_to_host())
+struct elphel_fpga_regs_t fpga_regs;           //! FPGA register window
+struct elphel_gamma_memo_t gamma_memo[GAMMA_MEMO_SIZE]; //! calculated gamma tables (elphel_gamma_add())
+unsigned long gamma_memo_clock;                //! LRU counter for gamma_memo
+struct elphel_gamma_index_t gamma_index_cache[GAMMA_INDEX_CACHE_SIZE]; //! hash32 -> gamma cache index (gamma_frame_index())
+struct elphel_gamma_inverse_t gamma_inverse[GAMMA_INVERSE_NUMBER];     //! full resolution inverse gamma tables
+unsigned long gamma_inverse_clock;             //! LRU counter for gamma_inverse
+struct elphel_hist_snapshot_t hist_snapshot[HIST_SNAPSHOT_NUMBER]; //! recently retrieved histograms (get_histogram_snapshot())
+unsigned long hist_snapshot_clock;             //! LRU counter for hist_snapshot
+struct elphel_autoexp_t autoexp[SENSOR_PORTS]; //! native autoexposure control loops
+struct elphel_hist_aggregate_t hist_aggregate[SENSOR_PORTS][MAX_SENSORS]; //! temporal histogram aggregates
+int    opened[SENSOR_PORTS];                   //! ELPHEL_OPEN_* bits of the port subsystems that are open
+int    opened_global;                          //! ELPHEL_OPEN_GAMMA, ELPHEL_OPEN_EXIFDIR if open
+char * preopen_ports;                          //! elphel.preopen_ports - ports to open in MINIT
+char * fpga_device;                            //! elphel.fpga_device - device to access FPGA registers
+long   fpga_base;                              //! elphel.fpga_base - register window offset in fpga_device, bytes
+long   fpga_size;                              //! elphel.fpga_size - register window size, bytes
 
 
 /// (circbuf.c) access to /dev/circbuf (mmap, lseek)
 int             fd_circ[SENSOR_PORTS];
 unsigned long * ccam_dma_buf[SENSOR_PORTS];
 unsigned long   ccam_dma_buf_len[SENSOR_PORTS]; // in bytes
+double          circbuf_rate[SENSOR_PORTS];     // average compressor output, bytes per second (elphel_circbuf_status)
 //struct framepars_t *framePars;
 
 /// (framepars.c) access to /dev/frameparsall (write, lseek, mmap)
@@ -63,6 +324,132 @@ ZEND_END_MODULE_GLOBALS(elphel)
 #else
 #define ELPHEL_G(v) (elphel_globals.v)
 #endif
+/// Open port/global subsystems if they are not open yet, 0 - OK, <0 - -errno (warning is issued). Port should be valid
+#define ELPHEL_NEED(port, what)  (((ELPHEL_G(opened[port]) & (what)) == (what))? 0 : elphel_open_port((port), (what)))
+#define ELPHEL_NEED_GLOBAL(what) (((ELPHEL_G(opened_global) & (what)) == (what))? 0 : elphel_open_global(what))
+
+/// Column mask for elphel_get_interframe_meta_batch(), bit number is the column index
+#define INTERFRAME_META_WIDTH        0x01
+#define INTERFRAME_META_HEIGHT       0x02
+#define INTERFRAME_META_QUALITY2     0x04
+#define INTERFRAME_META_COLOR        0x08
+#define INTERFRAME_META_FRAME_LENGTH 0x10
+#define INTERFRAME_META_META_INDEX   0x20
+#define INTERFRAME_META_TIMESTAMP    0x40 /// timestamp_sec and timestamp_usec (next bit)
+#define INTERFRAME_META_ALL          0x7f
+#define INTERFRAME_META_COLUMNS      8
+
+#define EXIF_DIR_INITIAL_ENTRIES 128 /// initial size of the buffer for the Exif directory, grows if needed
+#define EXIF_DIR_MIN_HASH        256 /// minimal size of the Exif directory hash (power of 2)
+#define EXIF_DIR_HASH(ltag, mask) (((((unsigned int) (ltag)) * 2654435761U) >> 16) & (mask))
+
+#ifndef JPEG_HEADER_MAXSIZE
+#define JPEG_HEADER_MAXSIZE 0x300 /// maximal size of the JPEG header generated by the driver
+#endif
+#define RECORD_ALIGN       4096       /// alignment of the recorder writes (and O_DIRECT block size)
+#define RECORD_BUFFER_SIZE 0x100000   /// default recorder write buffer size
+#define RECORD_SEGMENT_MAX (((LONG_MAX > 0xffffffffUL) ? 0xffffffffUL : LONG_MAX) & ~(RECORD_ALIGN - 1)) /// maximal segment size (index offsets are 32-bit)
+#define RECORD_POLL_NSEC   2000000    /// recorder sleep while waiting for the next frame
+#define RECORD_FRAME_TIMEOUT 10.0     /// default "frame_timeout" - stop if no new frames for this time, seconds
+#define CIRCBUF_STATUS_MAX_FRAMES 4096 /// limit of the frames walked by elphel_circbuf_status()
+#define CIRCBUF_RATE_FRAMES       8    /// number of recent frames to measure the fill rate when the reader is not behind
+#define CIRCBUF_RATE_ALPHA        0.25 /// weight of the new fill rate measurement in the running average
+#define MJPEG_BOUNDARY     "ElphelMJPEGBoundary" /// multipart boundary used by elphel_mjpeg_stream()
+
+/// Complete JPEG file for a frame in the circbuf (see get_jpeg_frame())
+struct elphel_jpeg_frame_t {
+    struct interframe_params_t frame_params;
+    long          frame_length;                  ///< compressed data length in the circbuf
+    long          length;                        ///< total JPEG file length
+    int           num_chunks;
+    struct iovec  chunks[6];                     ///< SOI, Exif, header, data, wrapped data, EOI
+    unsigned char head[JPEG_HEADER_MAXSIZE];
+};
+
+/// Fields decoded by decode_exif_elphel(), bits of elphel_exif_elphel_t.present
+#define EXIF_ELPHEL_DESCRIPTION  0x0001
+#define EXIF_ELPHEL_FRAME_NUMBER 0x0002
+#define EXIF_ELPHEL_FRAME_PAGE   0x0004
+#define EXIF_ELPHEL_ORIENTATION  0x0008
+#define EXIF_ELPHEL_DATE_TIME    0x0010
+#define EXIF_ELPHEL_EXPOSURE     0x0020
+#define EXIF_ELPHEL_MAKER_NOTE   0x0040
+#define EXIF_ELPHEL_GPS_MODE     0x0080
+#define EXIF_ELPHEL_GPS_DATE     0x0100
+#define EXIF_ELPHEL_GPS_TIME     0x0200
+#define EXIF_ELPHEL_LONGITUDE    0x0400
+#define EXIF_ELPHEL_LATITUDE     0x0800
+#define EXIF_ELPHEL_ALTITUDE     0x1000
+#define EXIF_ELPHEL_HEADING      0x2000
+#define EXIF_ELPHEL_ROLL         0x4000
+#define EXIF_ELPHEL_PITCH        0x8000
+#define EXIF_ELPHEL_ALL          0xffff
+#define EXIF_ELPHEL_COLUMNS      16     /// column index in elphel_get_exif_batch() is the bit number
+#define EXIF_ELPHEL_GPS_FIX      0x10000 /// not a field: GPS measure mode is 2D/3D and longitude/latitude are valid numbers
+
+/// Exif fields used by the Elphel cameras, decoded from a single Exif page
+struct elphel_exif_elphel_t {
+    unsigned long present;                 ///< bit mask of the decoded fields (EXIF_ELPHEL_*)
+    char          image_description[256];
+    long          frame_number;
+    long          frame_page;
+    long          orientation;
+    char          date_time_original[28];  ///< "YYYY:MM:DD HH:MM:SS.ssssss"
+    double        exposure;                ///< seconds
+    unsigned long maker_note[16];
+    char          gps_measure_mode[2];
+    char          gps_date[11];            ///< "YYYY:MM:DD"
+    int           gps_hours;
+    int           gps_minutes;
+    double        gps_seconds;
+    double        longitude;               ///< degrees, negative - West
+    double        latitude;                ///< degrees, negative - South
+    double        altitude;                ///< meters
+    double        heading;                 ///< magnetic compass direction, degrees
+    double        roll;
+    double        pitch;
+};
+
+#define EXIF_WRITE_MAX_IOV 64 /// maximal number of fields merged into one write by elphel_set_exif_fields()
+
+#define EXIF_MAX_IFDS    8   /// IFD0, IFD1, Exif and GPS sub-IFDs are used
+#define EXIF_MAX_ENTRIES 256 /// maximal number of IFD entries parsed from the Exif page
+#define EXIF_TYPED_PAIRS 1   /// elphel_get_exif_typed() flag: return rationals as [numerator, denominator]
+
+/// TIFF IFD entry found in the Exif page (parse_exif_ifds())
+struct elphel_exif_entry_t {
+    unsigned int  tag;
+    unsigned int  type;   ///< TIFF type (1 - BYTE ... 12 - DOUBLE)
+    unsigned long count;
+    unsigned long data;   ///< data location in the Exif page (same as exif_dir_table_t.dst)
+    unsigned long len;    ///< data length, bytes
+};
+
+/// Pending write of one Exif field (elphel_set_exif_fields())
+struct elphel_exif_write_t {
+    unsigned long src;  ///< field location in the Exif meta data (fd_exifmeta)
+    const char *  data;
+    long          len;  ///< already truncated to the field length
+};
+
+#define TRACK_BUFFER_SIZE  0x4000 /// output buffer of elphel_export_track()
+#define TRACK_LINE_MAXSIZE 0x200  /// maximal length of a single track_printf() output
+
+/// Output buffer of elphel_export_track()
+struct elphel_track_out_t {
+    int  len;
+    char buf[TRACK_BUFFER_SIZE];
+};
+
+/// Record in the index file written by elphel_record()
+struct elphel_record_index_t {
+    unsigned int segment;         ///< segment number (1-based, as in the file name)
+    unsigned int offset;          ///< frame offset in the segment file
+    unsigned int length;          ///< JPEG file length
+    unsigned int timestamp_sec;   ///< frame timestamp, seconds
+    unsigned int timestamp_usec;  ///< frame timestamp, microseconds
+    unsigned int circbuf_pointer; ///< frame pointer in the circbuf
+};
 
 #define PHP_ELPHEL_VERSION "2.0"
 #define PHP_ELPHEL_EXTNAME "elphel"
@@ -85,6 +472,8 @@ PHP_FUNCTION(elphel_test);
 PHP_FUNCTION(elphel_get_P_arr);
 PHP_FUNCTION(elphel_set_P_arr);
 PHP_FUNCTION(elphel_gamma_add);
+PHP_FUNCTION(elphel_gamma_add_batch);     /// add several gamma tables
+PHP_FUNCTION(elphel_gamma_calc);          /// calculate gamma table without the driver
 PHP_FUNCTION(elphel_gamma_add_custom);
 PHP_FUNCTION(elphel_gamma_get);
 PHP_FUNCTION(elphel_gamma_get_index);
@@ -103,17 +492,44 @@ PHP_FUNCTION(elphel_compressor_frame);
 PHP_FUNCTION(elphel_reset_sensor);
 PHP_FUNCTION(elphel_set_fpga_time);
 PHP_FUNCTION(elphel_get_fpga_time);
+PHP_FUNCTION(elphel_fpga_time_now);       /// FPGA time from the clock model, without driver calls
+PHP_FUNCTION(elphel_fpga_to_host);        /// convert FPGA timestamp to host (realtime or monotonic) time
 PHP_FUNCTION(elphel_wait_frame);          /// wait for compressed frame in a circular frame buffer - will wait forever if compressor is off
+PHP_FUNCTION(elphel_record);              /// record compressed frames to disk until stop condition is met
+PHP_FUNCTION(elphel_mjpeg_stream);        /// send compressed frames to the client as multipart MJPEG
+PHP_FUNCTION(elphel_metalog_open);        /// start binary metadata log of the compressed frames
+PHP_FUNCTION(elphel_metalog_update);      /// add frames compressed since the last call to the metadata log
+PHP_FUNCTION(elphel_metalog_close);
+PHP_FUNCTION(elphel_metalog_query);       /// read range of the metadata log records as columns
 PHP_FUNCTION(elphel_fpga_read);
 PHP_FUNCTION(elphel_fpga_write);
+PHP_FUNCTION(elphel_fpga_read_block);     /// read consecutive FPGA registers
+PHP_FUNCTION(elphel_fpga_write_vec);      /// write several FPGA registers
 PHP_FUNCTION(elphel_gamma);
+PHP_FUNCTION(elphel_gamma_array);         /// convert array of levels with one gamma table lookup
 PHP_FUNCTION(elphel_reverse_gamma);
 PHP_FUNCTION(elphel_histogram);
 PHP_FUNCTION(elphel_reverse_histogram);
+PHP_FUNCTION(elphel_histogram_query);     /// many cumulative histogram values and percentiles from one histogram
+PHP_FUNCTION(elphel_histogram_stats);     /// per-color statistics of the raw histograms
+PHP_FUNCTION(elphel_autoexp_start);       /// start (or reconfigure) native autoexposure/white balance for the port
+PHP_FUNCTION(elphel_autoexp_stop);
+PHP_FUNCTION(elphel_autoexp_log);         /// read autoexposure log records
+PHP_FUNCTION(elphel_histogram_aggregate_start); /// start (or restart) aggregation of the cumulative histograms over frames
+PHP_FUNCTION(elphel_histogram_aggregate_stop);
+PHP_FUNCTION(elphel_histogram_aggregate);       /// aggregated cumulative histograms
+PHP_FUNCTION(elphel_histogram_aggregate_stats); /// frames added/skipped by the last elphel_histogram_aggregate()
 PHP_FUNCTION(elphel_get_exif_field);
 PHP_FUNCTION(elphel_set_exif_field);
+PHP_FUNCTION(elphel_set_exif_fields);          /// set several Exif fields with as few writes as possible
+PHP_FUNCTION(elphel_get_exif_typed);           /// Exif fields as PHP values of their TIFF types
 PHP_FUNCTION(elphel_get_interframe_meta);
+PHP_FUNCTION(elphel_get_interframe_meta_batch); /// interframe parameters for many frames, as columns
+PHP_FUNCTION(elphel_get_synced_frames);         /// match frames of several ports by timestamps
+PHP_FUNCTION(elphel_circbuf_status);            /// reader lag and time until its frame is overwritten
 PHP_FUNCTION(elphel_get_exif_elphel);
+PHP_FUNCTION(elphel_get_exif_batch);           /// typed Exif fields for many pages, as columns
+PHP_FUNCTION(elphel_export_track);             /// KML/GeoJSON track of the frames in the circbuf
 PHP_FUNCTION(elphel_get_circbuf_pointers);
 PHP_FUNCTION(elphel_update_exif); // force to rebuild directory after Exif format was changed Usually done automatically
 
@@ -126,7 +542,64 @@ extern zend_module_entry elphel_module_entry;
 #define phpext_elphel_ptr &elphel_module_entry
 //static void init_sens();
 int splitConstantName             (char * name);
-int get_histogram_index           (long port, long sub_chn, long color,long frame, long needreverse); /// histogram is availble for previous frame, not for the current one
+struct histogram_stuct_t * get_histogram_snapshot (long port, long sub_chn, long frame, long needed, int wait_y, int * error);
+void histogram_snapshot_error     (long frame, long needed, int error);
+double histogram_level_fraction   (const unsigned long * hist_cumul, double dlevel);
+double histogram_fraction_level   (const unsigned long * hist_cumul, const unsigned char * hist_percentile, double fraction);
+void histogram_query_array        (zval * result, const char * name, HashTable * arr_hash, struct histogram_stuct_t * histogram, long color, int reverse);
+void histogram_stats              (const unsigned long * hist, struct elphel_hist_stats_t * stats);
+void autoexp_config               (HashTable * options, struct elphel_autoexp_config_t * config);
+void autoexp_frame                (long port, struct elphel_autoexp_t * ae, struct histogram_stuct_t * histogram);
+void * autoexp_thread             (void * arg);
+int  autoexp_stop                 (long port);
+void hist_aggregate_add           (struct elphel_hist_aggregate_t * aggregate, const unsigned long * cumul_hist);
+void hist_aggregate_update        (long port, long sub_chn);
+void hist_aggregate_reset         (struct elphel_hist_aggregate_t * aggregate);
+void hist_aggregate_free          (struct elphel_hist_aggregate_t * aggregate);
 unsigned long get_imageParamsThat (int port, int indx, unsigned long frame);
+long get_interframe_meta          (long port, long circbuf_pointer, struct interframe_params_t * frame_params);
+long get_circbuf_frames           (long port, int second, long ** pointers);
+double get_circbuf_fill_rate      (long port);
+long createExifDirectory          (int rebuild);
+long load_exif_dir_all            (void);
+struct exif_dir_table_t * exif_dir_find (unsigned long ltag);
+long read_exif_page               (long port, long exif_page, unsigned char * page, long page_size);
+void decode_exif_elphel           (const unsigned char * page, long page_len, struct elphel_exif_elphel_t * exif);
+void add_assoc_exif_elphel        (zval * arr, const struct elphel_exif_elphel_t * exif);
+int  parse_exif_ifds              (const unsigned char * page, long page_len, struct elphel_exif_entry_t * entries, int max_entries, int * big_endian);
+void exif_entry_to_zval           (zval * value, const unsigned char * page, long page_len, const struct elphel_exif_entry_t * entry, int big_endian, long flags);
+void track_printf                 (struct elphel_track_out_t * out, const char * format, ...);
+void track_xml_escaped            (struct elphel_track_out_t * out, const char * text);
+long get_jpeg_frame               (long port, int fd_head, long circbuf_pointer, unsigned char * exif_buf, long exif_size, struct elphel_jpeg_frame_t * frame);
+void copy_jpeg_frame              (struct elphel_jpeg_frame_t * frame, unsigned char * buf);
+int  open_jpeghead                (long port);
+long get_option_long              (HashTable * options, const char * key, long default_value);
+double get_option_double          (HashTable * options, const char * key, double default_value);
+const char * get_option_string    (HashTable * options, const char * key, const char * default_value);
+double monotonic_seconds          (void);
+void fpga_clock_sample            (struct elphel_fpga_sample_t * sample);
+struct elphel_fpga_clock_t * fpga_clock_model (double mono);
+int  gamma_calc_vector            (double gamma, double black, unsigned short * gtable);
+long gamma_add                    (double gamma, double black, int force);
+int  gamma_frame_index            (long port, long color, long frame, int need_reverse);
+double gamma_direct_level         (const unsigned short * gamma_direct, double sensorLevel);
+long gamma_reverse_full           (const unsigned short * gamma_direct, const unsigned char * gamma_reverse, long lgammaLevel);
+const unsigned short * gamma_inverse_table (int gamma_index, int build);
+double gamma_inverse_level        (const unsigned short * inverse, double gammaLevel);
+double gamma_reverse_level        (const unsigned short * gamma_direct, const unsigned char * gamma_reverse, double gammaLevel);
+long gamma_get_index              (long hash16, long iscale);
+unsigned short * gamma_memo_table (int hash16);
+int  elphel_open_port             (long port, int what);
+int  elphel_open_global           (int what);
+void elphel_preopen               (void);
+int  fpga_regs_open               (void);
+void fpga_regs_close              (void);
+int  fpga_regs_read               (long addr, long count, unsigned int * data);
+int  fpga_regs_write              (long addr, long count, const unsigned int * data);
+int  metalog_map                  (struct elphel_metalog_t * ml, long capacity);
+int  metalog_open                 (struct elphel_metalog_t * ml, const char * path, long port, int append);
+int  metalog_append               (struct elphel_metalog_t * ml, long circbuf_pointer);
+void metalog_add_record           (zval ** columns, const struct elphel_metalog_record_t * record);
+void metalog_close                (struct elphel_metalog_t * ml);
 
 #endif
@@ -0,0 +1,43 @@
+--TEST--
+FPGA register block read / vector write (file-backed register window)
+--SKIPIF--
+<?php if (!extension_loaded("elphel")) print "skip"; ?>
+--INI--
+elphel.fpga_device=/tmp/elphel_test_002.fpga
+elphel.fpga_base=0
+elphel.fpga_size=0x10000
+--FILE--
+<?php
+$dev = ini_get("elphel.fpga_device");
+file_put_contents($dev, str_repeat("\0", 0x10000));
+/* mmap-ed window */
+var_dump(elphel_fpga_write_vec(array(0x10 => 1, 0x11 => 2, 0x12 => 3, 0x20 => 0x12345678)));
+var_dump(elphel_fpga_read_block(0x10, 4));
+var_dump(elphel_fpga_read(0x20));
+clearstatcache();
+$words = unpack("V*", file_get_contents($dev));
+var_dump($words[0x11], $words[0x21]);
+/* settings can not be changed from scripts */
+var_dump(ini_set("elphel.fpga_device", "/dev/mem"));
+var_dump(elphel_fpga_read_block(0x3fff, 2));
+unlink($dev);
+?>
+--EXPECTF--
+int(4)
+array(4) {
+  [0]=>
+  int(1)
+  [1]=>
+  int(2)
+  [2]=>
+  int(3)
+  [3]=>
+  int(0)
+}
+int(305419896)
+int(1)
+int(305419896)
+bool(false)
+
+Warning: elphel_fpga_read_block(): Can not read 2 FPGA registers at 0x3fff from /tmp/elphel_test_002.fpga (%d) in %s on line %d
+NULL
@@ -0,0 +1,36 @@
+--TEST--
+Vector gamma tables match the scalar formula bit for bit
+--SKIPIF--
+<?php if (!extension_loaded("elphel")) print "skip"; ?>
+--FILE--
+<?php
+function gamma_reference($gamma, $black) {
+    $gamma = max(0.13, min(10.0, $gamma));
+    $black256 = $black * 256.0;
+    $k = 1.0 / (256.0 - $black256);
+    $table = array();
+    for ($i = 0; $i < 257; $i++) {
+        $x = max(0.0, $k * ($i - $black256));
+        $table[] = min(0xffff, (int) (0.5 + 65535.0 * pow($x, $gamma)));
+    }
+    return $table;
+}
+$mismatches = 0;
+for ($igamma = 13; $igamma <= 1000; $igamma += 7) {
+    for ($iblack = 0; $iblack < 255; $iblack += 11) {
+        $gamma = 0.01 * $igamma;
+        $black = $iblack / 256.0;
+        $reference = gamma_reference($gamma, $black);
+        if (elphel_gamma_calc($gamma, $black) !== $reference) $mismatches++;
+        if (elphel_gamma_calc($gamma, $black, true) !== $reference) $mismatches++;
+    }
+}
+var_dump($mismatches);
+$table = elphel_gamma_calc(0.57, 0.04);
+var_dump(count($table), $table[0], $table[256]);
+?>
+--EXPECT--
+int(0)
+int(257)
+int(0)
+int(65535)
@@ -0,0 +1,39 @@
+--TEST--
+FPGA register access with pread()/pwrite() (window larger than the file)
+--SKIPIF--
+<?php if (!extension_loaded("elphel")) print "skip"; ?>
+--INI--
+elphel.fpga_device=/tmp/elphel_test_004.fpga
+elphel.fpga_base=0
+elphel.fpga_size=0x20000
+--FILE--
+<?php
+$dev = ini_get("elphel.fpga_device");
+file_put_contents($dev, str_repeat("\0", 0x10000));
+var_dump(elphel_fpga_write_vec(array(0x11 => 2, 0x12 => 3)));
+var_dump(elphel_fpga_write(0x13, 4));
+var_dump(elphel_fpga_read_block(0x11, 3));
+var_dump(elphel_fpga_read_block(0x4000, 1));
+var_dump(elphel_fpga_write(0x8000, 5)); /// outside the window - pwrite() would extend the file
+clearstatcache();
+var_dump(filesize($dev));
+unlink($dev);
+?>
+--EXPECTF--
+int(2)
+int(0)
+array(3) {
+  [0]=>
+  int(2)
+  [1]=>
+  int(3)
+  [2]=>
+  int(4)
+}
+
+Warning: elphel_fpga_read_block(): Can not read 1 FPGA registers at 0x4000 from %s (%d) in %s on line %d
+NULL
+
+Warning: elphel_fpga_write(): Can not write FPGA register 0x8000 to %s (%i) in %s on line %d
+int(%i)
+int(65536)